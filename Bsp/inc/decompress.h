@@ -0,0 +1,51 @@
+#ifndef __DECOMPRESS_H
+#define __DECOMPRESS_H
+
+#include "main.h"
+
+/*
+ * 流式LZSS解压，码流格式与heatshrink一致：
+ *   1 + 8bit                  字面量
+ *   0 + window_bits + lookahead_bits  回溯引用，偏移和长度均按减1编码
+ * 各字段按MSB在前的位序紧密排列，压缩数据可以在任意字节处被分帧截断。
+ * 解压窗口同时作为输出缓冲：每凑满DECOMPRESS_CHUNK_SIZE字节就直接从窗口交给output写flash，
+ * 数据从窗口到flash之间不再额外拷贝。
+ * 主机端可以用 heatshrink -e -w <window_bits> -l <lookahead_bits> 生成码流。
+ */
+
+#define DECOMPRESS_MAX_WINDOW_BITS	15u		// 窗口最大32KB
+#define DECOMPRESS_MIN_WINDOW_BITS	8u
+#define DECOMPRESS_WINDOW_SIZE		(1u << DECOMPRESS_MAX_WINDOW_BITS)	// 窗口缓冲区按最大窗口分配
+#define DECOMPRESS_CHUNK_SIZE		4096u	// 每次写flash的长度，必须是flash字的整数倍且能整除窗口缓冲区
+
+enum decompress_status {
+	DECOMPRESS_SUCCESS = 0,
+	DECOMPRESS_FAIL,
+};
+
+struct decompress_t {
+	uint8_t *window;		// 解压窗口，长度为DECOMPRESS_WINDOW_SIZE
+	uint32_t mask;			// 窗口缓冲区掩码
+	uint8_t window_bits;
+	uint8_t lookahead_bits;
+
+	uint8_t state;			// 当前正在解析的字段
+	uint8_t bit_need;		// 当前字段的位数
+	uint8_t bit_have;		// 当前字段已收到的位数
+	uint32_t bit_acc;		// 当前字段的值
+	uint32_t backref;		// 回溯偏移
+
+	uint32_t out_pos;		// 已解压的总字节数
+	uint32_t out_flushed;	// 已交给output的字节数
+	uint32_t out_limit;		// 解压结果的最大长度
+	void *arg;
+
+	uint8_t (*output)(struct decompress_t *this, uint32_t offset, uint8_t *data, uint32_t len);	// 输出一段解压数据
+	uint8_t (*input)(struct decompress_t *this, uint8_t *data, uint32_t len);	// 输入一段压缩数据
+	uint8_t (*finish)(struct decompress_t *this);	// 输入结束，输出剩余数据
+};
+
+uint8_t decompress_init(struct decompress_t *this, uint8_t *window, uint8_t window_bits, uint8_t lookahead_bits,
+		uint32_t out_limit, uint8_t (*output)(struct decompress_t *this, uint32_t offset, uint8_t *data, uint32_t len), void *arg);
+
+#endif
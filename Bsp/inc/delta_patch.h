@@ -0,0 +1,50 @@
+#ifndef __DELTA_PATCH_H
+#define __DELTA_PATCH_H
+
+#include "main.h"
+
+/*
+ * 流式增量补丁（bsdiff算法）
+ * 码流与mendsley/bsdiff库输出的内部码流一致（不含文件头和bzip2压缩），由若干条记录组成：
+ *   控制字 diff_len, extra_len, seek  各8字节，小端，最高位为符号位
+ *   diff_len字节差分数据     new = old[old_pos] + diff，old_pos随之递增
+ *   extra_len字节新增数据    new = extra
+ *   old_pos += seek
+ * 参考镜像(old)直接从flash地址读取，不占用RAM。
+ * 还原出的数据先存入输出缓冲区，凑满一块再交给output写flash。
+ */
+
+#define DELTA_PATCH_CHUNK_SIZE		4096u	// 输出缓冲区大小，必须是flash字的整数倍
+
+enum delta_patch_status {
+	DELTA_PATCH_SUCCESS = 0,
+	DELTA_PATCH_FAIL,
+};
+
+struct delta_patch_t {
+	const uint8_t *ref;		// 参考镜像
+	uint32_t ref_size;		// 参考镜像长度
+	int64_t ref_pos;		// 当前参考位置，可以被seek移到镜像之外
+
+	uint8_t state;			// 当前正在解析的字段
+	uint8_t ctrl[24];		// 控制字
+	uint32_t ctrl_have;		// 控制字已收到的字节数
+	uint32_t diff_left;		// 本条记录剩余的差分数据长度
+	uint32_t extra_left;	// 本条记录剩余的新增数据长度
+	int64_t seek;			// 本条记录结束后参考位置的偏移
+
+	uint8_t *buf;			// 输出缓冲区，长度为DELTA_PATCH_CHUNK_SIZE
+	uint32_t buf_len;		// 输出缓冲区中的字节数
+	uint32_t out_pos;		// 已还原的总字节数
+	uint32_t out_limit;		// 还原结果的长度
+	void *arg;
+
+	uint8_t (*output)(struct delta_patch_t *this, uint32_t offset, uint8_t *data, uint32_t len);	// 输出一段还原数据
+	uint8_t (*input)(struct delta_patch_t *this, uint8_t *data, uint32_t len);	// 输入一段补丁数据
+	uint8_t (*finish)(struct delta_patch_t *this);	// 补丁结束，输出剩余数据
+};
+
+uint8_t delta_patch_init(struct delta_patch_t *this, const uint8_t *ref, uint32_t ref_size, uint8_t *buf,
+		uint32_t out_limit, uint8_t (*output)(struct delta_patch_t *this, uint32_t offset, uint8_t *data, uint32_t len), void *arg);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef __FEC_H
+#define __FEC_H
+
+#include "main.h"
+
+/*
+ * 系统Reed-Solomon纠删码，GF(256)，本原多项式0x11D，生成元2。
+ * 每个FEC块由k个数据分片和若干校验分片组成，校验分片r（从0开始）为
+ *   parity[r] = sum_j C[r][j] * data[j]，C[r][j] = 1 / ((k + r) ^ j)
+ * 即Cauchy矩阵，任意e个校验行与e个缺失数据列组成的子矩阵均可逆，
+ * 因此收到任意k个分片（数据或校验）就能恢复整个块，k + r 不超过255。
+ * 主机按同样的矩阵编码，校验分片可以按需追加生成，不限于第一轮发送的数量。
+ */
+
+#define FEC_MAX_DATA_SHARDS		32u		// 每块最多的数据分片数，数据分片位图为32位
+#define FEC_MAX_PARITY			8u		// 一次解码最多使用的校验分片数
+
+enum fec_status {
+	FEC_SUCCESS = 0,
+	FEC_FAIL,
+};
+
+struct fec_t {
+	uint32_t k;				// 每块数据分片数
+	uint32_t shard_size;	// 分片长度
+
+	// 恢复缺失的数据分片
+	// data[j]在present的bit j置位时为输入，否则为输出缓冲区
+	// parity为收到的校验分片，rows为其行号，解码时用作暂存区，内容会被改写
+	uint8_t (*decode)(struct fec_t *this, uint8_t **data, uint32_t present,
+			uint8_t **parity, const uint8_t *rows, uint32_t parity_count);
+};
+
+uint8_t fec_init(struct fec_t *this, uint32_t k, uint32_t shard_size);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef __FIRMWARE_CMD_H
+#define __FIRMWARE_CMD_H
+
+#include "main.h"
+#include "firmware_opt.h"
+
+/*
+ * 批量命令：一个FIRMWARE_V2_TYPE_CMD帧的数据段中依次放若干条命令，一次往返完成多步操作。
+ * 每条命令为12字节的struct firmware_cmd_req_t，后跟len字节参数，参数按4字节补齐。
+ * 命令按顺序执行，遇到第一条失败的命令即停止，应答帧中每条已执行的命令对应一条结果：
+ * 4字节的struct firmware_cmd_rsp_t，后跟len字节结果数据，同样按4字节补齐。
+ * 应答帧也是v2帧，type为FIRMWARE_V2_TYPE_CMD，index原样返回请求帧的index，主机据此匹配请求。
+ * 擦除和写入只能针对firmware区域（不含日志区），读取和校验可以针对firmware区域和app区域。
+ * 小改动的升级：主机先用HASH取app区域各扇区的摘要，与新镜像比较后只把不同的扇区
+ * 按相同偏移写入firmware区域，相同的扇区用KEEP标记，COMMIT时这些扇区既不传输也不擦写。
+ * A/B布局下firmware区域是非活动槽（见firmware_slot.h），COMMIT只写激活记录，不支持KEEP。
+ * 命令方式写入的镜像没有清单，FIRMWARE_MANIFEST_REQUIRED置1时WRITE和COMMIT返回ERR_DENIED。
+ * 其他传输方式持有升级会话时只执行只读命令（VERIFY、READ、STATUS、HASH），其余返回ERR_DENIED。
+ * 擦写命令会结束当前的帧传输会话，并作废日志中未完成的接收和复制。
+ */
+
+enum firmware_cmd_op {
+	FIRMWARE_CMD_ERASE = 1,		// 擦除[addr, addr+size)，必须按扇区对齐
+	FIRMWARE_CMD_WRITE,			// 把参数写入addr，addr按flash字对齐
+	FIRMWARE_CMD_VERIFY,		// 计算[addr, addr+size)的CRC32，参数为4字节期望值时比较，结果为实际CRC32
+	FIRMWARE_CMD_READ,			// 读取[addr, addr+size)
+	FIRMWARE_CMD_STATUS,		// 结果为当前的struct firmware_ack_t
+	FIRMWARE_CMD_COMMIT,		// 把firmware区域开头size字节写入app区域，参数为4字节期望CRC32时先校验
+	FIRMWARE_CMD_REBOOT,		// 发出应答后复位
+	FIRMWARE_CMD_HASH,			// 把[addr, addr+size)按块计算摘要，参数为可选的struct firmware_cmd_hash_arg_t，结果为各块摘要依次排列
+	FIRMWARE_CMD_KEEP,			// app区域[addr, addr+size)已与新镜像相同，按扇区对齐，COMMIT时保留不擦写
+};
+
+enum firmware_cmd_status {
+	FIRMWARE_CMD_OK = 0,
+	FIRMWARE_CMD_ERR_FORMAT,	// 命令不完整或未知命令
+	FIRMWARE_CMD_ERR_RANGE,		// 地址或长度越界、未对齐
+	FIRMWARE_CMD_ERR_FLASH,		// 擦除或编程失败
+	FIRMWARE_CMD_ERR_VERIFY,	// CRC32不符
+	FIRMWARE_CMD_ERR_SPACE,		// 应答缓冲区放不下结果
+	FIRMWARE_CMD_ERR_DENIED,	// 当前配置或会话状态不允许执行
+};
+
+struct firmware_cmd_req_t {
+	uint8_t op;				// enum firmware_cmd_op
+	uint8_t reserved;
+	uint16_t len;			// 参数长度
+	uint32_t addr;
+	uint32_t size;
+};
+
+enum firmware_cmd_hash_algo {
+	FIRMWARE_CMD_HASH_SHA256 = 0,	// 每块32字节
+	FIRMWARE_CMD_HASH_CRC32,		// 每块4字节，与VERIFY相同
+};
+
+// HASH命令的参数，不带参数时按扇区计算SHA-256
+struct firmware_cmd_hash_arg_t {
+	uint8_t algo;			// enum firmware_cmd_hash_algo
+	uint8_t reserved[3];
+	uint32_t block;			// 块大小，0表示整个范围只算一个摘要
+};
+
+struct firmware_cmd_rsp_t {
+	uint8_t op;
+	uint8_t status;			// enum firmware_cmd_status
+	uint16_t len;			// 结果数据长度
+};
+
+// 应答缓冲区大小，含v2帧头，限制了一批READ命令能读取的总长
+#define FIRMWARE_CMD_REPLY_SIZE		4096u
+
+struct firmware_cmd_t {
+	struct firmware_opt_t *opt;	// 命令直接操作的firmware_opt
+	uint8_t *reply;				// 应答帧缓冲区
+	uint32_t reply_size;
+	uint8_t reboot;				// 本批命令要求发出应答后复位
+	uint8_t read_only;			// 发送方不持有会话，调用exec前设置，为1时拒绝擦写类命令
+
+	// 执行一个CMD帧，返回应答帧长度，0表示不是有效的CMD帧
+	uint32_t (*exec)(struct firmware_cmd_t *this, uint8_t *frame, uint32_t len);
+};
+
+uint8_t firmware_cmd_init(struct firmware_cmd_t *this, struct firmware_opt_t *opt, uint8_t *reply, uint32_t reply_size);
+// 判断帧是否为CMD帧
+uint8_t firmware_cmd_match(uint8_t *frame, uint32_t len);
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef __FIRMWARE_MANIFEST_H
+#define __FIRMWARE_MANIFEST_H
+
+#include <stddef.h>
+#include "main.h"
+
+/*
+ * 镜像清单：DATA帧按帧序号逐块计算SHA-256作为Merkle树的叶子，
+ *   leaf = SHA256(0x00 || 帧数据段)，node = SHA256(0x01 || left || right)
+ * 树形与RFC 6962一致（左子树取不超过叶子数的最大2的幂）。
+ * 清单头中的根哈希连同镜像参数由ECDSA P-256签名，签名为DER格式，覆盖清单头开头到root的部分。
+ * 清单随后附带全部叶子哈希，bootloader验证签名和根哈希后保存叶子，
+ * 之后每帧到达时单独校验，帧可以任意顺序到达，任何一帧不符立即中止本次升级，不再写flash。
+ * 主机端用tools/fw_manifest.py生成清单。
+ */
+
+#define FIRMWARE_MANIFEST_MAGIC		0x4E414D46u	// "FMAN"
+#define FIRMWARE_HASH_SIZE			32u
+#define FIRMWARE_MANIFEST_SIG_MAX	72u			// P-256签名DER编码的最大长度
+
+enum manifest_status {
+	MANIFEST_SUCCESS = 0,
+	MANIFEST_FAIL,
+};
+
+struct firmware_manifest_t {
+	uint32_t magic;			// FIRMWARE_MANIFEST_MAGIC
+	uint32_t total_byte;	// 与START帧一致
+	uint32_t frame_size;	// 每个叶子对应的数据长度，必须等于协商后的frame_size
+	uint32_t leaf_count;	// 叶子数，即总帧数
+	uint8_t root[FIRMWARE_HASH_SIZE];	// Merkle根
+	uint32_t sig_len;		// 签名长度
+	uint8_t signature[FIRMWARE_MANIFEST_SIG_MAX];
+	uint32_t reserved;
+	// 之后为leaf_count个叶子哈希
+};
+
+// 签名覆盖的长度
+#define FIRMWARE_MANIFEST_SIGNED_SIZE	offsetof(struct firmware_manifest_t, sig_len)
+
+// 校验清单的根哈希和签名，leaf为清单附带的叶子哈希
+uint8_t manifest_verify(const struct firmware_manifest_t *m, const uint8_t *leaf);
+// 普通SHA-256，不带前缀
+void firmware_sha256(const uint8_t *data, uint32_t len, uint8_t *hash);
+// 计算一帧数据的叶子哈希
+void manifest_leaf_hash(const uint8_t *data, uint32_t len, uint8_t *hash);
+
+#endif
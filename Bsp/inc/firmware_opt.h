@@ -1,13 +1,27 @@
 #ifndef __FIRMWARE_OPT_H
 #define __FIRMWARE_OPT_H
 
+#include <stddef.h>
 #include "main.h"
 #include "internal_flash.h"
+#include "flash_engine.h"
+#include "decompress.h"
+#include "delta_patch.h"
+#include "firmware_manifest.h"
+#include "firmware_slot.h"
 
 // 使用内部flash，如果以后添加外部flash，只需要修改这部分代码
-#define sector_erase Internal_Flash_EraseSector
-#define flash_write Internal_Flash_Write
+// 擦写经中断驱动的flash_engine执行，等待期间写flash线程让出CPU
+#define sector_erase flash_engine_erase
+#define flash_write flash_engine_write
+#define sector_erase_async flash_engine_erase_async
+#define flash_wait flash_engine_wait
 #define flash_read Internal_Flash_Read
+#define flash_check Internal_Flash_Check
+#define flash_stream_t Internal_Flash_StreamTypeDef
+#define flash_stream_init Internal_Flash_StreamInit
+#define flash_stream_write Internal_Flash_StreamWrite
+#define flash_stream_flush Internal_Flash_StreamFlush
 
 enum f_opt_status{
 	FIRMWARE_OPT_SUCCESS = 0,
@@ -16,6 +30,7 @@ enum f_opt_status{
 	FIRMWARE_OPT_FAIL,
 };
 
+// v1帧格式，旧工具使用
 struct firmware_trans_protocol_t {
 	uint32_t index;			// 本帧序号
 	uint32_t total_frame;	// 总帧数
@@ -25,21 +40,203 @@ struct firmware_trans_protocol_t {
 	uint16_t crc;
 };
 
-#define IAP_PROTOCOL_BUFFER_SIZE sizeof(struct firmware_trans_protocol_t)
-extern uint8_t iap_protocol_buffer[IAP_PROTOCOL_BUFFER_SIZE];
+/*
+ * v2帧格式：32字节帧头在前，数据段紧随其后，数据段长度在会话开始时协商。
+ * 主机先发送START帧提出frame_size，bootloader在应答中给出实际采用的值，
+ * 之后每个DATA帧除最后一帧外数据段长度都等于frame_size。
+ * crc为CRC32(IEEE 802.3)，覆盖帧头（crc字段按0计算）和数据段有效部分。
+ * v1帧的第一个字段是帧序号，不可能等于FIRMWARE_V2_MAGIC，据此区分两种格式。
+ */
+#define FIRMWARE_V2_MAGIC			0x32565746u	// "FWV2"
+#define FIRMWARE_V2_MAX_FRAME_SIZE	FLASH_SECTOR_SIZE	// 协议允许的最大数据段，一个扇区
+#define FIRMWARE_V2_BUF_FRAME_SIZE	(32u * 1024u)		// 本机接收缓冲区能容纳的最大数据段
 
+enum firmware_v2_type {
+	FIRMWARE_V2_TYPE_START = 1,	// 会话开始，协商frame_size
+	FIRMWARE_V2_TYPE_DATA,		// 数据帧
+	FIRMWARE_V2_TYPE_MANIFEST,	// 镜像清单，START之后、DATA之前发送，见firmware_manifest.h
+	FIRMWARE_V2_TYPE_CMD,		// 批量命令，见firmware_cmd.h，与帧传输会话无关
+};
+
+// 置1后只接受带签名清单的会话，不带清单的v1帧、TFTP、组播等传输方式和批量命令的WRITE/COMMIT都会被拒绝
+#define FIRMWARE_MANIFEST_REQUIRED	0
+
+struct firmware_v2_header_t {
+	uint32_t magic;			// FIRMWARE_V2_MAGIC
+	uint8_t type;			// enum firmware_v2_type
+	uint8_t flags;
+	uint16_t reserved;
+	uint32_t index;			// 本帧序号
+	uint32_t total_frame;	// 总帧数
+	uint32_t total_byte;	// 总字节数
+	uint32_t frame_size;	// START帧中为主机提议值，DATA帧中为协商后的值
+	uint32_t len;			// 本帧数据段有效长度
+	uint32_t crc;			// CRC32
+} __attribute__((aligned(32)));
+
+/*
+ * v2 START帧的数据段为镜像头，描述DATA帧中数据如何还原成写入firmware区域的镜像。
+ * START帧不带数据段时按未压缩镜像处理，image_size等于total_byte。
+ * 两个标志可以同时使用，此时DATA帧为压缩后的补丁。
+ * 压缩镜像和补丁必须按序处理，超前到达的帧会被拒绝，等主机按应答重传。
+ */
+#define FIRMWARE_IMAGE_FLAG_COMPRESSED	0x01u	// DATA帧为LZSS压缩码流，见decompress.h
+#define FIRMWARE_IMAGE_FLAG_DELTA		0x02u	// DATA帧为相对当前app的增量补丁，见delta_patch.h
+#define FIRMWARE_IMAGE_FLAG_IN_ORDER	(FIRMWARE_IMAGE_FLAG_COMPRESSED | FIRMWARE_IMAGE_FLAG_DELTA)
+
+struct firmware_image_header_t {
+	uint32_t flags;				// FIRMWARE_IMAGE_FLAG_xxx
+	uint32_t image_size;		// 还原后的镜像字节数
+	uint8_t window_bits;		// 压缩窗口位数
+	uint8_t lookahead_bits;		// 压缩长度位数
+	uint16_t reserved;
+	uint32_t ref_size;			// 增量补丁的参考镜像长度，从当前app（app_start_addr）开始
+	uint32_t ref_crc;			// 参考镜像的CRC32
+	uint32_t image_crc;			// 还原后镜像的CRC32，0表示不校验；非0时未压缩镜像允许断点续传
+};
+
+// 一个接收缓冲区能容纳v1帧和最大的v2帧
+#define IAP_PROTOCOL_BUFFER_SIZE (sizeof(struct firmware_v2_header_t) + FIRMWARE_V2_BUF_FRAME_SIZE)
+
+#define FIRMWARE_FRAME_DATA_SIZE	1024u											// v1每帧数据段长度，也是v2的最小frame_size
+#define FIRMWARE_MAX_FRAME			(BOOTLOADER_FIRMWARE_DATA_SIZE / FIRMWARE_FRAME_DATA_SIZE)	// firmware区域最多容纳的帧数
+
+// 窗口大小，1为停等模式（只接收严格连续的帧），大于1时主机可以同时发送多帧
+// 应答中的sack位图覆盖累计确认点之后的32帧，窗口不应超过33
+#define FIRMWARE_OPT_WINDOW			16u
+
+#define FIRMWARE_ACK_MAGIC			0x4B434146u	// "FACK"
+
+// 应答帧：累计确认 + 选择确认
+struct firmware_ack_t {
+	uint32_t magic;
+	uint32_t next_index;	// 序号小于next_index的帧均已收到
+	uint32_t sack;			// bit n 置位表示 next_index+1+n 号帧已收到
+	uint32_t window;		// 允许主机同时在途的帧数
+	uint32_t status;		// 最近一帧的处理结果，enum f_opt_status
+	uint32_t frame_size;	// 本会话每帧数据段长度，v2中为协商结果
+};
+
+
+/*
+ * 断点续传日志，位于firmware区域末尾的BOOTLOADER_JOURNAL_SIZE字节中，随firmware区域一起擦除。
+ * 每条记录占一个flash字（32字节），只追加不改写，第一条整条空白的记录之后均为空白。
+ * session为会话描述（帧格式、总字节数、frame_size、镜像头）的CRC32，用于识别是否是同一镜像；
+ * committed为已连续写入flash的帧数，每写入FIRMWARE_JOURNAL_INTERVAL字节追加一条。
+ * 主机重新连接并发送相同的START帧时，bootloader从最后一条有效记录恢复，
+ * START帧应答中的next_index即主机应继续发送的帧序号，之前的帧无需重传，所在的扇区也不再擦除；
+ * 续传点所在扇区的剩余部分有残留数据时，next_index退回到该扇区开头。
+ * 只有镜像头带image_crc的未压缩镜像可以续传，完成后以image_crc校验整个镜像。
+ * 写入app区域时同样以日志保护：开始前追加一条COPYING记录，记下镜像长度、CRC和保留的扇区，
+ * 每处理完一个app扇区再追加一条，committed为已完成的扇区数。复制中掉电时firmware区域的镜像仍在，
+ * 写flash线程启动时从最后一条COPYING记录继续，只重写剩余的扇区，不需要重新传输。
+ * A/B布局下firmware区域是非活动槽，日志在该槽的槽尾，最后一个flash字留给激活记录。
+ */
+#define FIRMWARE_JOURNAL_MAGIC		0x4C4E4A46u	// "FJNL"
+#define FIRMWARE_JOURNAL_INTERVAL	(16u * 1024u)
+#define FIRMWARE_JOURNAL_ENTRIES	(BOOTLOADER_JOURNAL_SIZE / sizeof(struct firmware_journal_t) - FIRMWARE_SLOT_AB)
+
+enum firmware_journal_state {
+	FIRMWARE_JOURNAL_RECEIVING = 1,	// 接收中，committed之前的帧已写入
+	FIRMWARE_JOURNAL_DONE,			// 已写入app区域，不再续传
+	FIRMWARE_JOURNAL_COPYING,		// 正在写入app区域，committed之前的扇区已完成
+};
+
+struct firmware_journal_t {
+	uint32_t magic;			// FIRMWARE_JOURNAL_MAGIC
+	uint32_t session;		// 会话描述的CRC32
+	uint32_t committed;		// 已连续写入的帧数，COPYING记录中为已完成的app扇区数
+	uint32_t state;			// enum firmware_journal_state
+	uint32_t image_size;	// 以下三项只用于COPYING记录：镜像字节数
+	uint32_t image_crc;		// 新镜像的CRC32，keep_sectors中的扇区取自app区域
+	uint32_t keep_sectors;	// 保留不擦写的app扇区
+	uint32_t crc;			// 前7个字的CRC32
+} __attribute__((aligned(32)));
+
+/*
+ * 不带帧格式的传输（如TFTP）直接按字节偏移写入firmware区域，镜像为未压缩的bin文件。
+ * 数据必须按序送入，各段长度任意，不足flash字的部分由写合并流拼接。
+ */
+#define FIRMWARE_OPT_VERSION_STAGE	3u
+
+/*
+ * 按FEC块分片的传输（组播）：镜像按shard_size切成分片，每block_shards个分片为一个FEC块。
+ * 分片即帧，frame_size等于shard_size，帧序号为 block * block_shards + 分片号，
+ * 可以乱序、按块批量写入，最后一个块不足block_shards个分片时缺少的部分不存在。
+ */
+#define FIRMWARE_OPT_VERSION_SHARD	4u
+
+// firmware区域由批量命令直接擦写，见firmware_cmd.h
+#define FIRMWARE_OPT_VERSION_CMD	5u
+
+/*
+ * firmware区域按扇区延迟擦除：会话开始时只处理日志所在的扇区，
+ * 之后每个扇区在第一次写入前检查，已经是空白的不擦除；写入位置接近扇区末尾时
+ * 提前向flash_engine提交下一个扇区的擦除，只擦到镜像所在的扇区为止。
+ * 单bank上擦除期间不能编程，提前量只需覆盖在途的网络缓冲区。
+ * 没有会话、也没有可续传的镜像时，写flash线程在空闲中逐个扇区预先擦除，
+ * 下次升级开始时通常不需要再等待擦除。A/B布局下非活动槽保存上一版本，不在空闲中擦除。
+ */
+#define FIRMWARE_ERASE_AHEAD		(16u * 1024u)	// 写入位置距扇区末尾不足这么多字节时开始擦除下一个扇区
+#define FIRMWARE_ERASE_FLAG(i)		(1u << (i))		// firmware区域第i个扇区擦除完成的事件标志
+#define FIRMWARE_ERASE_ALL			((1u << BOOTLOADER_FIRMWARE_SECTOR_COUNT) - 1u)
+
+struct firmware_shard_info_t {
+	uint32_t total_byte;	// 镜像总字节数
+	uint32_t shard_size;	// 分片长度，flash字的整数倍
+	uint32_t block_shards;	// 每个FEC块的数据分片数
+	uint32_t image_crc;		// 镜像的CRC32，非0时允许断点续传
+};
 
 struct firmware_opt_t {
     uint32_t firm_start_addr;
 	uint32_t firm_current_addr;
 	uint32_t app_start_addr;
+	uint32_t slot_seq;		// A/B布局下firmware区域中的镜像激活时使用的序号
 
-	uint32_t index;	// 帧序号
+	uint32_t version;		// 本次会话使用的帧格式，1或2，FIRMWARE_OPT_VERSION_xxx为其他传输方式，0表示尚未确定
+	uint32_t frame_size;	// 每帧数据段长度，v1固定为1024，v2为协商值
+	uint32_t index;			// 期望的下一帧序号，之前的帧均已收到
+	uint32_t window;		// 窗口大小
+	uint32_t total_frame;	// 本次会话总帧数，收到第一帧后确定
+	uint32_t total_byte;	// 本次会话总字节数
+	uint32_t recv_frame;	// 已收到的帧数
+	uint32_t image_flags;	// 镜像头中的flags
+	uint32_t image_size;	// 还原后的镜像字节数
+	uint32_t image_crc;		// 还原后镜像的CRC32，0表示不校验
+	uint32_t block_shards;	// 分片传输时每个FEC块的分片数
+	uint32_t session;		// 会话描述的CRC32，0表示本会话不记录日志
+	uint32_t journal_slot;	// 下一条日志记录的位置
+	uint32_t journal_committed;	// 最近一条日志记录的committed
+	uint8_t resumed;		// 本会话从日志恢复，未确认的帧可能已部分写入
+	uint8_t manifest;		// 本会话已验证清单，每帧按叶子哈希校验
+	uint32_t keep_sectors;	// app区域中已与新镜像相同的扇区位图，bit0为APP_SECTOR_START，写入app时直接保留
+	uint32_t erase_ready;	// firmware区域中本会话可以直接写入的扇区位图，bit0为firmware区域的第一个扇区
+	uint32_t erase_busy;	// 已提交擦除、尚未确认完成的扇区位图
+	uint32_t erase_limit;	// 本会话写入firmware区域的字节数上限，提前擦除不超出它所在的扇区
+	uint8_t applied;		// 本会话的镜像已写入app区域，firmware区域可以回收
+	struct decompress_t decomp;	// 压缩镜像的解压器
+	struct delta_patch_t patch;	// 增量补丁
+	flash_stream_t stream;	// 按偏移写入时的写合并流，各段长度不必是flash字的整数倍
+	uint32_t recv_bitmap[(FIRMWARE_MAX_FRAME + 31) / 32];	// 已收到帧的位图
+	uint8_t last_status;	// 最近一帧的处理结果
 
 	uint8_t (*recv)(struct firmware_opt_t *this, uint8_t *data, uint32_t len);			// 接收每帧数据并存入firmware区域
-	uint8_t (*write)(struct firmware_opt_t *this);		// 将完整的bin文件从firmware区域写入app区域
+	uint8_t (*write)(struct firmware_opt_t *this);		// 将完整的bin文件从firmware区域写入app区域，A/B布局下改为激活firmware区域所在的槽
+	void (*ack)(struct firmware_opt_t *this, struct firmware_ack_t *ack);				// 生成当前的应答帧
+	uint8_t (*stage)(struct firmware_opt_t *this, uint32_t offset, uint8_t *data, uint32_t len);	// 按偏移写入一段镜像数据
+	uint8_t (*stage_finish)(struct firmware_opt_t *this, uint32_t total_byte);		// 按偏移写入结束，total_byte为镜像总长
+	uint8_t (*shard_open)(struct firmware_opt_t *this, const struct firmware_shard_info_t *info);	// 开始分片传输会话
+	uint8_t (*shard_place)(struct firmware_opt_t *this, uint32_t block, uint8_t *data, uint32_t mask);	// 写入一个FEC块中mask指定的分片
+	uint8_t (*idle)(struct firmware_opt_t *this);		// 空闲时预先擦除firmware区域中的一个扇区，返回1表示本次擦除了扇区
+	uint8_t (*recover)(struct firmware_opt_t *this);	// 启动时继续被掉电中断的app写入，完成返回FIRMWARE_OPT_WRITE_CPLT
 };
 
 uint8_t firmware_opt_init(struct firmware_opt_t *this);
+uint32_t firmware_crc32(uint32_t crc, const uint8_t *buf, uint32_t len);
+// 新镜像开头bytes字节的CRC32放入crc，keep_sectors中的扇区取自app区域；其中有ECC错误时返回FIRMWARE_OPT_FAIL
+uint8_t firmware_image_crc(struct firmware_opt_t *this, uint32_t bytes, uint32_t *crc);
+// firmware区域被直接擦写前调用，日志中未完成的接收或复制作废，不再续传，启动时也不再继续复制
+void firmware_journal_abandon(struct firmware_opt_t *this);
 
 #endif
@@ -0,0 +1,64 @@
+#ifndef __FIRMWARE_SLOT_H
+#define __FIRMWARE_SLOT_H
+
+#include "main.h"
+#include "internal_flash.h"
+
+/*
+ * A/B槽布局：扇区2-4为槽0，扇区5-7为槽1，app在所在的槽中原地运行，升级不再复制镜像。
+ * 每个槽末尾BOOTLOADER_JOURNAL_SIZE字节为槽尾：前面是该槽接收时的断点续传日志，
+ * 最后一个flash字是激活记录。新镜像接收到非活动槽，校验通过后在该槽写入一条
+ * seq比活动槽大1的激活记录即完成切换，不再擦写其他扇区；写入中掉电的记录校验不通过，仍运行原来的槽。
+ * 接收开始时先擦除槽尾所在的扇区，旧记录随之作废，半擦除的槽不会被选中。
+ * 上电时选择记录和镜像都有效、seq最大的槽，把VTOR指向槽首后跳转。
+ * app必须按所在槽的地址链接（每个槽一份链接脚本），镜像不超过BOOTLOADER_FIRMWARE_DATA_SIZE；
+ * 激活前检查向量表中的复位入口落在目标槽内，为另一个槽链接的镜像会被拒绝。
+ * 主机用READ读取两个槽的激活记录，决定发送哪个槽的镜像。
+ * app需要进入bootloader升级时，在FIRMWARE_SLOT_STAY_ADDR写入FIRMWARE_SLOT_STAY_MAGIC
+ * （写后清D-Cache）再软件复位，其他复位都直接启动活动槽。
+ * 置0时保持原来的布局：扇区2-4为firmware区域，接收完成后复制到扇区5-7的app区域。
+ */
+#ifndef FIRMWARE_SLOT_AB
+#define FIRMWARE_SLOT_AB			0
+#endif
+
+#define FIRMWARE_SLOT_COUNT			2u
+#define FIRMWARE_SLOT_SIZE			BOOTLOADER_FIRMWARE_SIZE
+#define FIRMWARE_SLOT_SECTOR_COUNT	BOOTLOADER_FIRMWARE_SECTOR_COUNT
+#define FIRMWARE_SLOT_NONE			0xFFFFFFFFu
+#define FIRMWARE_SLOT_MAGIC			0x544F4C53u	// "SLOT"
+
+// D3 SRAM不在bootloader的链接范围内，软件复位后内容保持
+#define FIRMWARE_SLOT_STAY_ADDR		D3_SRAM_BASE
+#define FIRMWARE_SLOT_STAY_MAGIC	0x59415453u	// "STAY"
+
+enum firmware_slot_status {
+	FIRMWARE_SLOT_SUCCESS = 0,
+	FIRMWARE_SLOT_FAIL,
+};
+
+struct firmware_slot_t {
+	uint32_t magic;			// FIRMWARE_SLOT_MAGIC
+	uint32_t seq;			// 激活序号，两个槽都有效时大的为活动槽
+	uint32_t size;			// 镜像字节数
+	uint32_t image_crc;		// 镜像的CRC32
+	uint32_t reserved[3];
+	uint32_t crc;			// 前7个字的CRC32
+} __attribute__((aligned(32)));
+
+// 槽首地址和激活记录地址
+#define FIRMWARE_SLOT_BASE(slot)	(BOOTLOADER_FIRMWARE_BASE + (slot) * FIRMWARE_SLOT_SIZE)
+#define FIRMWARE_SLOT_RECORD(slot)	(FIRMWARE_SLOT_BASE(slot) + FIRMWARE_SLOT_SIZE - sizeof(struct firmware_slot_t))
+
+// 激活记录的校验值
+uint32_t firmware_slot_crc(const struct firmware_slot_t *rec);
+// 镜像开头的向量表是否属于按base链接的程序：栈顶在RAM中，复位入口在[base, base+size)内
+uint8_t firmware_slot_vector_check(uint32_t base, uint32_t size);
+// 槽中的激活记录、镜像CRC和向量表都有效时取出记录
+uint8_t firmware_slot_check(uint32_t slot, struct firmware_slot_t *rec);
+// 当前的活动槽，没有有效的槽时返回FIRMWARE_SLOT_NONE，rec可以为NULL
+uint32_t firmware_slot_active(struct firmware_slot_t *rec);
+// 在main开头、任何初始化之前调用，按上面的规则启动活动槽，不启动时返回
+void firmware_slot_boot(void);
+
+#endif
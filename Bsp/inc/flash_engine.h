@@ -0,0 +1,71 @@
+#ifndef __FLASH_ENGINE_H
+#define __FLASH_ENGINE_H
+
+#include "main.h"
+#include "tx_api.h"
+#include "internal_flash.h"
+
+/*
+ * 中断驱动的flash擦写引擎。
+ * 线程把擦除和编程请求放入队列后立即返回，由FLASH的EOP和错误中断逐个执行：
+ * 擦除由HAL在中断中连续擦完各扇区，编程每个flash字完成后在中断中编程下一个，
+ * 一个请求完成后紧接着开始队列中的下一个，不需要轮询。
+ * 每个请求完成时在done中置位它的flag，出错的请求同时记入failed，等待方据此取结果。
+ * 擦写期间读同一bank会被挂起，不在cache中的代码和数据要等当前操作完成，
+ * 但调用线程不再空转，其他线程可以运行。
+ */
+
+#define FLASH_ENGINE_QUEUE_SIZE		8u			// 请求队列长度，2的幂
+#define FLASH_ENGINE_FLAG_SYNC		0x80000000u	// flash_engine_erase/flash_engine_write使用的完成标志
+
+enum flash_engine_status {
+	FLASH_ENGINE_SUCCESS = 0,
+	FLASH_ENGINE_FAIL,
+	FLASH_ENGINE_FULL,
+};
+
+enum flash_engine_op {
+	FLASH_ENGINE_ERASE = 0,
+	FLASH_ENGINE_PROGRAM,
+};
+
+struct flash_engine_req_t {
+	uint32_t op;			// enum flash_engine_op
+	uint32_t addr;			// 擦除为起始扇区，编程为目标地址（与Internal_Flash_Write一样要求4字节对齐）
+	const uint8_t *data;	// 编程的源数据，请求完成前必须保持有效
+	uint32_t len;			// 擦除为扇区数，编程为字节数，不足一个flash字的尾部填充0xFF
+	ULONG flag;				// 完成时在done中置位的事件标志
+};
+
+struct flash_engine_t {
+	TX_EVENT_FLAGS_GROUP done;
+	struct flash_engine_req_t queue[FLASH_ENGINE_QUEUE_SIZE];
+	volatile uint32_t head;	// 下一个提交位置，只由线程推进
+	volatile uint32_t tail;	// 正在执行的请求，只由中断推进
+	uint32_t pos;			// 当前编程请求已完成的字节数
+	uint8_t busy;			// 当前请求已交给硬件
+	volatile uint8_t step;	// 中断回调记录的本步结果
+	volatile ULONG failed;	// 出错请求的事件标志
+	uint32_t word[FLASH_NB_32BITWORD_IN_FLASHWORD];	// 尾部或非对齐源数据拼成的flash字
+
+	// 提交一个请求，队列满时返回FLASH_ENGINE_FULL
+	uint8_t (*submit)(struct flash_engine_t *this, const struct flash_engine_req_t *req);
+	// 等待flags对应的请求全部完成，其中任一出错返回FLASH_ENGINE_FAIL
+	uint8_t (*wait)(struct flash_engine_t *this, ULONG flags, ULONG wait_option);
+};
+
+// 在使用前调用一次，之后开启FLASH中断
+uint8_t flash_engine_init(struct flash_engine_t *this);
+// 在FLASH_IRQHandler中于HAL_FLASH_IRQHandler之后调用
+void flash_engine_irq(void);
+
+// 以下两个函数提交请求后阻塞到完成，与Internal_Flash_EraseSector/Internal_Flash_Write参数和返回值相同，
+// 只能由唯一的写flash线程调用
+uint32_t flash_engine_erase(uint32_t StartSector, uint32_t SectorCount);
+uint32_t flash_engine_write(uint32_t Address, uint8_t *Data, uint32_t Length);
+
+// 提交擦除后立即返回，完成时置位flag，之后用flash_engine_wait取结果；引擎未启动时直接擦除
+uint32_t flash_engine_erase_async(uint32_t StartSector, uint32_t SectorCount, ULONG flag);
+uint32_t flash_engine_wait(ULONG flag);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef __FRAME_PARSER_H
+#define __FRAME_PARSER_H
+
+#include <stddef.h>
+#include "main.h"
+#include "firmware_opt.h"
+
+// v1帧在线路上的长度：帧头16字节 + 数据段1024字节 + crc16，不含结构体尾部填充
+#define FIRMWARE_V1_FRAME_SIZE	(offsetof(struct firmware_trans_protocol_t, crc) + sizeof(uint16_t))
+// 判断帧格式所需的最少字节数
+#define FRAME_PARSER_PROBE_SIZE	sizeof(uint32_t)
+
+enum frame_parser_status {
+	FRAME_PARSER_SUCCESS = 0,
+	FRAME_PARSER_FAIL,
+	FRAME_PARSER_STALL,		// on_frame没有换到新的帧缓冲区，输入在此暂停
+};
+
+/*
+ * TCP流式帧重组器
+ * 直接遍历NX_PACKET链中各包的数据区，将字节拷贝拼接到帧缓冲区中，
+ * 帧可以跨越任意多个TCP分段，每凑满一帧回调一次on_frame。
+ * 先收4字节判断是v1还是v2帧，v2帧再收满32字节帧头得到数据段长度。
+ * 每个字节从包数据区拷贝一次到帧缓冲区，帧缓冲区即firmware_opt写flash时的数据源，之后不再拷贝。
+ * 包数据区不能直接作为数据源：帧会跨越分段，flash字也要求32字节对齐。
+ * v2帧头的长度非法时返回FRAME_PARSER_FAIL，并逐字节向后寻找下一个v2帧头，不会卡在坏帧头上。
+ * on_frame交出帧缓冲区后若没有空闲缓冲区，把frame置为NULL并返回FRAME_PARSER_STALL，
+ * 输入随即暂停：feed记下包链中已处理的字节数，调用者保留该包链，设置新的frame后再次feed同一个包链即可继续。
+ * frame_parser_init时frame可以为NULL，第一次输入前再设置。
+ */
+struct frame_parser_t {
+	uint8_t *frame;			// 帧组装缓冲区
+	uint32_t capacity;		// 帧缓冲区大小
+	uint32_t need;			// 当前阶段需要凑满的字节数
+	uint32_t offset;		// 当前帧已组装的字节数
+	uint32_t discard;		// 待丢弃的字节数
+	uint8_t sync;			// 帧头出错后正在重新寻找v2帧头
+	uint32_t skip;			// feed暂停时包链中已处理的字节数，再次feed同一个包链时跳过
+	uint32_t left;			// write暂停时本次输入中未处理的字节数
+	void *arg;				// 回调私有参数
+
+	uint8_t (*on_frame)(struct frame_parser_t *this, uint8_t *frame, uint32_t len);	// 完整帧回调
+	uint8_t (*feed)(struct frame_parser_t *this, NX_PACKET *packet);				// 输入一个数据包链
+	uint8_t (*write)(struct frame_parser_t *this, const uint8_t *data, uint32_t len);	// 输入一段连续数据，用于需要先解码的传输
+	void (*reset)(struct frame_parser_t *this);										// 新连接时丢弃未组装完的帧
+};
+
+uint8_t frame_parser_init(struct frame_parser_t *this, uint8_t *frame, uint32_t capacity,
+		uint8_t (*on_frame)(struct frame_parser_t *this, uint8_t *frame, uint32_t len), void *arg);
+
+#endif
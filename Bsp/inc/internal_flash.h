@@ -27,6 +27,14 @@ extern "C" {
 /* Flash超时值定义 */
 #define FLASH_TIMEOUT_VALUE    50000U /* Flash操作超时时间 */
 
+/* 写合并流：连续写入时缓存不足一个Flash字(32字节)的尾部，凑满后再编程 */
+typedef struct {
+	uint32_t Address;    /* Buffer对应的Flash字地址 */
+	uint32_t Count;      /* Buffer中已有的字节数 */
+	uint32_t Buffer[8];  /* 部分Flash字 */
+	uint32_t (*Program)(uint32_t Address, uint8_t *Data, uint32_t Length);  /* 编程整Flash字的函数 */
+} Internal_Flash_StreamTypeDef;
+
 /* Sector 定义 */
 /* Flash扇区定义 - 每个扇区128KB */
 #define FLASH_SECTOR0_BASE    0x08000000  /* 扇区0起始地址: 0x0800 0000 - 0x0801 FFFF */
@@ -62,6 +70,11 @@ typedef enum {
 #define BOOTLOADER_FIRMWARE_END   (FLASH_SECTOR4_BASE+FLASH_SECTOR_SIZE-1)  /* Bootloader固件区结束地址 */
 #define BOOTLOADER_FIRMWARE_SIZE  (BOOTLOADER_FIRMWARE_END-BOOTLOADER_FIRMWARE_BASE+1)  /* Bootloader固件区大小: 384KB */
 
+/* 固件区末尾保留给升级进度日志，随固件区一起擦除 */
+#define BOOTLOADER_JOURNAL_SIZE   0x1000                       /* 进度日志区大小: 4KB */
+#define BOOTLOADER_JOURNAL_BASE   (BOOTLOADER_FIRMWARE_END-BOOTLOADER_JOURNAL_SIZE+1)  /* 进度日志区起始地址 */
+#define BOOTLOADER_FIRMWARE_DATA_SIZE  (BOOTLOADER_FIRMWARE_SIZE-BOOTLOADER_JOURNAL_SIZE)  /* 固件区可存放镜像的大小: 380KB */
+
 /* 整体区域定义 */
 #define BOOTLOADER_BASE           FLASH_SECTOR0_BASE           /* Bootloader起始地址 */
 #define BOOTLOADER_END            (FLASH_SECTOR4_BASE+FLASH_SECTOR_SIZE-1)  /* Bootloader结束地址 */
@@ -71,6 +84,8 @@ typedef enum {
 #define APP_END                   (FLASH_SECTOR7_BASE+FLASH_SECTOR_SIZE-1)  /* 应用程序结束地址 */
 #define APP_SIZE                  (APP_END-APP_BASE+1)         /* 应用程序大小: 384KB */
 
+/* A/B槽布局(FIRMWARE_SLOT_AB)下固件区和应用区分别为槽0和槽1，app在所在的槽中运行，见firmware_slot.h */
+
 /* sector 定义 */
 #define BOOTLOADER_CODE_SECTOR_START  INTERNAL_FLASH_SECTOR_0  /* Bootloader代码区起始扇区 */
 #define BOOTLOADER_CODE_SECTOR_END    INTERNAL_FLASH_SECTOR_1  /* Bootloader代码区结束扇区 */
@@ -101,6 +116,32 @@ uint32_t Internal_Flash_EraseSector(uint32_t StartSector, uint32_t SectorCount);
   */
 uint32_t Internal_Flash_Write(uint32_t Address, uint8_t *Data, uint32_t Length);
 
+/**
+  * @brief  初始化写合并流
+  * @param  Stream: 写合并流
+  * @param  Address: 流的起始地址 (必须32字节对齐)
+  * @param  Program: 编程整Flash字的函数，如Internal_Flash_Write
+  * @retval 操作状态
+  */
+uint32_t Internal_Flash_StreamInit(Internal_Flash_StreamTypeDef *Stream, uint32_t Address,
+								   uint32_t (*Program)(uint32_t Address, uint8_t *Data, uint32_t Length));
+
+/**
+  * @brief  向写合并流追加数据，不足一个Flash字的尾部暂存到下次追加或冲刷
+  * @param  Stream: 写合并流
+  * @param  Data: 要写入的数据指针 (8位)
+  * @param  Length: 要写入的字节数
+  * @retval 操作状态
+  */
+uint32_t Internal_Flash_StreamWrite(Internal_Flash_StreamTypeDef *Stream, uint8_t *Data, uint32_t Length);
+
+/**
+  * @brief  把写合并流中剩余的部分Flash字填充0xFF后写入
+  * @param  Stream: 写合并流
+  * @retval 操作状态
+  */
+uint32_t Internal_Flash_StreamFlush(Internal_Flash_StreamTypeDef *Stream);
+
 /**
   * @brief  从Flash读取数据
   * @param  Address: 读取的起始地址
@@ -110,6 +151,14 @@ uint32_t Internal_Flash_Write(uint32_t Address, uint8_t *Data, uint32_t Length);
   */
 uint32_t Internal_Flash_Read(uint32_t Address, uint8_t *Buffer, uint32_t Length);
 
+/**
+  * @brief  检查一段Flash能否读取，掉电时写了一半的Flash字有双位ECC错误，直接读取会产生总线错误
+  * @param  Address: 起始地址
+  * @param  Length: 字节数
+  * @retval INTERNAL_FLASH_OK表示可以读取，INTERNAL_FLASH_ERROR表示其中有ECC错误
+  */
+uint32_t Internal_Flash_Check(uint32_t Address, uint32_t Length);
+
 #ifdef __cplusplus
 }
 #endif
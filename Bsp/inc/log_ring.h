@@ -0,0 +1,43 @@
+#ifndef __LOG_RING_H
+#define __LOG_RING_H
+
+#include "main.h"
+
+/*
+ * 多生产者多消费者的无锁日志环（Vyukov有界队列），条目定长。
+ * 每个槽带一个序号：序号等于写位置时可写，等于写位置+1时可读，
+ * 生产者和消费者都只用CAS推进各自的位置，线程在任何时刻被抢占都不会阻塞其他线程。
+ * 环满时生产者先替消费者取走最旧的一条丢弃，仍然抢不到槽（最旧的槽正被写入或读出）
+ * 就丢弃新的一条，两种情况都计入dropped，生产者从不等待。
+ */
+
+#define LOG_RING_DATA_SIZE		120u	// 每条日志的最大长度，超出部分截断
+
+enum log_ring_status {
+	LOG_RING_SUCCESS = 0,
+	LOG_RING_FAIL,
+};
+
+struct log_ring_slot_t {
+	uint32_t seq;
+	uint16_t len;
+	uint8_t data[LOG_RING_DATA_SIZE];
+};
+
+struct log_ring_t {
+	struct log_ring_slot_t *slot;
+	uint32_t mask;			// 槽数-1，槽数为2的幂
+	uint32_t head;			// 下一个写位置
+	uint32_t tail;			// 下一个读位置
+	uint32_t dropped;		// 因环满丢弃的条数
+
+	// 写入一条日志，环满时丢弃最旧的一条，返回LOG_RING_FAIL表示本条被丢弃
+	uint8_t (*push)(struct log_ring_t *this, const uint8_t *data, uint32_t len);
+	// 取出一条日志，返回长度，0表示环为空，buf为NULL时直接丢弃
+	uint32_t (*pop)(struct log_ring_t *this, uint8_t *buf, uint32_t size);
+};
+
+// count必须是2的幂
+uint8_t log_ring_init(struct log_ring_t *this, struct log_ring_slot_t *slot, uint32_t count);
+
+#endif
@@ -0,0 +1,152 @@
+#include "decompress.h"
+
+enum decompress_state {
+	DECOMPRESS_STATE_TAG = 0,
+	DECOMPRESS_STATE_LITERAL,
+	DECOMPRESS_STATE_INDEX,
+	DECOMPRESS_STATE_COUNT,
+};
+
+static uint8_t decompress_input(struct decompress_t *this, uint8_t *data, uint32_t len);
+static uint8_t decompress_finish(struct decompress_t *this);
+
+uint8_t decompress_init(struct decompress_t *this, uint8_t *window, uint8_t window_bits, uint8_t lookahead_bits,
+		uint32_t out_limit, uint8_t (*output)(struct decompress_t *this, uint32_t offset, uint8_t *data, uint32_t len), void *arg)
+{
+	if (window == NULL || output == NULL ||
+		window_bits < DECOMPRESS_MIN_WINDOW_BITS || window_bits > DECOMPRESS_MAX_WINDOW_BITS ||
+		lookahead_bits == 0 || lookahead_bits >= window_bits) {
+		return DECOMPRESS_FAIL;
+	}
+
+	this->window			= window;
+	this->mask				= DECOMPRESS_WINDOW_SIZE - 1;
+	this->window_bits		= window_bits;
+	this->lookahead_bits	= lookahead_bits;
+	this->state				= DECOMPRESS_STATE_TAG;
+	this->bit_need			= 1;
+	this->bit_have			= 0;
+	this->bit_acc			= 0;
+	this->backref			= 0;
+	this->out_pos			= 0;
+	this->out_flushed		= 0;
+	this->out_limit			= out_limit;
+	this->arg				= arg;
+	this->output			= output;
+	this->input				= decompress_input;
+	this->finish			= decompress_finish;
+
+	// 与heatshrink一致，窗口初始内容为0
+	// 缓冲区按最大窗口分配，window_bits只限制回溯距离，写出的块因此不会跨越缓冲区末尾
+	memset(window, 0, DECOMPRESS_WINDOW_SIZE);
+
+	return DECOMPRESS_SUCCESS;
+}
+
+// 输出一个字节到窗口，窗口中凑满一块就写出
+static uint8_t emit(struct decompress_t *this, uint8_t byte)
+{
+	uint32_t start;
+
+	if (this->out_pos >= this->out_limit) {
+		return DECOMPRESS_FAIL;
+	}
+	this->window[this->out_pos & this->mask] = byte;
+	this->out_pos++;
+
+	if (this->out_pos - this->out_flushed == DECOMPRESS_CHUNK_SIZE) {
+		start = this->out_flushed;
+		this->out_flushed = this->out_pos;
+		return this->output(this, start, &this->window[start & this->mask], DECOMPRESS_CHUNK_SIZE);
+	}
+
+	return DECOMPRESS_SUCCESS;
+}
+
+// 当前字段已收齐，处理后进入下一个字段
+static uint8_t field_done(struct decompress_t *this)
+{
+	uint32_t count;
+	uint32_t i;
+
+	switch (this->state) {
+	case DECOMPRESS_STATE_TAG:
+		if (this->bit_acc) {
+			this->state = DECOMPRESS_STATE_LITERAL;
+			this->bit_need = 8;
+		} else {
+			this->state = DECOMPRESS_STATE_INDEX;
+			this->bit_need = this->window_bits;
+		}
+		break;
+
+	case DECOMPRESS_STATE_LITERAL:
+		if (emit(this, (uint8_t)this->bit_acc) != DECOMPRESS_SUCCESS) {
+			return DECOMPRESS_FAIL;
+		}
+		this->state = DECOMPRESS_STATE_TAG;
+		this->bit_need = 1;
+		break;
+
+	case DECOMPRESS_STATE_INDEX:
+		this->backref = this->bit_acc + 1;
+		this->state = DECOMPRESS_STATE_COUNT;
+		this->bit_need = this->lookahead_bits;
+		break;
+
+	case DECOMPRESS_STATE_COUNT:
+		count = this->bit_acc + 1;
+		for (i = 0; i < count; i++) {
+			if (emit(this, this->window[(this->out_pos - this->backref) & this->mask]) != DECOMPRESS_SUCCESS) {
+				return DECOMPRESS_FAIL;
+			}
+		}
+		this->state = DECOMPRESS_STATE_TAG;
+		this->bit_need = 1;
+		break;
+
+	default:
+		return DECOMPRESS_FAIL;
+	}
+
+	this->bit_have = 0;
+	this->bit_acc = 0;
+
+	return DECOMPRESS_SUCCESS;
+}
+
+static uint8_t decompress_input(struct decompress_t *this, uint8_t *data, uint32_t len)
+{
+	uint32_t i;
+	uint8_t byte;
+	int8_t bit;
+
+	for (i = 0; i < len; i++) {
+		byte = data[i];
+		for (bit = 7; bit >= 0; bit--) {
+			this->bit_acc = (this->bit_acc << 1) | ((byte >> bit) & 0x01);
+			this->bit_have++;
+			if (this->bit_have == this->bit_need) {
+				if (field_done(this) != DECOMPRESS_SUCCESS) {
+					return DECOMPRESS_FAIL;
+				}
+			}
+		}
+	}
+
+	return DECOMPRESS_SUCCESS;
+}
+
+// 码流最后一个字节中的填充位被忽略，窗口中不满一块的数据在这里写出
+static uint8_t decompress_finish(struct decompress_t *this)
+{
+	uint32_t start = this->out_flushed;
+	uint32_t len = this->out_pos - this->out_flushed;
+
+	if (len == 0) {
+		return DECOMPRESS_SUCCESS;
+	}
+	this->out_flushed = this->out_pos;
+
+	return this->output(this, start, &this->window[start & this->mask], len);
+}
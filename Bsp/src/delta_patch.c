@@ -0,0 +1,182 @@
+#include "delta_patch.h"
+
+enum delta_patch_state {
+	DELTA_PATCH_STATE_CTRL = 0,
+	DELTA_PATCH_STATE_DIFF,
+	DELTA_PATCH_STATE_EXTRA,
+};
+
+static uint8_t patch_input(struct delta_patch_t *this, uint8_t *data, uint32_t len);
+static uint8_t patch_finish(struct delta_patch_t *this);
+
+uint8_t delta_patch_init(struct delta_patch_t *this, const uint8_t *ref, uint32_t ref_size, uint8_t *buf,
+		uint32_t out_limit, uint8_t (*output)(struct delta_patch_t *this, uint32_t offset, uint8_t *data, uint32_t len), void *arg)
+{
+	if (ref == NULL || buf == NULL || output == NULL) {
+		return DELTA_PATCH_FAIL;
+	}
+
+	this->ref			= ref;
+	this->ref_size		= ref_size;
+	this->ref_pos		= 0;
+	this->state			= DELTA_PATCH_STATE_CTRL;
+	this->ctrl_have		= 0;
+	this->diff_left		= 0;
+	this->extra_left	= 0;
+	this->seek			= 0;
+	this->buf			= buf;
+	this->buf_len		= 0;
+	this->out_pos		= 0;
+	this->out_limit		= out_limit;
+	this->arg			= arg;
+	this->output		= output;
+	this->input			= patch_input;
+	this->finish		= patch_finish;
+
+	return DELTA_PATCH_SUCCESS;
+}
+
+// bsdiff的offtin：8字节小端，最高位为符号位，其余为绝对值
+static int64_t offtin(const uint8_t *buf)
+{
+	int64_t y = buf[7] & 0x7F;
+	int8_t i;
+
+	for (i = 6; i >= 0; i--) {
+		y = (y << 8) | buf[i];
+	}
+	if (buf[7] & 0x80) {
+		y = -y;
+	}
+
+	return y;
+}
+
+static uint8_t flush(struct delta_patch_t *this)
+{
+	uint32_t len = this->buf_len;
+
+	if (len == 0) {
+		return DELTA_PATCH_SUCCESS;
+	}
+	this->buf_len = 0;
+
+	return this->output(this, this->out_pos - len, this->buf, len);
+}
+
+// 解析控制字，检查本条记录不会超出还原结果的长度
+static uint8_t ctrl_parse(struct delta_patch_t *this)
+{
+	int64_t diff_len = offtin(&this->ctrl[0]);
+	int64_t extra_len = offtin(&this->ctrl[8]);
+
+	this->seek = offtin(&this->ctrl[16]);
+	if (diff_len < 0 || extra_len < 0 ||
+		(uint64_t)this->out_pos + (uint64_t)diff_len + (uint64_t)extra_len > this->out_limit) {
+		return DELTA_PATCH_FAIL;
+	}
+	this->diff_left = (uint32_t)diff_len;
+	this->extra_left = (uint32_t)extra_len;
+
+	return DELTA_PATCH_SUCCESS;
+}
+
+static uint8_t patch_input(struct delta_patch_t *this, uint8_t *data, uint32_t len)
+{
+	uint32_t n;
+	uint32_t i;
+	uint8_t ref;
+
+	while (len > 0) {
+		switch (this->state) {
+		case DELTA_PATCH_STATE_CTRL:
+			n = sizeof(this->ctrl) - this->ctrl_have;
+			if (n > len) {
+				n = len;
+			}
+			memcpy(&this->ctrl[this->ctrl_have], data, n);
+			this->ctrl_have += n;
+			data += n;
+			len -= n;
+			if (this->ctrl_have < sizeof(this->ctrl)) {
+				break;
+			}
+			this->ctrl_have = 0;
+			if (ctrl_parse(this) != DELTA_PATCH_SUCCESS) {
+				return DELTA_PATCH_FAIL;
+			}
+			this->state = DELTA_PATCH_STATE_DIFF;
+			break;
+
+		case DELTA_PATCH_STATE_DIFF:
+			// 每次处理的长度不超过输出缓冲区剩余空间
+			n = DELTA_PATCH_CHUNK_SIZE - this->buf_len;
+			if (n > this->diff_left) {
+				n = this->diff_left;
+			}
+			if (n > len) {
+				n = len;
+			}
+			for (i = 0; i < n; i++) {
+				// 参考位置超出参考镜像时按0处理，与bspatch一致
+				ref = 0;
+				if (this->ref_pos >= 0 && this->ref_pos < this->ref_size) {
+					ref = this->ref[this->ref_pos];
+				}
+				this->buf[this->buf_len++] = ref + data[i];
+				this->ref_pos++;
+			}
+			this->diff_left -= n;
+			this->out_pos += n;
+			data += n;
+			len -= n;
+			break;
+
+		case DELTA_PATCH_STATE_EXTRA:
+			n = DELTA_PATCH_CHUNK_SIZE - this->buf_len;
+			if (n > this->extra_left) {
+				n = this->extra_left;
+			}
+			if (n > len) {
+				n = len;
+			}
+			memcpy(&this->buf[this->buf_len], data, n);
+			this->buf_len += n;
+			this->extra_left -= n;
+			this->out_pos += n;
+			data += n;
+			len -= n;
+			break;
+
+		default:
+			return DELTA_PATCH_FAIL;
+		}
+
+		if (this->buf_len == DELTA_PATCH_CHUNK_SIZE) {
+			if (flush(this) != DELTA_PATCH_SUCCESS) {
+				return DELTA_PATCH_FAIL;
+			}
+		}
+
+		// 差分段结束进入新增段，新增段结束后移动参考位置并开始下一条记录
+		if (this->state == DELTA_PATCH_STATE_DIFF && this->diff_left == 0) {
+			this->state = DELTA_PATCH_STATE_EXTRA;
+		}
+		if (this->state == DELTA_PATCH_STATE_EXTRA && this->extra_left == 0) {
+			this->ref_pos += this->seek;
+			this->state = DELTA_PATCH_STATE_CTRL;
+		}
+	}
+
+	return DELTA_PATCH_SUCCESS;
+}
+
+// 补丁必须恰好结束在一条记录的末尾
+static uint8_t patch_finish(struct delta_patch_t *this)
+{
+	if (this->state != DELTA_PATCH_STATE_CTRL || this->ctrl_have != 0) {
+		return DELTA_PATCH_FAIL;
+	}
+
+	return flush(this);
+}
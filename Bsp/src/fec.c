@@ -0,0 +1,177 @@
+#include "fec.h"
+
+static uint8_t fec_decode(struct fec_t *this, uint8_t **data, uint32_t present,
+		uint8_t **parity, const uint8_t *rows, uint32_t parity_count);
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+
+// 生成GF(256)的指数表和对数表，指数表重复一遍，乘法不用取模
+static void gf_init(void)
+{
+	uint32_t i;
+	uint32_t x = 1;
+
+	if (gf_exp[0] != 0) {
+		return;
+	}
+	for (i = 0; i < 255; i++) {
+		gf_exp[i] = x;
+		gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100) {
+			x ^= 0x11D;
+		}
+	}
+	gf_exp[510] = gf_exp[0];
+	gf_exp[511] = gf_exp[1];
+}
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	if (a == 0 || b == 0) {
+		return 0;
+	}
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+// dst ^= c * src，先按系数生成一张256字节的乘法表，逐字节查表
+static void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, uint32_t len)
+{
+	uint8_t table[256];
+	uint32_t i;
+
+	if (c == 0) {
+		return;
+	}
+	for (i = 0; i < 256; i++) {
+		table[i] = gf_mul(c, i);
+	}
+	for (i = 0; i < len; i++) {
+		dst[i] ^= table[src[i]];
+	}
+}
+
+uint8_t fec_init(struct fec_t *this, uint32_t k, uint32_t shard_size)
+{
+	if (k == 0 || k > FEC_MAX_DATA_SHARDS || shard_size == 0) {
+		return FEC_FAIL;
+	}
+
+	gf_init();
+
+	this->k				= k;
+	this->shard_size	= shard_size;
+	this->decode		= fec_decode;
+
+	return FEC_SUCCESS;
+}
+
+// Gauss-Jordan消元求n阶矩阵的逆，a被破坏，结果放入inv
+static uint8_t gf_invert(uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY], uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY], uint32_t n)
+{
+	uint32_t row;
+	uint32_t col;
+	uint32_t i;
+	uint8_t t;
+
+	if (n > FEC_MAX_PARITY) {
+		return FEC_FAIL;
+	}
+	memset(inv, 0, FEC_MAX_PARITY * FEC_MAX_PARITY);
+	for (i = 0; i < n; i++) {
+		inv[i][i] = 1;
+	}
+
+	for (col = 0; col < n; col++) {
+		for (row = col; row < n && a[row][col] == 0; row++) {
+		}
+		if (row == n) {
+			return FEC_FAIL;
+		}
+		if (row != col) {
+			for (i = 0; i < n; i++) {
+				t = a[row][i]; a[row][i] = a[col][i]; a[col][i] = t;
+				t = inv[row][i]; inv[row][i] = inv[col][i]; inv[col][i] = t;
+			}
+		}
+		t = gf_inv(a[col][col]);
+		for (i = 0; i < n; i++) {
+			a[col][i] = gf_mul(a[col][i], t);
+			inv[col][i] = gf_mul(inv[col][i], t);
+		}
+		for (row = 0; row < n; row++) {
+			if (row == col || a[row][col] == 0) {
+				continue;
+			}
+			t = a[row][col];
+			for (i = 0; i < n; i++) {
+				a[row][i] ^= gf_mul(t, a[col][i]);
+				inv[row][i] ^= gf_mul(t, inv[col][i]);
+			}
+		}
+	}
+
+	return FEC_SUCCESS;
+}
+
+/*
+ * 设缺失的数据列为E，取前|E|个校验行R：
+ *   syndrome[r] = parity[r] - sum_{j不在E} C[r][j] * data[j] = sum_{j在E} C[r][j] * data[j]
+ * 解这个|E|阶线性方程组即得缺失的数据分片。
+ */
+static uint8_t fec_decode(struct fec_t *this, uint8_t **data, uint32_t present,
+		uint8_t **parity, const uint8_t *rows, uint32_t parity_count)
+{
+	uint8_t a[FEC_MAX_PARITY][FEC_MAX_PARITY];
+	uint8_t inv[FEC_MAX_PARITY][FEC_MAX_PARITY];
+	uint8_t missing[FEC_MAX_PARITY];
+	uint32_t e = 0;
+	uint32_t i;
+	uint32_t j;
+	uint8_t x;
+
+	for (j = 0; j < this->k; j++) {
+		if (present & (1u << j)) {
+			continue;
+		}
+		if (e == FEC_MAX_PARITY || e == parity_count) {
+			return FEC_FAIL;
+		}
+		missing[e++] = j;
+	}
+	if (e == 0) {
+		return FEC_SUCCESS;
+	}
+
+	// 在校验分片上原地计算syndrome
+	for (i = 0; i < e; i++) {
+		x = this->k + rows[i];
+		for (j = 0; j < this->k; j++) {
+			if (present & (1u << j)) {
+				gf_mul_add(parity[i], data[j], gf_inv(x ^ j), this->shard_size);
+			}
+		}
+		for (j = 0; j < e; j++) {
+			a[i][j] = gf_inv(x ^ missing[j]);
+		}
+	}
+
+	if (gf_invert(a, inv, e) != FEC_SUCCESS) {
+		return FEC_FAIL;
+	}
+	for (j = 0; j < e; j++) {
+		memset(data[missing[j]], 0, this->shard_size);
+		for (i = 0; i < e; i++) {
+			gf_mul_add(data[missing[j]], parity[i], inv[j][i], this->shard_size);
+		}
+	}
+
+	return FEC_SUCCESS;
+}
@@ -0,0 +1,375 @@
+#include "firmware_cmd.h"
+#include "firmware_manifest.h"
+
+static uint32_t cmd_exec(struct firmware_cmd_t *this, uint8_t *frame, uint32_t len);
+
+#define CMD_ALIGN(n)	(((n) + 3u) & ~3u)
+
+uint8_t firmware_cmd_init(struct firmware_cmd_t *this, struct firmware_opt_t *opt, uint8_t *reply, uint32_t reply_size)
+{
+	if (opt == NULL || reply == NULL || reply_size < sizeof(struct firmware_v2_header_t)) {
+		return FIRMWARE_OPT_FAIL;
+	}
+
+	this->opt			= opt;
+	this->reply			= reply;
+	this->reply_size	= reply_size;
+	this->reboot		= 0;
+	this->read_only		= 0;
+	this->exec			= cmd_exec;
+
+	return FIRMWARE_OPT_SUCCESS;
+}
+
+uint8_t firmware_cmd_match(uint8_t *frame, uint32_t len)
+{
+	struct firmware_v2_header_t *h = (struct firmware_v2_header_t *)frame;
+
+	return len >= sizeof(*h) && h->magic == FIRMWARE_V2_MAGIC && h->type == FIRMWARE_V2_TYPE_CMD;
+}
+
+// [addr, addr+size)是否完全落在[base, base+limit)内
+static inline uint8_t cmd_in_region(uint32_t addr, uint32_t size, uint32_t base, uint32_t limit)
+{
+	return addr >= base && addr - base <= limit && size <= limit - (addr - base);
+}
+
+// A/B布局下firmware区域为非活动槽，活动槽不可擦写
+static inline uint8_t cmd_writable(struct firmware_cmd_t *this, uint32_t addr, uint32_t size)
+{
+	return cmd_in_region(addr, size, this->opt->firm_start_addr, BOOTLOADER_FIRMWARE_DATA_SIZE);
+}
+
+static inline uint8_t cmd_readable(uint32_t addr, uint32_t size)
+{
+	return cmd_in_region(addr, size, BOOTLOADER_FIRMWARE_BASE, BOOTLOADER_FIRMWARE_SIZE) ||
+		cmd_in_region(addr, size, APP_BASE, APP_SIZE);
+}
+
+// 会改变flash或会话状态的命令，其他传输方式持有会话时不执行
+static inline uint8_t cmd_changes_state(uint8_t op)
+{
+	return op == FIRMWARE_CMD_ERASE || op == FIRMWARE_CMD_WRITE || op == FIRMWARE_CMD_COMMIT ||
+		op == FIRMWARE_CMD_REBOOT || op == FIRMWARE_CMD_KEEP;
+}
+
+/*
+ * 直接擦写firmware区域前结束正在进行的帧传输会话，之后的帧传输需要重新开始。
+ * 日志中未完成的接收和复制一并作废，之后相同的START帧不会在被命令改写的扇区上续传。
+ */
+static void cmd_take_over(struct firmware_cmd_t *this)
+{
+	if (this->opt->version != FIRMWARE_OPT_VERSION_CMD) {
+		firmware_opt_init(this->opt);
+		firmware_journal_abandon(this->opt);
+		this->opt->version = FIRMWARE_OPT_VERSION_CMD;
+	}
+}
+
+static uint8_t cmd_erase(struct firmware_cmd_t *this, struct firmware_cmd_req_t *req)
+{
+	uint8_t status = 0;
+
+	// 日志区与最后一个扇区共用，擦除范围按整个firmware区域检查
+	if (req->size == 0 || !cmd_in_region(req->addr, req->size, this->opt->firm_start_addr, BOOTLOADER_FIRMWARE_SIZE) ||
+		(req->addr - this->opt->firm_start_addr) % FLASH_SECTOR_SIZE != 0 || req->size % FLASH_SECTOR_SIZE != 0) {
+		status = FIRMWARE_CMD_ERR_RANGE;
+		return status;
+	}
+	cmd_take_over(this);
+	if (sector_erase((req->addr - FLASH_SECTOR0_BASE) / FLASH_SECTOR_SIZE, req->size / FLASH_SECTOR_SIZE) != INTERNAL_FLASH_OK) {
+		status = FIRMWARE_CMD_ERR_FLASH;
+		return status;
+	}
+
+	status = FIRMWARE_CMD_OK;
+	return status;
+}
+
+static uint8_t cmd_write(struct firmware_cmd_t *this, struct firmware_cmd_req_t *req, uint8_t *arg)
+{
+	uint8_t status = 0;
+
+	// 命令方式没有清单可以校验
+	if (FIRMWARE_MANIFEST_REQUIRED) {
+		status = FIRMWARE_CMD_ERR_DENIED;
+		return status;
+	}
+	if (req->len == 0 || !cmd_writable(this, req->addr, req->len) ||
+		(req->addr & (FLASH_NB_32BITWORD_IN_FLASHWORD * 4u - 1u)) != 0) {
+		status = FIRMWARE_CMD_ERR_RANGE;
+		return status;
+	}
+	cmd_take_over(this);
+	if (flash_write(req->addr, arg, req->len) != INTERNAL_FLASH_OK) {
+		status = FIRMWARE_CMD_ERR_FLASH;
+		return status;
+	}
+
+	status = FIRMWARE_CMD_OK;
+	return status;
+}
+
+static uint8_t cmd_keep(struct firmware_cmd_t *this, struct firmware_cmd_req_t *req)
+{
+	uint8_t status = 0;
+	uint32_t sector;
+
+	// A/B布局下新镜像不写入app所在的槽，没有可以保留的扇区
+	if (FIRMWARE_SLOT_AB || req->size == 0 || !cmd_in_region(req->addr, req->size, APP_BASE, APP_SIZE) ||
+		(req->addr - APP_BASE) % FLASH_SECTOR_SIZE != 0 || req->size % FLASH_SECTOR_SIZE != 0) {
+		status = FIRMWARE_CMD_ERR_RANGE;
+		return status;
+	}
+	cmd_take_over(this);
+	for (sector = (req->addr - APP_BASE) / FLASH_SECTOR_SIZE; sector < (req->addr - APP_BASE + req->size) / FLASH_SECTOR_SIZE; sector++) {
+		this->opt->keep_sectors |= 1u << sector;
+	}
+
+	status = FIRMWARE_CMD_OK;
+	return status;
+}
+
+static uint8_t cmd_verify(struct firmware_cmd_t *this, struct firmware_cmd_req_t *req, uint8_t *arg, uint32_t *crc)
+{
+	uint8_t status = 0;
+	uint32_t expect;
+
+	if (!cmd_readable(req->addr, req->size) || (req->len != 0 && req->len != sizeof(expect))) {
+		status = FIRMWARE_CMD_ERR_RANGE;
+		return status;
+	}
+	*crc = firmware_crc32(0, (uint8_t *)req->addr, req->size);
+	if (req->len == sizeof(expect)) {
+		memcpy(&expect, arg, sizeof(expect));
+		if (expect != *crc) {
+			status = FIRMWARE_CMD_ERR_VERIFY;
+			return status;
+		}
+	}
+
+	status = FIRMWARE_CMD_OK;
+	return status;
+}
+
+static uint8_t cmd_commit(struct firmware_cmd_t *this, struct firmware_cmd_req_t *req, uint8_t *arg)
+{
+	uint8_t status = 0;
+	struct firmware_opt_t *opt = this->opt;
+	uint32_t expect;
+	uint32_t crc;
+
+	// firmware区域中的镜像可能来自未经清单校验的写入，不能写入app区域
+	if (FIRMWARE_MANIFEST_REQUIRED) {
+		status = FIRMWARE_CMD_ERR_DENIED;
+		return status;
+	}
+	if (req->size == 0 || req->size > BOOTLOADER_FIRMWARE_DATA_SIZE || (req->len != 0 && req->len != sizeof(expect))) {
+		status = FIRMWARE_CMD_ERR_RANGE;
+		return status;
+	}
+	if (req->len == sizeof(expect)) {
+		memcpy(&expect, arg, sizeof(expect));
+		if (firmware_image_crc(opt, req->size, &crc) != FIRMWARE_OPT_SUCCESS || crc != expect) {
+			status = FIRMWARE_CMD_ERR_VERIFY;
+			return status;
+		}
+	}
+
+	// 镜像由命令直接写入，不属于任何帧传输会话，不记录日志
+	cmd_take_over(this);
+	opt->firm_current_addr = opt->firm_start_addr + req->size;
+	opt->total_byte = req->size;
+	opt->image_size = req->size;
+	if (opt->write(opt) != FIRMWARE_OPT_WRITE_CPLT) {
+		status = FIRMWARE_CMD_ERR_FLASH;
+		return status;
+	}
+
+	status = FIRMWARE_CMD_OK;
+	return status;
+}
+
+/*
+ * 主机用各块摘要与期望镜像比较，代替逐字节读回，384K的app区按扇区只需返回96字节。
+ * 最后一块可以不满block。
+ */
+static uint8_t cmd_hash(struct firmware_cmd_req_t *req, uint8_t *arg, uint8_t *data, uint32_t room, uint16_t *out_len)
+{
+	uint8_t status = 0;
+	struct firmware_cmd_hash_arg_t hash_arg = {FIRMWARE_CMD_HASH_SHA256, {0}, FLASH_SECTOR_SIZE};
+	uint32_t digest_size;
+	uint32_t count;
+	uint32_t block;
+	uint32_t addr;
+	uint32_t crc;
+
+	if (req->len != 0 && req->len != sizeof(hash_arg)) {
+		status = FIRMWARE_CMD_ERR_FORMAT;
+		return status;
+	}
+	if (req->len == sizeof(hash_arg)) {
+		memcpy(&hash_arg, arg, sizeof(hash_arg));
+	}
+	if (hash_arg.algo == FIRMWARE_CMD_HASH_SHA256) {
+		digest_size = FIRMWARE_HASH_SIZE;
+	} else if (hash_arg.algo == FIRMWARE_CMD_HASH_CRC32) {
+		digest_size = sizeof(crc);
+	} else {
+		status = FIRMWARE_CMD_ERR_FORMAT;
+		return status;
+	}
+	if (req->size == 0 || !cmd_readable(req->addr, req->size)) {
+		status = FIRMWARE_CMD_ERR_RANGE;
+		return status;
+	}
+
+	block = hash_arg.block == 0 ? req->size : hash_arg.block;
+	count = (req->size + block - 1) / block;
+	if (count * digest_size > room) {
+		status = FIRMWARE_CMD_ERR_SPACE;
+		return status;
+	}
+
+	for (addr = req->addr; addr < req->addr + req->size; addr += block) {
+		if (block > req->addr + req->size - addr) {
+			block = req->addr + req->size - addr;
+		}
+		if (hash_arg.algo == FIRMWARE_CMD_HASH_SHA256) {
+			firmware_sha256((uint8_t *)addr, block, data);
+		} else {
+			crc = firmware_crc32(0, (uint8_t *)addr, block);
+			memcpy(data, &crc, sizeof(crc));
+		}
+		data += digest_size;
+	}
+	*out_len = count * digest_size;
+
+	status = FIRMWARE_CMD_OK;
+	return status;
+}
+
+/*
+ * 逐条执行命令，结果追加到应答帧中。
+ * 结果数据先直接写入应答缓冲区中结果头之后的位置，放不下时按ERR_SPACE处理。
+ */
+static uint32_t cmd_exec(struct firmware_cmd_t *this, uint8_t *frame, uint32_t len)
+{
+	struct firmware_v2_header_t *h = (struct firmware_v2_header_t *)frame;
+	struct firmware_v2_header_t *out = (struct firmware_v2_header_t *)this->reply;
+	struct firmware_v2_header_t head;
+	struct firmware_cmd_req_t req;
+	struct firmware_cmd_rsp_t rsp;
+	uint8_t *p;
+	uint8_t *end;
+	uint8_t *data;
+	uint32_t pos = sizeof(*out);
+	uint32_t room;
+	uint32_t crc;
+
+	this->reboot = 0;
+	if (!firmware_cmd_match(frame, len) || h->len != len - sizeof(*h)) {
+		return 0;
+	}
+	head = *h;
+	head.crc = 0;
+	crc = firmware_crc32(0, (uint8_t *)&head, sizeof(head));
+	crc = firmware_crc32(crc, frame + sizeof(*h), h->len);
+	if (crc != h->crc) {
+		return 0;
+	}
+
+	p = frame + sizeof(*h);
+	end = p + h->len;
+	while (p < end) {
+		if (pos + sizeof(rsp) > this->reply_size) {
+			break;
+		}
+		data = this->reply + pos + sizeof(rsp);
+		room = this->reply_size - pos - sizeof(rsp);
+		rsp.len = 0;
+
+		if ((uint32_t)(end - p) < sizeof(req)) {
+			rsp.op = 0;
+			rsp.status = FIRMWARE_CMD_ERR_FORMAT;
+		} else {
+			memcpy(&req, p, sizeof(req));
+			p += sizeof(req);
+			rsp.op = req.op;
+			if ((uint32_t)(end - p) < req.len) {
+				rsp.status = FIRMWARE_CMD_ERR_FORMAT;
+			} else if (this->read_only && cmd_changes_state(req.op)) {
+				rsp.status = FIRMWARE_CMD_ERR_DENIED;
+			} else {
+				switch (req.op) {
+				case FIRMWARE_CMD_ERASE:
+					rsp.status = cmd_erase(this, &req);
+					break;
+				case FIRMWARE_CMD_WRITE:
+					rsp.status = cmd_write(this, &req, p);
+					break;
+				case FIRMWARE_CMD_VERIFY:
+					rsp.status = cmd_verify(this, &req, p, &crc);
+					if (room >= sizeof(crc) && rsp.status != FIRMWARE_CMD_ERR_RANGE) {
+						memcpy(data, &crc, sizeof(crc));
+						rsp.len = sizeof(crc);
+					}
+					break;
+				case FIRMWARE_CMD_READ:
+					if (!cmd_readable(req.addr, req.size)) {
+						rsp.status = FIRMWARE_CMD_ERR_RANGE;
+					} else if (CMD_ALIGN(req.size) > room) {
+						rsp.status = FIRMWARE_CMD_ERR_SPACE;
+					} else {
+						memcpy(data, (uint8_t *)req.addr, req.size);
+						memset(data + req.size, 0, CMD_ALIGN(req.size) - req.size);
+						rsp.len = req.size;
+						rsp.status = FIRMWARE_CMD_OK;
+					}
+					break;
+				case FIRMWARE_CMD_STATUS:
+					if (room < sizeof(struct firmware_ack_t) || this->opt->ack == NULL) {
+						rsp.status = FIRMWARE_CMD_ERR_SPACE;
+					} else {
+						this->opt->ack(this->opt, (struct firmware_ack_t *)data);
+						rsp.len = sizeof(struct firmware_ack_t);
+						rsp.status = FIRMWARE_CMD_OK;
+					}
+					break;
+				case FIRMWARE_CMD_COMMIT:
+					rsp.status = cmd_commit(this, &req, p);
+					break;
+				case FIRMWARE_CMD_KEEP:
+					rsp.status = cmd_keep(this, &req);
+					break;
+				case FIRMWARE_CMD_HASH:
+					rsp.status = cmd_hash(&req, p, data, room, &rsp.len);
+					break;
+				case FIRMWARE_CMD_REBOOT:
+					this->reboot = 1;
+					rsp.status = FIRMWARE_CMD_OK;
+					break;
+				default:
+					rsp.status = FIRMWARE_CMD_ERR_FORMAT;
+					break;
+				}
+				p += CMD_ALIGN(req.len);
+			}
+		}
+
+		memcpy(this->reply + pos, &rsp, sizeof(rsp));
+		pos += sizeof(rsp) + CMD_ALIGN(rsp.len);
+		if (rsp.status != FIRMWARE_CMD_OK) {
+			break;
+		}
+	}
+
+	memset(out, 0, sizeof(*out));
+	out->magic = FIRMWARE_V2_MAGIC;
+	out->type = FIRMWARE_V2_TYPE_CMD;
+	out->index = h->index;
+	out->len = pos - sizeof(*out);
+	out->crc = firmware_crc32(0, this->reply, pos);
+
+	return pos;
+}
@@ -0,0 +1,96 @@
+#include "firmware_manifest.h"
+#include "nx_crypto_sha2.h"
+#include "nx_crypto_ecdsa.h"
+#include "manifest_key.h"
+
+#define MANIFEST_TREE_DEPTH		32u
+
+// 验签公钥，未压缩格式 0x04 || X || Y
+// 构建时由tools/fw_pubkey.py从MANIFEST_PUBLIC_KEY指定的密钥生成，见CMakeLists.txt
+static const uint8_t manifest_public_key[65] = MANIFEST_PUBLIC_KEY;
+
+static HN_UBASE ecdsa_scratch[NX_CRYPTO_ECDSA_SCRATCH_BUFFER_SIZE >> HN_SIZE_SHIFT];
+static NX_CRYPTO_SHA256 sha256;
+
+void firmware_sha256(const uint8_t *data, uint32_t len, uint8_t *hash)
+{
+	_nx_crypto_sha256_initialize(&sha256, NX_CRYPTO_HASH_SHA256);
+	_nx_crypto_sha256_update(&sha256, (UCHAR *)data, len);
+	_nx_crypto_sha256_digest_calculate(&sha256, hash, NX_CRYPTO_HASH_SHA256);
+}
+
+void manifest_leaf_hash(const uint8_t *data, uint32_t len, uint8_t *hash)
+{
+	UCHAR prefix = 0x00;
+
+	_nx_crypto_sha256_initialize(&sha256, NX_CRYPTO_HASH_SHA256);
+	_nx_crypto_sha256_update(&sha256, &prefix, 1);
+	_nx_crypto_sha256_update(&sha256, (UCHAR *)data, len);
+	_nx_crypto_sha256_digest_calculate(&sha256, hash, NX_CRYPTO_HASH_SHA256);
+}
+
+static void manifest_node_hash(const uint8_t *left, const uint8_t *right, uint8_t *hash)
+{
+	UCHAR prefix = 0x01;
+
+	_nx_crypto_sha256_initialize(&sha256, NX_CRYPTO_HASH_SHA256);
+	_nx_crypto_sha256_update(&sha256, &prefix, 1);
+	_nx_crypto_sha256_update(&sha256, (UCHAR *)left, FIRMWARE_HASH_SIZE);
+	_nx_crypto_sha256_update(&sha256, (UCHAR *)right, FIRMWARE_HASH_SIZE);
+	_nx_crypto_sha256_digest_calculate(&sha256, hash, NX_CRYPTO_HASH_SHA256);
+}
+
+/*
+ * 用栈逐个合并叶子：栈顶两个子树高度相同就合并，
+ * 最后从右向左折叠剩余子树，得到的树形与RFC 6962相同，只需O(log n)的空间。
+ */
+static void manifest_root(const uint8_t *leaf, uint32_t count, uint8_t *root)
+{
+	uint8_t stack[MANIFEST_TREE_DEPTH][FIRMWARE_HASH_SIZE];
+	uint8_t height[MANIFEST_TREE_DEPTH];
+	uint32_t top = 0;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		memcpy(stack[top], leaf + i * FIRMWARE_HASH_SIZE, FIRMWARE_HASH_SIZE);
+		height[top++] = 0;
+		while (top >= 2 && height[top - 1] == height[top - 2]) {
+			manifest_node_hash(stack[top - 2], stack[top - 1], stack[top - 2]);
+			height[top - 2]++;
+			top--;
+		}
+	}
+	while (top >= 2) {
+		manifest_node_hash(stack[top - 2], stack[top - 1], stack[top - 2]);
+		top--;
+	}
+	memcpy(root, stack[0], FIRMWARE_HASH_SIZE);
+}
+
+uint8_t manifest_verify(const struct firmware_manifest_t *m, const uint8_t *leaf)
+{
+	uint8_t hash[FIRMWARE_HASH_SIZE];
+	NX_CRYPTO_EC *curve;
+
+	if (m->magic != FIRMWARE_MANIFEST_MAGIC || m->leaf_count == 0 ||
+		m->sig_len == 0 || m->sig_len > FIRMWARE_MANIFEST_SIG_MAX) {
+		return MANIFEST_FAIL;
+	}
+
+	manifest_root(leaf, m->leaf_count, hash);
+	if (memcmp(hash, m->root, FIRMWARE_HASH_SIZE) != 0) {
+		return MANIFEST_FAIL;
+	}
+
+	_nx_crypto_sha256_initialize(&sha256, NX_CRYPTO_HASH_SHA256);
+	_nx_crypto_sha256_update(&sha256, (UCHAR *)m, FIRMWARE_MANIFEST_SIGNED_SIZE);
+	_nx_crypto_sha256_digest_calculate(&sha256, hash, NX_CRYPTO_HASH_SHA256);
+
+	NX_CRYPTO_EC_GET_SECP256R1(curve);
+	if (_nx_crypto_ecdsa_verify(curve, hash, sizeof(hash), (UCHAR *)manifest_public_key, sizeof(manifest_public_key),
+			(UCHAR *)m->signature, m->sig_len, ecdsa_scratch) != NX_CRYPTO_SUCCESS) {
+		return MANIFEST_FAIL;
+	}
+
+	return MANIFEST_SUCCESS;
+}
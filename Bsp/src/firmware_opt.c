@@ -2,10 +2,29 @@
 
 static uint16_t ymodem_crc(uint8_t * buf, uint16_t len);
 static uint8_t frame_check(struct firmware_opt_t *this, uint8_t *data, uint16_t crc, uint32_t len);
+static void crc32_table_init(void);
+static uint32_t crc32_update(uint32_t crc, const uint8_t *buf, uint32_t len);
+static uint8_t frame_place(struct firmware_opt_t *this, uint32_t index, uint8_t *data, uint32_t len);
+static uint8_t journal_append(struct firmware_opt_t *this, uint32_t committed, uint32_t state);
 static uint8_t frame_recv(struct firmware_opt_t *this, uint8_t *data, uint32_t len);
 static uint8_t firmware_write(struct firmware_opt_t *this);
+static void frame_ack(struct firmware_opt_t *this, struct firmware_ack_t *ack);
+static uint8_t stage_write(struct firmware_opt_t *this, uint32_t offset, uint8_t *data, uint32_t len);
+static uint8_t stage_finish(struct firmware_opt_t *this, uint32_t total_byte);
+static uint8_t shard_open(struct firmware_opt_t *this, const struct firmware_shard_info_t *info);
+static uint8_t shard_place(struct firmware_opt_t *this, uint32_t block, uint8_t *data, uint32_t mask);
+static void erase_sync(struct firmware_opt_t *this);
+static uint8_t staging_idle(struct firmware_opt_t *this);
+static void slot_select(struct firmware_opt_t *this);
+static uint8_t copy_recover(struct firmware_opt_t *this);
 
-uint8_t iap_protocol_buffer[IAP_PROTOCOL_BUFFER_SIZE];
+static uint32_t crc32_table[256];
+// 解压窗口，放在AXI SRAM中
+static uint8_t decompress_window[DECOMPRESS_WINDOW_SIZE] __attribute__((aligned(32), section(".AxiSramSection")));
+// 增量补丁输出缓冲区
+static uint8_t patch_buffer[DELTA_PATCH_CHUNK_SIZE] __attribute__((aligned(32), section(".AxiSramSection")));
+// 清单中的叶子哈希，每帧一个
+static uint8_t manifest_leaf[FIRMWARE_MAX_FRAME][FIRMWARE_HASH_SIZE];
 
 uint8_t firmware_opt_init(struct firmware_opt_t *this)
 {
@@ -14,11 +33,48 @@ uint8_t firmware_opt_init(struct firmware_opt_t *this)
 	this->firm_start_addr 	= BOOTLOADER_FIRMWARE_BASE;
 	this->firm_current_addr	= this->firm_start_addr;
 	this->app_start_addr	= APP_BASE;
+	this->slot_seq		= 0;
+	this->version		= 0;
+	this->frame_size	= FIRMWARE_FRAME_DATA_SIZE;
 	this->index			= 0;
+	this->window		= FIRMWARE_OPT_WINDOW;
+	this->total_frame	= 0;
+	this->total_byte	= 0;
+	this->recv_frame	= 0;
+	this->image_flags	= 0;
+	this->image_size	= 0;
+	this->image_crc		= 0;
+	this->block_shards	= 0;
+	this->session		= 0;
+	this->journal_slot	= 0;
+	this->journal_committed	= 0;
+	this->resumed		= 0;
+	this->manifest		= 0;
+	this->keep_sectors	= 0;
+	// 上一个会话提前提交的擦除先等它完成，flash_engine中不留下无人等待的请求
+	erase_sync(this);
+	if (FIRMWARE_SLOT_AB) {
+		slot_select(this);
+	}
+	this->erase_ready	= 0;
+	this->erase_limit	= BOOTLOADER_FIRMWARE_DATA_SIZE;
+	this->applied		= 0;
+	this->last_status	= FIRMWARE_OPT_SUCCESS;
+	memset(this->recv_bitmap, 0, sizeof(this->recv_bitmap));
 	this->recv 			= frame_recv;
 	this->write 		= firmware_write;
+	this->ack			= frame_ack;
+	this->stage			= stage_write;
+	this->stage_finish	= stage_finish;
+	this->shard_open	= shard_open;
+	this->shard_place	= shard_place;
+	this->idle			= staging_idle;
+	this->recover		= copy_recover;
+
+	crc32_table_init();
 
-	status = sector_erase(BOOTLOADER_FIRMWARE_SECTOR_START, BOOTLOADER_FIRMWARE_SECTOR_COUNT);
+	// firmware区域在会话参数确定后按需擦除，能续传时保留已写入的数据
+	status = FIRMWARE_OPT_SUCCESS;
 
 	return status;
 }
@@ -62,57 +118,1282 @@ static uint8_t frame_check(struct firmware_opt_t *this, uint8_t *data, uint16_t
 	return status;
 }
 
-static uint8_t frame_recv(struct firmware_opt_t *this, uint8_t *data, uint32_t len)
+//CRC32 (IEEE 802.3)，查表法，表在初始化时生成
+static void crc32_table_init(void)
+{
+	uint32_t i;
+	uint32_t j;
+	uint32_t c;
+
+	if (crc32_table[1] != 0) {
+		return;
+	}
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++) {
+			c = (c & 1) ? (c >> 1) ^ 0xEDB88320u : (c >> 1);
+		}
+		crc32_table[i] = c;
+	}
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+	crc = ~crc;
+	while (len--) {
+		crc = crc32_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+// 供各传输层校验数据使用
+uint32_t firmware_crc32(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+	crc32_table_init();
+
+	return crc32_update(crc, buf, len);
+}
+
+static inline uint8_t frame_received(struct firmware_opt_t *this, uint32_t index)
+{
+	return (this->recv_bitmap[index / 32] >> (index % 32)) & 0x01;
+}
+
+// firmware区域的第一个扇区，A/B布局下随活动槽变化
+static inline uint32_t firm_sector(struct firmware_opt_t *this)
+{
+	return (this->firm_start_addr - FLASH_SECTOR0_BASE) / FLASH_SECTOR_SIZE;
+}
+
+static inline uint32_t journal_base(struct firmware_opt_t *this)
+{
+	return this->firm_start_addr + BOOTLOADER_FIRMWARE_DATA_SIZE;
+}
+
+// firmware区域[offset, offset + len)能否读取，掉电时写了一半的flash字有ECC错误，读取会产生总线错误
+static inline uint8_t region_readable(struct firmware_opt_t *this, uint32_t offset, uint32_t len)
+{
+	return flash_check(this->firm_start_addr + offset, len) == INTERNAL_FLASH_OK;
+}
+
+// firmware区域[offset, offset + len)是否为擦除状态，offset和len按字对齐；有ECC错误的按不空白处理
+static uint8_t region_blank(struct firmware_opt_t *this, uint32_t offset, uint32_t len)
+{
+	const uint32_t *p = (const uint32_t *)(this->firm_start_addr + offset);
+	uint32_t n;
+
+	if (!region_readable(this, offset, len)) {
+		return 0;
+	}
+	for (n = 0; n < len / 4u; n++) {
+		if (p[n] != 0xFFFFFFFFu) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// firmware区域第i个扇区是否为擦除状态
+static uint8_t erase_sector_blank(struct firmware_opt_t *this, uint32_t i)
+{
+	return region_blank(this, i * FLASH_SECTOR_SIZE, FLASH_SECTOR_SIZE);
+}
+
+// 让第i个扇区在本会话中可写：空白的直接标记，否则提交擦除，不等待完成
+static uint8_t erase_sector_start(struct firmware_opt_t *this, uint32_t i)
+{
+	uint8_t status = FIRMWARE_OPT_SUCCESS;
+
+	if ((this->erase_ready | this->erase_busy) & (1u << i)) {
+		return status;
+	}
+	if (erase_sector_blank(this, i)) {
+		this->erase_ready |= 1u << i;
+		return status;
+	}
+	if (sector_erase_async(firm_sector(this) + i, 1, FIRMWARE_ERASE_FLAG(i)) != INTERNAL_FLASH_OK) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	this->erase_busy |= 1u << i;
+
+	return status;
+}
+
+static uint8_t erase_sector_wait(struct firmware_opt_t *this, uint32_t i)
+{
+	uint8_t status = FIRMWARE_OPT_SUCCESS;
+
+	if (!(this->erase_busy & (1u << i))) {
+		return status;
+	}
+	this->erase_busy &= ~(1u << i);
+	if (flash_wait(FIRMWARE_ERASE_FLAG(i)) != INTERNAL_FLASH_OK) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	this->erase_ready |= 1u << i;
+
+	return status;
+}
+
+static void erase_sync(struct firmware_opt_t *this)
+{
+	uint32_t i;
+
+	for (i = 0; i < BOOTLOADER_FIRMWARE_SECTOR_COUNT; i++) {
+		erase_sector_wait(this, i);
+	}
+}
+
+/*
+ * 写入firmware区域[offset, offset + len)之前调用，保证所在扇区已擦除，
+ * 写入位置接近扇区末尾时提前开始擦除下一个扇区。
+ */
+static uint8_t erase_ensure(struct firmware_opt_t *this, uint32_t offset, uint32_t len)
+{
+	uint8_t status = FIRMWARE_OPT_SUCCESS;
+	uint32_t end = offset + len;
+	uint32_t next;
+	uint32_t i;
+
+	if (len == 0) {
+		return status;
+	}
+	for (i = offset / FLASH_SECTOR_SIZE; i <= (end - 1) / FLASH_SECTOR_SIZE; i++) {
+		status = erase_sector_start(this, i);
+		if (status != FIRMWARE_OPT_SUCCESS) {
+			return status;
+		}
+		status = erase_sector_wait(this, i);
+		if (status != FIRMWARE_OPT_SUCCESS) {
+			return status;
+		}
+	}
+
+	next = i * FLASH_SECTOR_SIZE;
+	if (next - end < FIRMWARE_ERASE_AHEAD && next < this->erase_limit) {
+		status = erase_sector_start(this, i);
+	}
+
+	return status;
+}
+
+/*
+ * 还原流水线：DATA帧 -> [解压] -> [增量补丁] -> firmware区域
+ * stream_write接收解压后（或本来就未压缩）的数据，offset为该数据在码流中的位置
+ */
+static uint8_t stream_write(struct firmware_opt_t *this, uint32_t offset, uint8_t *data, uint32_t len)
 {
 	uint8_t status = 0;
-	struct firmware_trans_protocol_t *f = (struct firmware_trans_protocol_t *)data;
 
-	status = frame_check(this, data, f->crc, f->len);
-	if (status == FIRMWARE_OPT_FAIL) {
+	if (this->image_flags & FIRMWARE_IMAGE_FLAG_DELTA) {
+		status = this->patch.input(&this->patch, data, len);
+		status = (status == DELTA_PATCH_SUCCESS) ? FIRMWARE_OPT_SUCCESS : FIRMWARE_OPT_FAIL;
+		return status;
+	}
+
+	status = erase_ensure(this, offset, len);
+	if (status != FIRMWARE_OPT_SUCCESS) {
+		return status;
+	}
+	status = flash_write(this->firm_start_addr + offset, data, len);
+	status = (status == INTERNAL_FLASH_OK) ? FIRMWARE_OPT_SUCCESS : FIRMWARE_OPT_FAIL;
+	return status;
+}
+
+static uint8_t image_input(struct firmware_opt_t *this, uint32_t offset, uint8_t *data, uint32_t len)
+{
+	uint8_t status = 0;
+
+	if (this->image_flags & FIRMWARE_IMAGE_FLAG_COMPRESSED) {
+		status = this->decomp.input(&this->decomp, data, len);
+		status = (status == DECOMPRESS_SUCCESS) ? FIRMWARE_OPT_SUCCESS : FIRMWARE_OPT_FAIL;
+		return status;
+	}
+
+	return stream_write(this, offset, data, len);
+}
+
+// 所有帧都已处理，冲刷流水线中剩余的数据并检查还原结果的长度
+static uint8_t image_finish(struct firmware_opt_t *this)
+{
+	uint8_t status = FIRMWARE_OPT_SUCCESS;
+
+	if (this->image_flags & FIRMWARE_IMAGE_FLAG_COMPRESSED) {
+		if (this->decomp.finish(&this->decomp) != DECOMPRESS_SUCCESS) {
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+		if (!(this->image_flags & FIRMWARE_IMAGE_FLAG_DELTA) && this->decomp.out_pos != this->image_size) {
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+	}
+	if (this->image_flags & FIRMWARE_IMAGE_FLAG_DELTA) {
+		if (this->patch.finish(&this->patch) != DELTA_PATCH_SUCCESS || this->patch.out_pos != this->image_size) {
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+	}
+	if (this->image_crc != 0 && crc32_update(0, (uint8_t *)this->firm_start_addr, this->image_size) != this->image_crc) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+
+	return status;
+}
+
+/*
+ * 续传会话中，日志记录点之后的帧在断开前可能已经全部或部分写入flash。
+ * 按flash字比较：内容一致的跳过，仍为擦除状态的编程，
+ * 其他情况说明与本次数据不一致，flash不能覆盖写，只能失败。
+ */
+static uint8_t frame_merge(struct firmware_opt_t *this, uint32_t offset, uint8_t *data, uint32_t len)
+{
+	uint8_t status = 0;
+	const uint32_t word = FLASH_NB_32BITWORD_IN_FLASHWORD * 4u;
+	uint32_t addr = this->firm_start_addr + offset;
+	uint8_t *flash = (uint8_t *)addr;
+	uint32_t run = 0;
+	uint32_t run_len = 0;
+	uint32_t pos;
+	uint32_t n;
+	uint32_t i;
+
+	// 续传点之后的扇区可能还是更早的镜像，写入前按需擦除
+	status = erase_ensure(this, offset, len);
+	if (status != FIRMWARE_OPT_SUCCESS) {
+		return status;
+	}
+	for (pos = 0; pos < len; pos += word) {
+		n = (len - pos < word) ? len - pos : word;
+		if (memcmp(flash + pos, data + pos, n) == 0) {
+			// 已写入的部分，先把之前累积的空白区间编程
+			if (run_len > 0 && flash_write(addr + run, data + run, run_len) != INTERNAL_FLASH_OK) {
+				status = FIRMWARE_OPT_FAIL;
+				return status;
+			}
+			run_len = 0;
+			continue;
+		}
+		for (i = 0; i < word && flash[pos + i] == 0xFF; i++) {
+		}
+		if (i != word) {
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+		if (run_len == 0) {
+			run = pos;
+		}
+		run_len += n;
+	}
+	if (run_len > 0 && flash_write(addr + run, data + run, run_len) != INTERNAL_FLASH_OK) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+
+	status = FIRMWARE_OPT_SUCCESS;
+	return status;
+}
+
+/*
+ * 每帧在firmware区域中的位置由序号决定（index * frame_size），
+ * 因此乱序到达的帧可以直接写入最终位置，flash本身就是接收缓冲区，
+ * 不需要在RAM中暂存窗口内的帧。
+ */
+static uint8_t frame_place(struct firmware_opt_t *this, uint32_t index, uint8_t *data, uint32_t len)
+{
+	uint8_t status = 0;
+	uint32_t offset = 0;
+	uint8_t hash[FIRMWARE_HASH_SIZE];
+
+	if (index >= this->total_frame) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	// 重复帧（主机重传）直接确认，flash不能重复编程
+	if (frame_received(this, index)) {
+		status = FIRMWARE_OPT_SUCCESS;
+		return status;
+	}
+	// 停等模式下只接收期望的那一帧
+	if (this->window <= 1 && index != this->index) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+
+	// 除最后一帧外必须是满帧，最后一帧长度必须与总字节数吻合
+	offset = index * this->frame_size;
+	if (index == this->total_frame - 1) {
+		if (offset + len != this->total_byte) {
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+	} else if (len != this->frame_size) {
+		status = FIRMWARE_OPT_FAIL;
 		return status;
 	}
-	if (f->index != this->index) {
+
+	// 压缩码流和增量补丁只能按序处理
+	if ((this->image_flags & FIRMWARE_IMAGE_FLAG_IN_ORDER) && index != this->index) {
 		status = FIRMWARE_OPT_FAIL;
 		return status;
 	}
-	status = flash_write(this->firm_current_addr, f->data, f->len);
-	if (status == INTERNAL_FLASH_ERROR) {
+	// 写flash之前先按清单校验，不符说明镜像不可信，中止整个会话
+	if (this->manifest) {
+		manifest_leaf_hash(data, len, hash);
+		if (memcmp(hash, manifest_leaf[index], FIRMWARE_HASH_SIZE) != 0) {
+			firmware_opt_init(this);
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+	} else if (FIRMWARE_MANIFEST_REQUIRED) {
 		status = FIRMWARE_OPT_FAIL;
-		return status;	
+		return status;
+	}
+	if (this->resumed) {
+		status = frame_merge(this, offset, data, len);
+	} else {
+		status = image_input(this, offset, data, len);
+	}
+	if (status != FIRMWARE_OPT_SUCCESS) {
+		return status;
+	}
+	this->recv_bitmap[index / 32] |= 1u << (index % 32);
+	this->recv_frame++;
+
+	// 推进累计确认点
+	while (this->index < this->total_frame && frame_received(this, this->index)) {
+		this->index++;
+	}
+	if (this->image_flags & FIRMWARE_IMAGE_FLAG_DELTA) {
+		offset = this->patch.out_pos;
+	} else if (this->image_flags & FIRMWARE_IMAGE_FLAG_COMPRESSED) {
+		offset = this->decomp.out_pos;
+	} else {
+		offset = this->index * this->frame_size;
+	}
+	this->firm_current_addr = this->firm_start_addr + (offset < this->image_size ? offset : this->image_size);
+
+	// 累计确认点每前进FIRMWARE_JOURNAL_INTERVAL字节记录一次进度，日志写失败只影响续传，不影响本次接收
+	if (this->session != 0 && this->index < this->total_frame &&
+		(this->index - this->journal_committed) * this->frame_size >= FIRMWARE_JOURNAL_INTERVAL) {
+		journal_append(this, this->index, FIRMWARE_JOURNAL_RECEIVING);
 	}
-	this->index++;
-	this->firm_current_addr += f->len;
 
 	// 判断是否接收完成
-	if (this->index == f->total_frame && this->firm_current_addr == this->firm_start_addr + f->total_byte) {
-		status = FIRMWARE_OPT_RECV_CPLT;
+	if (this->index != this->total_frame) {
+		status = FIRMWARE_OPT_SUCCESS;
+		return status;
 	}
+	status = image_finish(this);
+	if (status != FIRMWARE_OPT_SUCCESS) {
+		return status;
+	}
+	this->firm_current_addr = this->firm_start_addr + this->image_size;
+	status = FIRMWARE_OPT_RECV_CPLT;
 
 	return status;
 }
 
-static uint8_t firmware_write(struct firmware_opt_t *this)
+static uint32_t journal_crc(struct firmware_journal_t *j)
+{
+	return crc32_update(0, (uint8_t *)j, offsetof(struct firmware_journal_t, crc));
+}
+
+// 扫描日志区，取最后一条有效记录，并定位下一条记录的写入位置
+static uint8_t journal_scan(struct firmware_opt_t *this, struct firmware_journal_t *last)
+{
+	struct firmware_journal_t *j = (struct firmware_journal_t *)journal_base(this);
+	uint8_t found = 0;
+	uint32_t i;
+
+	SCB_InvalidateDCache_by_Addr((uint32_t *)journal_base(this), BOOTLOADER_JOURNAL_SIZE);
+	for (i = 0; i < FIRMWARE_JOURNAL_ENTRIES; i++) {
+		// 写入中掉电的记录可能ECC校验不过，不读它的内容，也不是末尾
+		if (!region_readable(this, BOOTLOADER_FIRMWARE_DATA_SIZE + i * sizeof(*j), sizeof(*j))) {
+			continue;
+		}
+		// 整条记录空白才是末尾，写入中掉电的记录可能magic还是全1而其他字已编程
+		if (region_blank(this, BOOTLOADER_FIRMWARE_DATA_SIZE + i * sizeof(*j), sizeof(*j))) {
+			break;
+		}
+		// 写入过程中掉电的记录校验不通过，跳过即可
+		if (j[i].magic == FIRMWARE_JOURNAL_MAGIC && j[i].crc == journal_crc(&j[i])) {
+			*last = j[i];
+			found = 1;
+		}
+	}
+	this->journal_slot = i;
+
+	return found;
+}
+
+// 在下一个位置写入一条记录，magic、session和crc在这里填写
+static uint8_t journal_write(struct firmware_opt_t *this, struct firmware_journal_t *j)
 {
 	uint8_t status = 0;
-	uint32_t bytes = 0;
 
-	bytes = this->firm_current_addr - this->firm_start_addr;
-	status = sector_erase(APP_SECTOR_START, APP_SECTOR_COUNT);
-	if (status == FIRMWARE_OPT_FAIL) {
+	if (this->journal_slot >= FIRMWARE_JOURNAL_ENTRIES) {
+		status = FIRMWARE_OPT_FAIL;
 		return status;
 	}
-	status = flash_write(APP_BASE, (uint8_t *)this->app_start_addr, bytes);
+	j->magic	= FIRMWARE_JOURNAL_MAGIC;
+	j->session	= this->session;
+	j->crc		= journal_crc(j);
+
+	status = flash_write(journal_base(this) + this->journal_slot * sizeof(*j), (uint8_t *)j, sizeof(*j));
+	// 写失败的位置可能已部分编程，同样不再使用
+	this->journal_slot++;
 	if (status != INTERNAL_FLASH_OK) {
 		status = FIRMWARE_OPT_FAIL;
-		return status;	
+		return status;
+	}
+
+	status = FIRMWARE_OPT_SUCCESS;
+	return status;
+}
+
+static uint8_t journal_append(struct firmware_opt_t *this, uint32_t committed, uint32_t state)
+{
+	uint8_t status = 0;
+	struct firmware_journal_t j;
+
+	memset(&j, 0xFF, sizeof(j));
+	j.committed	= committed;
+	j.state		= state;
+	status = journal_write(this, &j);
+	if (status != FIRMWARE_OPT_SUCCESS) {
+		return status;
+	}
+	this->journal_committed = committed;
+
+	return status;
+}
+
+void firmware_journal_abandon(struct firmware_opt_t *this)
+{
+	struct firmware_journal_t last;
+
+	if (journal_scan(this, &last) &&
+		(last.state == FIRMWARE_JOURNAL_RECEIVING || last.state == FIRMWARE_JOURNAL_COPYING)) {
+		journal_append(this, 0, FIRMWARE_JOURNAL_DONE);
+	}
+}
+
+// 会话描述：决定firmware区域中每个字节内容的全部参数
+static uint32_t session_id(struct firmware_opt_t *this)
+{
+	uint32_t desc[6];
+	uint32_t crc;
+
+	desc[0] = this->version;
+	desc[1] = this->total_byte;
+	desc[2] = this->frame_size;
+	desc[3] = this->image_flags;
+	desc[4] = this->image_size;
+	desc[5] = this->image_crc;
+	crc = crc32_update(0, (uint8_t *)desc, sizeof(desc));
+
+	return crc != 0 ? crc : 1;
+}
+
+/*
+ * 从日志记录的续传点继续。续传点之前的数据是本会话写入的，所在扇区不能再擦除；
+ * 之后的扇区可能还保存着更早的镜像，交给erase_ensure在写入时检查并擦除。
+ * 续传点所在扇区的剩余部分不空白时（掉电时正在编程的字，或乱序先到的帧），
+ * 续传点退回到该扇区开头，整个扇区擦除后重写。日志区所在扇区的数据部分不空白时
+ * 只能连同日志一起擦除，擦除后重新写入续传点。
+ */
+static uint8_t session_resume(struct firmware_opt_t *this, uint32_t committed)
+{
+	uint8_t status = 0;
+	uint32_t cursor = committed * this->frame_size;
+	uint32_t sector = cursor / FLASH_SECTOR_SIZE;
+	uint32_t journal = BOOTLOADER_FIRMWARE_DATA_SIZE / FLASH_SECTOR_SIZE;
+	uint32_t end = (sector + 1) * FLASH_SECTOR_SIZE;
+	uint32_t i;
+
+	if (end > BOOTLOADER_FIRMWARE_DATA_SIZE) {
+		end = BOOTLOADER_FIRMWARE_DATA_SIZE;
+	}
+	this->erase_limit = (this->image_size != 0) ? this->image_size : BOOTLOADER_FIRMWARE_DATA_SIZE;
+	this->erase_ready = (1u << sector) - 1u;
+	if (cursor % FLASH_SECTOR_SIZE != 0) {
+		if (region_blank(this, cursor, end - cursor)) {
+			this->erase_ready |= 1u << sector;
+		} else {
+			committed = sector * FLASH_SECTOR_SIZE / this->frame_size;
+		}
+	}
+	this->journal_committed = committed;
+	if (!(this->erase_ready & (1u << journal))) {
+		if (region_blank(this, journal * FLASH_SECTOR_SIZE, BOOTLOADER_FIRMWARE_DATA_SIZE - journal * FLASH_SECTOR_SIZE)) {
+			this->erase_ready |= 1u << journal;
+		} else {
+			status = erase_ensure(this, BOOTLOADER_FIRMWARE_DATA_SIZE, BOOTLOADER_JOURNAL_SIZE);
+			if (status != FIRMWARE_OPT_SUCCESS) {
+				return status;
+			}
+			this->journal_slot = 0;
+			journal_append(this, committed, FIRMWARE_JOURNAL_RECEIVING);
+		}
+	}
+
+	for (i = 0; i < committed; i++) {
+		this->recv_bitmap[i / 32] |= 1u << (i % 32);
+	}
+	this->index = committed;
+	this->recv_frame = committed;
+	this->firm_current_addr = this->firm_start_addr + this->index * this->frame_size;
+	this->resumed = 1;
+
+	status = FIRMWARE_OPT_SUCCESS;
+	return status;
+}
+
+/*
+ * 会话参数确定后调用。日志中最后一条记录属于同一镜像且未完成时从记录点继续，
+ * 否则清空日志区重新开始，镜像所在的扇区在写入时才擦除。
+ */
+static uint8_t session_open(struct firmware_opt_t *this)
+{
+	uint8_t status = 0;
+	struct firmware_journal_t last;
+
+	this->session = 0;
+	if (this->image_crc != 0 && !(this->image_flags & FIRMWARE_IMAGE_FLAG_IN_ORDER)) {
+		this->session = session_id(this);
+		if (journal_scan(this, &last) && last.session == this->session &&
+			last.state == FIRMWARE_JOURNAL_RECEIVING && last.committed < this->total_frame) {
+			status = session_resume(this, last.committed);
+			return status;
+		}
+	}
+
+	// 日志区所在的扇区不空白就擦除，旧会话的记录不能留下；总长未知时按整个区域
+	this->erase_limit = (this->image_size != 0) ? this->image_size : BOOTLOADER_FIRMWARE_DATA_SIZE;
+	status = erase_ensure(this, BOOTLOADER_FIRMWARE_DATA_SIZE, BOOTLOADER_JOURNAL_SIZE);
+	if (status != FIRMWARE_OPT_SUCCESS) {
+		return status;
+	}
+	this->journal_slot = 0;
+	this->journal_committed = 0;
+	if (this->session != 0) {
+		journal_append(this, 0, FIRMWARE_JOURNAL_RECEIVING);
+	}
+
+	status = FIRMWARE_OPT_SUCCESS;
+	return status;
+}
+
+/*
+ * 没有会话，或本会话的镜像已写入app区域时，逐个扇区预先擦除firmware区域。
+ * 每次最多擦除一个扇区，返回后写flash线程先检查消息队列。
+ * A/B布局下firmware区域是保存上一版本的槽，留作回退，不预先擦除。
+ */
+static uint8_t staging_idle(struct firmware_opt_t *this)
+{
+	struct firmware_journal_t last;
+	uint32_t i;
+
+	if (FIRMWARE_SLOT_AB || (this->version != 0 && !this->applied) || this->erase_ready == FIRMWARE_ERASE_ALL) {
+		return 0;
+	}
+	// 中断的会话可以续传，中断的app写入还要从这里继续，都保留firmware区域
+	if (journal_scan(this, &last) &&
+		(last.state == FIRMWARE_JOURNAL_RECEIVING || last.state == FIRMWARE_JOURNAL_COPYING)) {
+		return 0;
+	}
+
+	erase_sync(this);
+	for (i = 0; i < BOOTLOADER_FIRMWARE_SECTOR_COUNT; i++) {
+		if (this->erase_ready & (1u << i)) {
+			continue;
+		}
+		if (erase_sector_blank(this, i)) {
+			this->erase_ready |= 1u << i;
+			continue;
+		}
+		if (sector_erase(firm_sector(this) + i, 1) != INTERNAL_FLASH_OK) {
+			return 0;
+		}
+		this->erase_ready |= 1u << i;
+		return 1;
+	}
+
+	return 0;
+}
+
+static uint8_t v1_frame_store(struct firmware_opt_t *this, struct firmware_trans_protocol_t *f)
+{
+	uint8_t status = 0;
+
+	if (f->len > sizeof(f->data)) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	// crc只覆盖数据段的有效部分
+	status = frame_check(this, f->data, f->crc, f->len);
+	if (status == FIRMWARE_OPT_FAIL) {
+		return status;
+	}
+
+	// 第一帧确定本次会话的总帧数和总字节数，之后每帧必须一致
+	if (this->version == 0) {
+		if (f->total_byte == 0 || f->total_byte > BOOTLOADER_FIRMWARE_DATA_SIZE ||
+			f->total_frame != (f->total_byte + FIRMWARE_FRAME_DATA_SIZE - 1) / FIRMWARE_FRAME_DATA_SIZE) {
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+		this->version = 1;
+		this->frame_size = FIRMWARE_FRAME_DATA_SIZE;
+		this->total_frame = f->total_frame;
+		this->total_byte = f->total_byte;
+		this->image_size = f->total_byte;
+		status = session_open(this);
+		if (status != FIRMWARE_OPT_SUCCESS) {
+			this->version = 0;
+			return status;
+		}
+	} else if (this->version != 1 || f->total_frame != this->total_frame || f->total_byte != this->total_byte) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+
+	return frame_place(this, f->index, f->data, f->len);
+}
+
+// 解压输出送往流水线的下一级
+static uint8_t decompress_output(struct decompress_t *decomp, uint32_t offset, uint8_t *data, uint32_t len)
+{
+	struct firmware_opt_t *this = (struct firmware_opt_t *)decomp->arg;
+
+	if (stream_write(this, offset, data, len) != FIRMWARE_OPT_SUCCESS) {
+		return DECOMPRESS_FAIL;
+	}
+
+	return DECOMPRESS_SUCCESS;
+}
+
+// 补丁还原出的新镜像写入firmware区域的对应位置
+static uint8_t patch_output(struct delta_patch_t *patch, uint32_t offset, uint8_t *data, uint32_t len)
+{
+	struct firmware_opt_t *this = (struct firmware_opt_t *)patch->arg;
+
+	if (erase_ensure(this, offset, len) != FIRMWARE_OPT_SUCCESS) {
+		return DELTA_PATCH_FAIL;
+	}
+	if (flash_write(this->firm_start_addr + offset, data, len) != INTERNAL_FLASH_OK) {
+		return DELTA_PATCH_FAIL;
+	}
+
+	return DELTA_PATCH_SUCCESS;
+}
+
+// 解析START帧数据段中的镜像头
+static uint8_t image_header_parse(struct firmware_opt_t *this, struct firmware_v2_header_t *h)
+{
+	uint8_t status = 0;
+	struct firmware_image_header_t *img = (struct firmware_image_header_t *)((uint8_t *)h + sizeof(*h));
+
+	if (h->len < sizeof(*img)) {
+		this->image_flags = 0;
+		this->image_size = h->total_byte;
+		this->image_crc = 0;
+		status = FIRMWARE_OPT_SUCCESS;
+		return status;
+	}
+
+	if (img->image_size == 0 || img->image_size > BOOTLOADER_FIRMWARE_DATA_SIZE) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	this->image_flags = img->flags;
+	this->image_size = img->image_size;
+	this->image_crc = img->image_crc;
+
+	// 增量补丁以当前app为参考，先确认参考镜像与主机生成补丁时使用的一致
+	if (img->flags & FIRMWARE_IMAGE_FLAG_DELTA) {
+		if (img->ref_size == 0 || img->ref_size > APP_SIZE ||
+			crc32_update(0, (uint8_t *)this->app_start_addr, img->ref_size) != img->ref_crc) {
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+		status = delta_patch_init(&this->patch, (uint8_t *)this->app_start_addr, img->ref_size, patch_buffer,
+				img->image_size, patch_output, this);
+		if (status != DELTA_PATCH_SUCCESS) {
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+	}
+
+	if (img->flags & FIRMWARE_IMAGE_FLAG_COMPRESSED) {
+		// 压缩的补丁解压后长度未知，由补丁自身限制还原长度
+		status = decompress_init(&this->decomp, decompress_window, img->window_bits, img->lookahead_bits,
+				(img->flags & FIRMWARE_IMAGE_FLAG_DELTA) ? UINT32_MAX : img->image_size, decompress_output, this);
+		if (status != DECOMPRESS_SUCCESS) {
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+	} else if (!(img->flags & FIRMWARE_IMAGE_FLAG_DELTA) && img->image_size != h->total_byte) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+
+	status = FIRMWARE_OPT_SUCCESS;
+	return status;
+}
+
+// v2会话开始，确定本机采用的frame_size：不小于1KB，不超过接收缓冲区，按flash字对齐
+static uint8_t v2_session_start(struct firmware_opt_t *this, struct firmware_v2_header_t *h)
+{
+	uint8_t status = 0;
+	uint32_t frame_size = h->frame_size;
+
+	if (this->recv_frame != 0) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	if (h->total_byte == 0 || h->total_byte > BOOTLOADER_FIRMWARE_DATA_SIZE) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	if (frame_size == 0 || frame_size > FIRMWARE_V2_BUF_FRAME_SIZE) {
+		frame_size = FIRMWARE_V2_BUF_FRAME_SIZE;
+	}
+	if (frame_size < FIRMWARE_FRAME_DATA_SIZE) {
+		frame_size = FIRMWARE_FRAME_DATA_SIZE;
+	}
+	frame_size &= ~(FLASH_NB_32BITWORD_IN_FLASHWORD * 4u - 1u);
+
+	status = image_header_parse(this, h);
+	if (status != FIRMWARE_OPT_SUCCESS) {
+		return status;
+	}
+
+	this->version = 2;
+	this->frame_size = frame_size;
+	this->total_byte = h->total_byte;
+	this->total_frame = (h->total_byte + frame_size - 1) / frame_size;
+
+	status = session_open(this);
+	if (status != FIRMWARE_OPT_SUCCESS) {
+		this->version = 0;
+		return status;
+	}
+
+	status = FIRMWARE_OPT_SUCCESS;
+	return status;
+}
+
+/*
+ * 清单必须与当前会话的参数一致。验证通过后保存叶子哈希，
+ * 之前已在flash中的帧（续传恢复的帧）按flash内容逐帧校验，只有未压缩镜像flash内容与帧数据相同。
+ */
+static uint8_t v2_manifest(struct firmware_opt_t *this, struct firmware_v2_header_t *h)
+{
+	uint8_t status = 0;
+	struct firmware_manifest_t *m = (struct firmware_manifest_t *)((uint8_t *)h + sizeof(*h));
+	uint8_t *leaf = (uint8_t *)(m + 1);
+	uint8_t hash[FIRMWARE_HASH_SIZE];
+	uint32_t len;
+	uint32_t i;
+
+	if (this->version != 2 || this->manifest || h->len < sizeof(*m) ||
+		m->total_byte != this->total_byte || m->frame_size != this->frame_size ||
+		m->leaf_count != this->total_frame || h->len != sizeof(*m) + m->leaf_count * FIRMWARE_HASH_SIZE ||
+		(this->recv_frame != 0 && (this->image_flags & FIRMWARE_IMAGE_FLAG_IN_ORDER))) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	if (manifest_verify(m, leaf) != MANIFEST_SUCCESS) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	memcpy(manifest_leaf, leaf, m->leaf_count * FIRMWARE_HASH_SIZE);
+
+	for (i = 0; i < this->total_frame; i++) {
+		if (!frame_received(this, i)) {
+			continue;
+		}
+		len = this->total_byte - i * this->frame_size;
+		if (len > this->frame_size) {
+			len = this->frame_size;
+		}
+		manifest_leaf_hash((uint8_t *)(this->firm_start_addr + i * this->frame_size), len, hash);
+		if (memcmp(hash, manifest_leaf[i], FIRMWARE_HASH_SIZE) != 0) {
+			firmware_opt_init(this);
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+	}
+	this->manifest = 1;
+
+	status = FIRMWARE_OPT_SUCCESS;
+	return status;
+}
+
+static uint8_t v2_frame_store(struct firmware_opt_t *this, struct firmware_v2_header_t *h)
+{
+	uint8_t status = 0;
+	struct firmware_v2_header_t head;
+	uint32_t crc;
+
+	if (h->len > FIRMWARE_V2_BUF_FRAME_SIZE) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	// crc覆盖帧头（crc字段按0计算）和数据段
+	head = *h;
+	head.crc = 0;
+	crc = crc32_update(0, (uint8_t *)&head, sizeof(head));
+	crc = crc32_update(crc, (uint8_t *)h + sizeof(*h), h->len);
+	if (crc != h->crc) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+
+	if (h->type == FIRMWARE_V2_TYPE_START) {
+		return v2_session_start(this, h);
+	}
+	if (h->type == FIRMWARE_V2_TYPE_MANIFEST) {
+		return v2_manifest(this, h);
+	}
+	if (h->type != FIRMWARE_V2_TYPE_DATA || this->version != 2 ||
+		h->total_frame != this->total_frame || h->total_byte != this->total_byte) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+
+	return frame_place(this, h->index, (uint8_t *)h + sizeof(*h), h->len);
+}
+
+static uint8_t frame_recv(struct firmware_opt_t *this, uint8_t *data, uint32_t len)
+{
+	uint8_t status = 0;
+
+	if (len >= sizeof(struct firmware_v2_header_t) && ((struct firmware_v2_header_t *)data)->magic == FIRMWARE_V2_MAGIC) {
+		status = v2_frame_store(this, (struct firmware_v2_header_t *)data);
 	} else {
-		status = FIRMWARE_OPT_WRITE_CPLT;
+		status = v1_frame_store(this, (struct firmware_trans_protocol_t *)data);
+	}
+	this->last_status = status;
+
+	return status;
+}
+
+/*
+ * 按偏移写入：第一段数据开始会话并擦除firmware区域，总长度在结束时才确定。
+ * 数据已由传输层保证按序，这里只检查连续性，段与段之间经写合并流拼成整flash字。
+ */
+static uint8_t stage_write(struct firmware_opt_t *this, uint32_t offset, uint8_t *data, uint32_t len)
+{
+	uint8_t status = 0;
+
+	if (FIRMWARE_MANIFEST_REQUIRED) {
+		status = FIRMWARE_OPT_FAIL;
+		this->last_status = status;
+		return status;
+	}
+	if (this->version == 0 && offset == 0) {
+		this->version = FIRMWARE_OPT_VERSION_STAGE;
+		this->image_flags = 0;
+		this->image_crc = 0;
+		status = session_open(this);
+		if (status != FIRMWARE_OPT_SUCCESS) {
+			this->version = 0;
+			this->last_status = status;
+			return status;
+		}
+		flash_stream_init(&this->stream, this->firm_start_addr, flash_write);
+	}
+	if (this->version != FIRMWARE_OPT_VERSION_STAGE || offset != this->firm_current_addr - this->firm_start_addr ||
+		len > BOOTLOADER_FIRMWARE_DATA_SIZE - offset) {
+		status = FIRMWARE_OPT_FAIL;
+		this->last_status = status;
+		return status;
+	}
+
+	status = erase_ensure(this, offset, len);
+	if (status != FIRMWARE_OPT_SUCCESS) {
+		this->last_status = status;
+		return status;
+	}
+	status = flash_stream_write(&this->stream, data, len);
+	status = (status == INTERNAL_FLASH_OK) ? FIRMWARE_OPT_SUCCESS : FIRMWARE_OPT_FAIL;
+	if (status == FIRMWARE_OPT_SUCCESS) {
+		this->firm_current_addr += len;
+	}
+	this->last_status = status;
+
+	return status;
+}
+
+static uint8_t stage_finish(struct firmware_opt_t *this, uint32_t total_byte)
+{
+	uint8_t status = 0;
+
+	if (this->version != FIRMWARE_OPT_VERSION_STAGE || this->last_status != FIRMWARE_OPT_SUCCESS ||
+		total_byte == 0 || total_byte != this->firm_current_addr - this->firm_start_addr) {
+		status = FIRMWARE_OPT_FAIL;
+		this->last_status = status;
+		return status;
+	}
+	// 最后一段的尾部还在写合并流中
+	if (flash_stream_flush(&this->stream) != INTERNAL_FLASH_OK) {
+		status = FIRMWARE_OPT_FAIL;
+		this->last_status = status;
+		return status;
+	}
+	this->total_byte = total_byte;
+	this->image_size = total_byte;
+	status = FIRMWARE_OPT_RECV_CPLT;
+	this->last_status = status;
+
+	return status;
+}
+
+static uint8_t shard_open(struct firmware_opt_t *this, const struct firmware_shard_info_t *info)
+{
+	uint8_t status = 0;
+
+	if (this->version != 0 || info->total_byte == 0 || info->total_byte > BOOTLOADER_FIRMWARE_DATA_SIZE ||
+		info->shard_size < FIRMWARE_FRAME_DATA_SIZE || info->shard_size > FIRMWARE_V2_BUF_FRAME_SIZE ||
+		(info->shard_size & (FLASH_NB_32BITWORD_IN_FLASHWORD * 4u - 1u)) != 0 ||
+		info->block_shards == 0 || info->block_shards > 32) {
+		status = FIRMWARE_OPT_FAIL;
+		this->last_status = status;
+		return status;
+	}
+
+	this->version = FIRMWARE_OPT_VERSION_SHARD;
+	this->frame_size = info->shard_size;
+	this->block_shards = info->block_shards;
+	this->total_byte = info->total_byte;
+	this->total_frame = (info->total_byte + info->shard_size - 1) / info->shard_size;
+	this->image_flags = 0;
+	this->image_size = info->total_byte;
+	this->image_crc = info->image_crc;
+	status = session_open(this);
+	if (status != FIRMWARE_OPT_SUCCESS) {
+		this->version = 0;
+	}
+	this->last_status = status;
+
+	return status;
+}
+
+// data为整个FEC块的数据分片，分片j位于data + j * shard_size
+static uint8_t shard_place(struct firmware_opt_t *this, uint32_t block, uint8_t *data, uint32_t mask)
+{
+	uint8_t status = FIRMWARE_OPT_SUCCESS;
+	uint32_t index;
+	uint32_t len;
+	uint32_t j;
+
+	if (this->version != FIRMWARE_OPT_VERSION_SHARD) {
+		status = FIRMWARE_OPT_FAIL;
+		this->last_status = status;
+		return status;
+	}
+	for (j = 0; j < this->block_shards && status == FIRMWARE_OPT_SUCCESS; j++) {
+		if (!(mask & (1u << j))) {
+			continue;
+		}
+		index = block * this->block_shards + j;
+		if (index >= this->total_frame) {
+			status = FIRMWARE_OPT_FAIL;
+			break;
+		}
+		len = this->total_byte - index * this->frame_size;
+		if (len > this->frame_size) {
+			len = this->frame_size;
+		}
+		status = frame_place(this, index, data + j * this->frame_size, len);
+	}
+	this->last_status = status;
+
+	return status;
+}
+
+static void frame_ack(struct firmware_opt_t *this, struct firmware_ack_t *ack)
+{
+	uint32_t i;
+	uint32_t index;
+
+	ack->magic		= FIRMWARE_ACK_MAGIC;
+	ack->next_index	= this->index;
+	ack->sack		= 0;
+	ack->window		= this->window;
+	ack->status		= this->last_status;
+	ack->frame_size	= this->frame_size;
+
+	for (i = 0; i < 32; i++) {
+		index = this->index + 1 + i;
+		if (index >= this->total_frame) {
+			break;
+		}
+		if (frame_received(this, index)) {
+			ack->sack |= 1u << i;
+		}
+	}
+}
+
+// 新镜像中offset处所在扇区的数据来源
+static const uint8_t *image_sector(struct firmware_opt_t *this, uint32_t offset)
+{
+	if (this->keep_sectors & (1u << (offset / FLASH_SECTOR_SIZE))) {
+		return (const uint8_t *)(this->app_start_addr + offset);
+	}
+	return (const uint8_t *)(this->firm_start_addr + offset);
+}
+
+uint8_t firmware_image_crc(struct firmware_opt_t *this, uint32_t bytes, uint32_t *crc)
+{
+	const uint8_t *src;
+	uint32_t offset;
+	uint32_t len;
+
+	*crc = 0;
+	for (offset = 0; offset < bytes; offset += FLASH_SECTOR_SIZE) {
+		len = bytes - offset < FLASH_SECTOR_SIZE ? bytes - offset : FLASH_SECTOR_SIZE;
+		src = image_sector(this, offset);
+		if (flash_check((uint32_t)(uintptr_t)src, len) != INTERNAL_FLASH_OK) {
+			return FIRMWARE_OPT_FAIL;
+		}
+		*crc = firmware_crc32(*crc, src, len);
+	}
+
+	return FIRMWARE_OPT_SUCCESS;
+}
+
+// app扇区已经是写入后的内容：前len字节与新镜像相同，其余为擦除状态；有ECC错误的扇区重写
+static uint8_t app_sector_same(struct firmware_opt_t *this, uint32_t offset, uint32_t len)
+{
+	const uint8_t *app = (const uint8_t *)(this->app_start_addr + offset);
+	uint32_t i;
+
+	if (flash_check(this->app_start_addr + offset, FLASH_SECTOR_SIZE) != INTERNAL_FLASH_OK) {
+		return 0;
+	}
+	if (memcmp(app, (const uint8_t *)(this->firm_start_addr + offset), len) != 0) {
+		return 0;
+	}
+	for (i = len; i < FLASH_SECTOR_SIZE && (i & 3u) != 0; i++) {
+		if (app[i] != 0xFF) {
+			return 0;
+		}
+	}
+	for (; i < FLASH_SECTOR_SIZE; i += 4) {
+		if (*(const uint32_t *)(app + i) != 0xFFFFFFFFu) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// A/B布局：新镜像写入非活动槽，活动槽作为增量补丁等的参考镜像
+static void slot_select(struct firmware_opt_t *this)
+{
+	struct firmware_slot_t rec;
+	uint32_t active;
+
+	active = firmware_slot_active(&rec);
+	if (active == FIRMWARE_SLOT_NONE) {
+		// 还没有有效的槽，从槽0开始
+		this->firm_start_addr	= FIRMWARE_SLOT_BASE(0);
+		this->app_start_addr	= FIRMWARE_SLOT_BASE(1);
+		this->slot_seq			= 1;
+	} else {
+		this->firm_start_addr	= FIRMWARE_SLOT_BASE(1 - active);
+		this->app_start_addr	= FIRMWARE_SLOT_BASE(active);
+		this->slot_seq			= rec.seq + 1;
+	}
+	this->firm_current_addr = this->firm_start_addr;
+}
+
+/*
+ * A/B布局：镜像已按最终地址存放在非活动槽中，确认它是为这个槽链接的，
+ * 在槽尾写入激活记录即完成切换，下次启动运行这个槽。
+ */
+static uint8_t slot_activate(struct firmware_opt_t *this, uint32_t bytes)
+{
+	uint8_t status = 0;
+	struct firmware_slot_t rec;
+	uint32_t addr = this->firm_start_addr + FIRMWARE_SLOT_SIZE - sizeof(rec);
+	const uint32_t *p = (const uint32_t *)addr;
+	uint32_t i;
+
+	// 新镜像不在app所在的槽中，没有可以保留的扇区
+	if (bytes == 0 || this->keep_sectors != 0 ||
+		firmware_slot_vector_check(this->firm_start_addr, bytes) != FIRMWARE_SLOT_SUCCESS) {
+		status = FIRMWARE_OPT_FAIL;
 		return status;
 	}
+	// 槽尾未擦除（如命令方式没有擦除最后一个扇区）时不能写入记录
+	for (i = 0; i < sizeof(rec) / 4u; i++) {
+		if (p[i] != 0xFFFFFFFFu) {
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+	}
 
+	memset(&rec, 0xFF, sizeof(rec));
+	rec.magic		= FIRMWARE_SLOT_MAGIC;
+	rec.seq			= this->slot_seq;
+	rec.size		= bytes;
+	rec.image_crc	= crc32_update(0, (uint8_t *)this->firm_start_addr, bytes);
+	rec.crc			= firmware_slot_crc(&rec);
+	if (flash_write(addr, (uint8_t *)&rec, sizeof(rec)) != INTERNAL_FLASH_OK) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
 
+	status = FIRMWARE_OPT_SUCCESS;
 	return status;
+}
+
+// 写入app区域的进度，image_size、image_crc和keep_sectors供掉电后继续时使用
+static uint8_t copy_record(struct firmware_opt_t *this, uint32_t bytes, uint32_t crc, uint32_t done)
+{
+	struct firmware_journal_t j;
 
+	memset(&j, 0xFF, sizeof(j));
+	j.committed		= done;
+	j.state			= FIRMWARE_JOURNAL_COPYING;
+	j.image_size	= bytes;
+	j.image_crc		= crc;
+	j.keep_sectors	= this->keep_sectors;
+
+	return journal_write(this, &j);
 }
 
+/*
+ * 按扇区写入app区域，与新镜像相同的扇区不擦除也不编程：
+ * keep_sectors中的扇区由主机比较摘要后确认，其余扇区在这里逐字节比较。
+ * 镜像之外的扇区擦空，与整体擦除后写入的结果一致。
+ * 从第start个扇区开始，每处理完一个扇区追加一条COPYING记录；
+ * resume时第start个扇区是掉电时可能正在擦写的扇区，内容不确定，读它可能触发ECC错误，不比较直接重写。
+ */
+static uint8_t app_copy(struct firmware_opt_t *this, uint32_t bytes, uint32_t crc, uint32_t start, uint8_t resume)
+{
+	uint8_t status = 0;
+	uint32_t sector;
+	uint32_t offset;
+	uint32_t len;
 
+	for (sector = start; sector < APP_SECTOR_COUNT; sector++) {
+		offset = sector * FLASH_SECTOR_SIZE;
+		len = 0;
+		if (bytes > offset) {
+			len = bytes - offset < FLASH_SECTOR_SIZE ? bytes - offset : FLASH_SECTOR_SIZE;
+		}
+		if ((this->keep_sectors & (1u << sector)) ||
+			(!(resume && sector == start) && app_sector_same(this, offset, len))) {
+			copy_record(this, bytes, crc, sector + 1);
+			continue;
+		}
+		status = sector_erase(APP_SECTOR_START + sector, 1);
+		if (status != INTERNAL_FLASH_OK) {
+			status = FIRMWARE_OPT_FAIL;
+			return status;
+		}
+		if (len != 0) {
+			status = flash_write(this->app_start_addr + offset, (uint8_t *)(this->firm_start_addr + offset), len);
+			if (status != INTERNAL_FLASH_OK) {
+				status = FIRMWARE_OPT_FAIL;
+				return status;
+			}
+		}
+		// 记录失败只是掉电后多重写一个扇区
+		copy_record(this, bytes, crc, sector + 1);
+	}
+	this->keep_sectors = 0;
+	// firmware区域中的镜像已用完，之后由空闲擦除回收
+	this->applied = 1;
+	this->erase_ready = 0;
+
+	// 镜像已生效，之后相同的START帧重新开始而不是续传，启动时也不再继续写入
+	journal_append(this, this->total_frame, FIRMWARE_JOURNAL_DONE);
+	status = FIRMWARE_OPT_WRITE_CPLT;
+	return status;
+}
+
+/*
+ * A/B布局下不复制，只写一条激活记录。
+ * 否则先追加一条COPYING记录再写入app区域，记录写不进去时不动app区域，掉电后无从恢复。
+ */
+static uint8_t firmware_write(struct firmware_opt_t *this)
+{
+	uint8_t status = 0;
+	struct firmware_journal_t last;
+	uint32_t bytes = 0;
+	uint32_t crc;
+
+	bytes = this->firm_current_addr - this->firm_start_addr;
+	if (FIRMWARE_SLOT_AB) {
+		erase_sync(this);
+		status = slot_activate(this, bytes);
+		if (status != FIRMWARE_OPT_SUCCESS) {
+			return status;
+		}
+		if (this->session != 0) {
+			journal_append(this, this->total_frame, FIRMWARE_JOURNAL_DONE);
+		}
+		// 刚激活的槽成为app，之后的擦写都落在另一个槽
+		this->applied = 1;
+		this->erase_ready = 0;
+		slot_select(this);
+		this->firm_current_addr = this->firm_start_addr + bytes;
+		status = FIRMWARE_OPT_WRITE_CPLT;
+		return status;
+	}
+
+	// 命令方式写入的镜像没有经过session_open，先定位日志的写入位置
+	erase_sync(this);
+	journal_scan(this, &last);
+	if (firmware_image_crc(this, bytes, &crc) != FIRMWARE_OPT_SUCCESS) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	status = copy_record(this, bytes, crc, 0);
+	if (status != FIRMWARE_OPT_SUCCESS) {
+		return status;
+	}
+
+	return app_copy(this, bytes, crc, 0, 0);
+}
+
+/*
+ * 写flash线程启动时调用。日志最后一条是COPYING记录说明上次写入app区域时掉电，
+ * firmware区域中的镜像按记录校验无误后从中断的扇区继续，之前完成的扇区不再处理。
+ */
+static uint8_t copy_recover(struct firmware_opt_t *this)
+{
+	uint8_t status = 0;
+	struct firmware_journal_t last;
+	uint32_t crc;
+
+	if (FIRMWARE_SLOT_AB || !journal_scan(this, &last) || last.state != FIRMWARE_JOURNAL_COPYING) {
+		status = FIRMWARE_OPT_SUCCESS;
+		return status;
+	}
+	if (last.image_size == 0 || last.image_size > BOOTLOADER_FIRMWARE_DATA_SIZE || last.committed > APP_SECTOR_COUNT) {
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	// 保留的扇区复制时不会擦写，仍可参与校验
+	this->keep_sectors = last.keep_sectors;
+	if (firmware_image_crc(this, last.image_size, &crc) != FIRMWARE_OPT_SUCCESS || crc != last.image_crc) {
+		this->keep_sectors = 0;
+		status = FIRMWARE_OPT_FAIL;
+		return status;
+	}
+	this->firm_current_addr = this->firm_start_addr + last.image_size;
+
+	return app_copy(this, last.image_size, last.image_crc, last.committed, 1);
+}
@@ -0,0 +1,122 @@
+#include "firmware_opt.h"
+
+#define SLOT_DTCM_SIZE		(128u * 1024u)
+#define SLOT_AXISRAM_SIZE	(320u * 1024u)
+
+// 切换栈之后不能再读栈上的局部变量，入口放在静态变量中
+static void (*slot_entry)(void);
+
+uint32_t firmware_slot_crc(const struct firmware_slot_t *rec)
+{
+	return firmware_crc32(0, (const uint8_t *)rec, offsetof(struct firmware_slot_t, crc));
+}
+
+uint8_t firmware_slot_vector_check(uint32_t base, uint32_t size)
+{
+	uint8_t status = 0;
+	const uint32_t *vector = (const uint32_t *)base;
+	uint32_t sp = vector[0];
+	uint32_t entry = vector[1] & ~1u;
+
+	if ((sp & 0x3) != 0 ||
+		!((sp > D1_DTCMRAM_BASE && sp <= D1_DTCMRAM_BASE + SLOT_DTCM_SIZE) ||
+		  (sp > D1_AXISRAM_BASE && sp <= D1_AXISRAM_BASE + SLOT_AXISRAM_SIZE))) {
+		status = FIRMWARE_SLOT_FAIL;
+		return status;
+	}
+	// Thumb入口，且在本槽的镜像之内
+	if (!(vector[1] & 1u) || entry < base || entry - base >= size) {
+		status = FIRMWARE_SLOT_FAIL;
+		return status;
+	}
+
+	status = FIRMWARE_SLOT_SUCCESS;
+	return status;
+}
+
+uint8_t firmware_slot_check(uint32_t slot, struct firmware_slot_t *rec)
+{
+	uint8_t status = 0;
+	const struct firmware_slot_t *r;
+	uint32_t base;
+
+	if (slot >= FIRMWARE_SLOT_COUNT) {
+		status = FIRMWARE_SLOT_FAIL;
+		return status;
+	}
+	base = FIRMWARE_SLOT_BASE(slot);
+	r = (const struct firmware_slot_t *)FIRMWARE_SLOT_RECORD(slot);
+	if (r->magic != FIRMWARE_SLOT_MAGIC || r->crc != firmware_slot_crc(r) ||
+		r->size == 0 || r->size > BOOTLOADER_FIRMWARE_DATA_SIZE) {
+		status = FIRMWARE_SLOT_FAIL;
+		return status;
+	}
+	if (firmware_slot_vector_check(base, r->size) != FIRMWARE_SLOT_SUCCESS ||
+		firmware_crc32(0, (const uint8_t *)base, r->size) != r->image_crc) {
+		status = FIRMWARE_SLOT_FAIL;
+		return status;
+	}
+	if (rec != NULL) {
+		*rec = *r;
+	}
+
+	status = FIRMWARE_SLOT_SUCCESS;
+	return status;
+}
+
+uint32_t firmware_slot_active(struct firmware_slot_t *rec)
+{
+	struct firmware_slot_t r;
+	struct firmware_slot_t best;
+	uint32_t active = FIRMWARE_SLOT_NONE;
+	uint32_t slot;
+
+	for (slot = 0; slot < FIRMWARE_SLOT_COUNT; slot++) {
+		if (firmware_slot_check(slot, &r) != FIRMWARE_SLOT_SUCCESS) {
+			continue;
+		}
+		if (active == FIRMWARE_SLOT_NONE || r.seq > best.seq) {
+			best = r;
+			active = slot;
+		}
+	}
+	if (active != FIRMWARE_SLOT_NONE && rec != NULL) {
+		*rec = best;
+	}
+
+	return active;
+}
+
+// 调用时还没有开启cache、中断和任何外设，app看到的几乎是复位状态
+static void slot_jump(uint32_t base)
+{
+	const uint32_t *vector = (const uint32_t *)base;
+
+	slot_entry = (void (*)(void))vector[1];
+	SCB->VTOR = base;
+	__DSB();
+	__ISB();
+	__set_MSP(vector[0]);
+	slot_entry();
+}
+
+void firmware_slot_boot(void)
+{
+	volatile uint32_t *stay = (volatile uint32_t *)FIRMWARE_SLOT_STAY_ADDR;
+	uint32_t slot;
+
+	if (!FIRMWARE_SLOT_AB) {
+		return;
+	}
+	// app请求留在bootloader，只生效一次
+	if (*stay == FIRMWARE_SLOT_STAY_MAGIC) {
+		*stay = 0;
+		return;
+	}
+	slot = firmware_slot_active(NULL);
+	if (slot == FIRMWARE_SLOT_NONE) {
+		return;
+	}
+
+	slot_jump(FIRMWARE_SLOT_BASE(slot));
+}
@@ -0,0 +1,282 @@
+#include "flash_engine.h"
+#include <string.h>
+
+enum engine_step {
+	ENGINE_STEP_NONE = 0,
+	ENGINE_STEP_DONE,
+	ENGINE_STEP_ERROR,
+};
+
+static uint8_t engine_submit(struct flash_engine_t *this, const struct flash_engine_req_t *req);
+static uint8_t engine_wait(struct flash_engine_t *this, ULONG flags, ULONG wait_option);
+
+// 中断和HAL回调通过它找到引擎
+static struct flash_engine_t *engine;
+
+uint8_t flash_engine_init(struct flash_engine_t *this)
+{
+	if (tx_event_flags_create(&this->done, "flash engine") != TX_SUCCESS) {
+		return FLASH_ENGINE_FAIL;
+	}
+	this->head		= 0;
+	this->tail		= 0;
+	this->pos		= 0;
+	this->busy		= 0;
+	this->step		= ENGINE_STEP_NONE;
+	this->failed	= 0;
+	this->submit	= engine_submit;
+	this->wait		= engine_wait;
+	engine = this;
+
+	HAL_NVIC_SetPriority(FLASH_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(FLASH_IRQn);
+
+	return FLASH_ENGINE_SUCCESS;
+}
+
+static uint8_t engine_submit(struct flash_engine_t *this, const struct flash_engine_req_t *req)
+{
+	UINT old;
+
+	old = tx_interrupt_control(TX_INT_DISABLE);
+	if (this->head - this->tail >= FLASH_ENGINE_QUEUE_SIZE) {
+		tx_interrupt_control(old);
+		return FLASH_ENGINE_FULL;
+	}
+	this->queue[this->head & (FLASH_ENGINE_QUEUE_SIZE - 1)] = *req;
+	this->head++;
+	tx_interrupt_control(old);
+
+	// 由中断开始执行，引擎正忙时中断里什么也不做
+	NVIC_SetPendingIRQ(FLASH_IRQn);
+
+	return FLASH_ENGINE_SUCCESS;
+}
+
+static uint8_t engine_wait(struct flash_engine_t *this, ULONG flags, ULONG wait_option)
+{
+	ULONG actual;
+	ULONG failed;
+	UINT old;
+
+	if (tx_event_flags_get(&this->done, flags, TX_AND_CLEAR, &actual, wait_option) != TX_SUCCESS) {
+		return FLASH_ENGINE_FAIL;
+	}
+	old = tx_interrupt_control(TX_INT_DISABLE);
+	failed = this->failed & flags;
+	this->failed &= ~flags;
+	tx_interrupt_control(old);
+
+	return (failed == 0) ? FLASH_ENGINE_SUCCESS : FLASH_ENGINE_FAIL;
+}
+
+// 编程当前请求的下一个flash字，源数据对齐时直接交给HAL，否则拼到word中
+static uint8_t engine_program(struct flash_engine_t *this, struct flash_engine_req_t *req)
+{
+	const uint8_t *src = req->data + this->pos;
+	uint32_t n = req->len - this->pos;
+
+	if (n < sizeof(this->word) || ((uint32_t)src & 0x3) != 0) {
+		if (n > sizeof(this->word)) {
+			n = sizeof(this->word);
+		}
+		memset(this->word, 0xFF, sizeof(this->word));
+		memcpy(this->word, src, n);
+		src = (const uint8_t *)this->word;
+	}
+	if (HAL_FLASH_Program_IT(FLASH_TYPEPROGRAM_FLASHWORD, req->addr + this->pos, (uint32_t)src) != HAL_OK) {
+		return FLASH_ENGINE_FAIL;
+	}
+
+	return FLASH_ENGINE_SUCCESS;
+}
+
+static uint8_t engine_start(struct flash_engine_t *this, struct flash_engine_req_t *req)
+{
+	FLASH_EraseInitTypeDef erase;
+
+	this->busy = 1;
+	this->pos = 0;
+	this->step = ENGINE_STEP_NONE;
+	if (HAL_FLASH_Unlock() != HAL_OK) {
+		return FLASH_ENGINE_FAIL;
+	}
+
+	if (req->op == FLASH_ENGINE_ERASE) {
+		erase.TypeErase		= FLASH_TYPEERASE_SECTORS;
+		erase.Banks			= FLASH_BANK_1;
+		erase.Sector		= req->addr;
+		erase.NbSectors		= req->len;
+		erase.VoltageRange	= FLASH_VOLTAGE_RANGE_3;
+		return (HAL_FLASHEx_Erase_IT(&erase) == HAL_OK) ? FLASH_ENGINE_SUCCESS : FLASH_ENGINE_FAIL;
+	}
+
+	return engine_program(this, req);
+}
+
+// 当前请求结束，使D-Cache中对应的旧数据失效后通知等待方
+static void engine_complete(struct flash_engine_t *this, struct flash_engine_req_t *req, uint8_t ok)
+{
+	uint32_t start;
+	uint32_t end;
+
+	if (req->op == FLASH_ENGINE_ERASE) {
+		start = FLASH_SECTOR0_BASE + req->addr * FLASH_SECTOR_SIZE;
+		end = start + req->len * FLASH_SECTOR_SIZE;
+	} else {
+		start = req->addr & ~0x1FU;
+		end = (req->addr + req->len + 0x1FU) & ~0x1FU;
+	}
+	SCB_InvalidateDCache_by_Addr((uint32_t *)start, (int32_t)(end - start));
+	// _IT接口和HAL_FLASH_IRQHandler都不清除PG/SER，留着会让下一个不同类型的请求产生编程顺序错误；
+	// 此时bank仍处于解锁状态，队列空了才上锁
+	CLEAR_BIT(FLASH->CR1, FLASH_CR_PG | FLASH_CR_SER);
+
+	if (!ok) {
+		this->failed |= req->flag;
+	}
+	this->busy = 0;
+	this->tail++;
+	tx_event_flags_set(&this->done, req->flag, TX_OR);
+}
+
+void flash_engine_irq(void)
+{
+	struct flash_engine_t *this = engine;
+	struct flash_engine_req_t *req;
+	uint8_t step;
+
+	if (this == NULL) {
+		return;
+	}
+
+	if (this->busy) {
+		// 擦除中间扇区的EOP由HAL接着擦下一个扇区，这里不处理
+		step = this->step;
+		if (step == ENGINE_STEP_NONE) {
+			return;
+		}
+		this->step = ENGINE_STEP_NONE;
+		req = &this->queue[this->tail & (FLASH_ENGINE_QUEUE_SIZE - 1)];
+		if (step == ENGINE_STEP_DONE && req->op == FLASH_ENGINE_PROGRAM) {
+			this->pos += sizeof(this->word);
+			if (this->pos < req->len) {
+				if (engine_program(this, req) == FLASH_ENGINE_SUCCESS) {
+					return;
+				}
+				step = ENGINE_STEP_ERROR;
+			}
+		}
+		engine_complete(this, req, step == ENGINE_STEP_DONE);
+	}
+
+	// 紧接着开始队列中的下一个请求，启动失败的请求直接结束
+	while (this->tail != this->head) {
+		req = &this->queue[this->tail & (FLASH_ENGINE_QUEUE_SIZE - 1)];
+		if (req->op == FLASH_ENGINE_PROGRAM && req->len == 0) {
+			engine_complete(this, req, 1);
+			continue;
+		}
+		if (engine_start(this, req) == FLASH_ENGINE_SUCCESS) {
+			return;
+		}
+		engine_complete(this, req, 0);
+	}
+
+	// 队列已空
+	HAL_FLASH_Lock();
+}
+
+// HAL在FLASH中断中调用的回调，只记录结果，由flash_engine_irq在HAL处理完后推进队列
+void HAL_FLASH_EndOfOperationCallback(uint32_t ReturnValue)
+{
+	struct flash_engine_req_t *req;
+
+	if (engine == NULL || !engine->busy || engine->step == ENGINE_STEP_ERROR) {
+		return;
+	}
+	req = &engine->queue[engine->tail & (FLASH_ENGINE_QUEUE_SIZE - 1)];
+	// 多扇区擦除时每擦完一个扇区回调一次，全部擦完时ReturnValue为0xFFFFFFFF
+	if (req->op == FLASH_ENGINE_PROGRAM || ReturnValue == 0xFFFFFFFFU) {
+		engine->step = ENGINE_STEP_DONE;
+	}
+}
+
+void HAL_FLASH_OperationErrorCallback(uint32_t ReturnValue)
+{
+	if (engine == NULL || !engine->busy) {
+		return;
+	}
+	engine->step = ENGINE_STEP_ERROR;
+}
+
+uint32_t flash_engine_erase(uint32_t StartSector, uint32_t SectorCount)
+{
+	struct flash_engine_req_t req = {FLASH_ENGINE_ERASE, StartSector, NULL, SectorCount, FLASH_ENGINE_FLAG_SYNC};
+
+	if (engine == NULL) {
+		return Internal_Flash_EraseSector(StartSector, SectorCount);
+	}
+	if (SectorCount == 0 || StartSector >= INTERNAL_FLASH_SECTOR_MAX ||
+		SectorCount > INTERNAL_FLASH_SECTOR_MAX - StartSector) {
+		return INTERNAL_FLASH_ERROR;
+	}
+	if (engine->submit(engine, &req) != FLASH_ENGINE_SUCCESS) {
+		return INTERNAL_FLASH_BUSY;
+	}
+	if (engine->wait(engine, FLASH_ENGINE_FLAG_SYNC, TX_WAIT_FOREVER) != FLASH_ENGINE_SUCCESS) {
+		return INTERNAL_FLASH_ERROR;
+	}
+
+	return INTERNAL_FLASH_OK;
+}
+
+uint32_t flash_engine_write(uint32_t Address, uint8_t *Data, uint32_t Length)
+{
+	struct flash_engine_req_t req = {FLASH_ENGINE_PROGRAM, Address, Data, Length, FLASH_ENGINE_FLAG_SYNC};
+
+	if (engine == NULL) {
+		return Internal_Flash_Write(Address, Data, Length);
+	}
+	if ((Address & 0x3) != 0) {
+		return INTERNAL_FLASH_ALIGN_ERROR;
+	}
+	if (engine->submit(engine, &req) != FLASH_ENGINE_SUCCESS) {
+		return INTERNAL_FLASH_BUSY;
+	}
+	if (engine->wait(engine, FLASH_ENGINE_FLAG_SYNC, TX_WAIT_FOREVER) != FLASH_ENGINE_SUCCESS) {
+		return INTERNAL_FLASH_ERROR;
+	}
+
+	return INTERNAL_FLASH_OK;
+}
+
+uint32_t flash_engine_erase_async(uint32_t StartSector, uint32_t SectorCount, ULONG flag)
+{
+	struct flash_engine_req_t req = {FLASH_ENGINE_ERASE, StartSector, NULL, SectorCount, flag};
+
+	if (engine == NULL) {
+		return Internal_Flash_EraseSector(StartSector, SectorCount);
+	}
+	if (SectorCount == 0 || StartSector >= INTERNAL_FLASH_SECTOR_MAX ||
+		SectorCount > INTERNAL_FLASH_SECTOR_MAX - StartSector) {
+		return INTERNAL_FLASH_ERROR;
+	}
+	if (engine->submit(engine, &req) != FLASH_ENGINE_SUCCESS) {
+		return INTERNAL_FLASH_BUSY;
+	}
+
+	return INTERNAL_FLASH_OK;
+}
+
+uint32_t flash_engine_wait(ULONG flag)
+{
+	if (engine == NULL) {
+		return INTERNAL_FLASH_OK;
+	}
+	if (engine->wait(engine, flag, TX_WAIT_FOREVER) != FLASH_ENGINE_SUCCESS) {
+		return INTERNAL_FLASH_ERROR;
+	}
+
+	return INTERNAL_FLASH_OK;
+}
@@ -0,0 +1,201 @@
+#include "frame_parser.h"
+
+static uint32_t frame_length(uint8_t *frame, uint32_t have);
+static uint8_t parser_write(struct frame_parser_t *this, const uint8_t *src, uint32_t remain);
+static uint8_t parser_feed(struct frame_parser_t *this, NX_PACKET *packet);
+static void parser_reset(struct frame_parser_t *this);
+static void parser_restart(struct frame_parser_t *this);
+static void parser_resync(struct frame_parser_t *this);
+
+uint8_t frame_parser_init(struct frame_parser_t *this, uint8_t *frame, uint32_t capacity,
+		uint8_t (*on_frame)(struct frame_parser_t *this, uint8_t *frame, uint32_t len), void *arg)
+{
+	if (capacity < FIRMWARE_V1_FRAME_SIZE || on_frame == NULL) {
+		return FRAME_PARSER_FAIL;
+	}
+
+	this->frame			= frame;
+	this->capacity		= capacity;
+	this->need			= FRAME_PARSER_PROBE_SIZE;
+	this->offset		= 0;
+	this->discard		= 0;
+	this->sync			= 0;
+	this->skip			= 0;
+	this->left			= 0;
+	this->arg			= arg;
+	this->on_frame		= on_frame;
+	this->feed			= parser_feed;
+	this->write			= parser_write;
+	this->reset			= parser_restart;
+
+	return FRAME_PARSER_SUCCESS;
+}
+
+static void parser_reset(struct frame_parser_t *this)
+{
+	this->need = FRAME_PARSER_PROBE_SIZE;
+	this->offset = 0;
+}
+
+static void parser_restart(struct frame_parser_t *this)
+{
+	parser_reset(this);
+	this->discard = 0;
+	this->sync = 0;
+	this->skip = 0;
+	this->left = 0;
+}
+
+/*
+ * 帧头无法识别时丢掉开头一个字节，在已组装的数据中寻找下一个v2帧头并移到缓冲区开头。
+ * 没找到时保留末尾不足4字节的部分，它们可能是下一个帧头的开头。
+ * 之后直到重新收到完整的帧，只接受以v2帧头开始的数据。
+ */
+static void parser_resync(struct frame_parser_t *this)
+{
+	uint32_t magic = FIRMWARE_V2_MAGIC;
+	uint32_t i;
+
+	for (i = 1; i + FRAME_PARSER_PROBE_SIZE <= this->offset; i++) {
+		if (memcmp(&this->frame[i], &magic, sizeof(magic)) == 0) {
+			break;
+		}
+	}
+	if (i > this->offset) {
+		i = this->offset;
+	}
+	memmove(this->frame, &this->frame[i], this->offset - i);
+	this->offset -= i;
+	// 已有的字节够判断帧格式时立即重新判断，否则继续凑4字节
+	this->need = this->offset > FRAME_PARSER_PROBE_SIZE ? this->offset : FRAME_PARSER_PROBE_SIZE;
+	this->sync = 1;
+}
+
+/*
+ * 根据已收到的have字节推算整帧长度
+ * 返回值大于have表示还需要继续接收，等于have表示帧已完整，0表示无法识别
+ */
+static uint32_t frame_length(uint8_t *frame, uint32_t have)
+{
+	struct firmware_v2_header_t *h = (struct firmware_v2_header_t *)frame;
+
+	if (have < FRAME_PARSER_PROBE_SIZE) {
+		return FRAME_PARSER_PROBE_SIZE;
+	}
+	if (h->magic != FIRMWARE_V2_MAGIC) {
+		return FIRMWARE_V1_FRAME_SIZE;
+	}
+	if (have < sizeof(struct firmware_v2_header_t)) {
+		return sizeof(struct firmware_v2_header_t);
+	}
+	if (h->len > FIRMWARE_V2_MAX_FRAME_SIZE) {
+		return 0;
+	}
+
+	return sizeof(struct firmware_v2_header_t) + h->len;
+}
+
+// 输入一段连续的字节流
+static uint8_t parser_write(struct frame_parser_t *this, const uint8_t *src, uint32_t remain)
+{
+	uint8_t status = FRAME_PARSER_SUCCESS;
+	uint8_t result;
+	uint32_t n;
+	uint32_t len;
+
+	while (remain > 0) {
+		// 跳过超出缓冲区的帧的剩余部分，保持与数据流同步
+		if (this->discard > 0) {
+			n = this->discard < remain ? this->discard : remain;
+			this->discard -= n;
+			src += n;
+			remain -= n;
+			continue;
+		}
+
+		if (this->frame == NULL) {
+			this->left = remain;
+			return FRAME_PARSER_STALL;
+		}
+
+		// 一次拷贝一段连续数据，不超过当前阶段剩余长度
+		n = this->need - this->offset;
+		if (n > remain) {
+			n = remain;
+		}
+		memcpy(&this->frame[this->offset], src, n);
+		this->offset += n;
+		src += n;
+		remain -= n;
+
+		if (this->offset < this->need) {
+			continue;
+		}
+
+		len = frame_length(this->frame, this->offset);
+		if (len == 0 || (this->sync && len == FIRMWARE_V1_FRAME_SIZE &&
+				((struct firmware_v2_header_t *)this->frame)->magic != FIRMWARE_V2_MAGIC)) {
+			// 无法识别，逐字节重新寻找帧头
+			parser_resync(this);
+			status = FRAME_PARSER_FAIL;
+			continue;
+		}
+		if (len > this->capacity) {
+			// 帧长超出缓冲区，整帧丢弃
+			this->discard = len - this->offset;
+			parser_reset(this);
+			status = FRAME_PARSER_FAIL;
+			continue;
+		}
+		if (len > this->offset) {
+			this->need = len;
+			continue;
+		}
+
+		parser_reset(this);
+		this->sync = 0;
+		result = this->on_frame(this, this->frame, len);
+		if (result == FRAME_PARSER_STALL) {
+			this->left = remain;
+			return FRAME_PARSER_STALL;
+		}
+		if (result != FRAME_PARSER_SUCCESS) {
+			status = FRAME_PARSER_FAIL;
+		}
+	}
+
+	return status;
+}
+
+static uint8_t parser_feed(struct frame_parser_t *this, NX_PACKET *packet)
+{
+	uint8_t status = FRAME_PARSER_SUCCESS;
+	uint8_t result;
+	uint32_t skip = this->skip;
+	uint32_t done = 0;
+	uint32_t len;
+	NX_PACKET *p;
+
+	// 逐个遍历包链，每个包只取prepend_ptr到append_ptr之间的有效数据，上次暂停前已处理的部分跳过
+	this->skip = 0;
+	for (p = packet; p != NX_NULL; p = p->nx_packet_next) {
+		len = (uint32_t)(p->nx_packet_append_ptr - p->nx_packet_prepend_ptr);
+		if (skip >= len) {
+			skip -= len;
+			done += len;
+			continue;
+		}
+		result = parser_write(this, p->nx_packet_prepend_ptr + skip, len - skip);
+		if (result == FRAME_PARSER_STALL) {
+			this->skip = done + len - this->left;
+			return FRAME_PARSER_STALL;
+		}
+		if (result != FRAME_PARSER_SUCCESS) {
+			status = FRAME_PARSER_FAIL;
+		}
+		done += len;
+		skip = 0;
+	}
+
+	return status;
+}
@@ -7,11 +7,13 @@
 
 /* 包含头文件 */
 #include "internal_flash.h"
+#include <string.h>
 
 /* 私有函数声明 */
 static uint32_t Internal_Flash_WaitForLastOperation(uint32_t Timeout);
 static uint32_t Internal_Flash_Unlock(void);
 static uint32_t Internal_Flash_Lock(void);
+static uint32_t Internal_Flash_ProgramWord(uint32_t Address, uint32_t *Data);
 
 /**
   * @brief  按扇区擦除Flash
@@ -73,11 +75,18 @@ static uint32_t Internal_Flash_Lock(void);
 	 /* 锁定Flash */
 	 Internal_Flash_Lock();
 	 
+	 /* 擦除后使D-Cache中对应的旧数据失效 */
+	 SCB_InvalidateDCache_by_Addr((uint32_t *)(FLASH_SECTOR0_BASE + StartSector * FLASH_SECTOR_SIZE),
+								  SectorCount * FLASH_SECTOR_SIZE);
+	 
 	 return status;
 }
 
 /**
   * @brief  写入数据到Flash
+  * @note   数据指针4字节对齐时整个Flash字直接从源数据编程，否则先复制到对齐的缓冲区；
+  *         末尾不足一个Flash字的部分用0xFF填充，该Flash字之后不能再编程。
+  *         连续多次写入且长度不是32字节整数倍时使用Internal_Flash_StreamWrite
   * @param  Address: 写入的起始地址 (必须4字节对齐)
   * @param  Data: 要写入的数据指针 (8位)
   * @param  Length: 要写入的字节数
@@ -87,13 +96,10 @@ uint32_t Internal_Flash_Write(uint32_t Address, uint8_t *Data, uint32_t Length)
 {
 	uint32_t status = INTERNAL_FLASH_OK;
 	uint32_t index = 0;
-	uint32_t row_index = 0;
-	uint32_t *dest_addr = (uint32_t *)Address;
+	uint32_t count;
+	uint32_t dest_addr = Address;
 	uint32_t flash_word[8]; // Flash字为8个32位字
-	uint32_t endAddress = Address + Length; // 计算结束地址
-	uint32_t wordCount = (Length + 3) / 4; // 计算32位字的数量（向上取整）
-	uint32_t temp;
-	uint8_t *bytePtr;
+	uint32_t *src;
 	
 	/* 检查地址是否4字节对齐 */
 	if ((Address & 0x3) != 0)
@@ -120,63 +126,148 @@ uint32_t Internal_Flash_Write(uint32_t Address, uint8_t *Data, uint32_t Length)
 	/* STM32H7的Flash编程以256位(32字节)为单位，即8个32位字 */
 	while (index < Length)
 	{
-		/* 准备一个Flash字(8个32位字) */
-		row_index = 0;
-		while ((row_index < 8) && (index + 3 < Length))
+		count = Length - index;
+		if (count >= sizeof(flash_word) && ((uint32_t)&Data[index] & 0x3) == 0)
 		{
-			/* 从字节数组中构建32位字 */
-			temp = ((uint32_t)Data[index]) | 
-				   ((uint32_t)Data[index + 1] << 8) | 
-				   ((uint32_t)Data[index + 2] << 16) | 
-				   ((uint32_t)Data[index + 3] << 24);
-			
-			flash_word[row_index] = temp;
-			row_index++;
-			index += 4;
+			/* 快速路径：HAL按32位字读取源数据，对齐时不需要复制 */
+			count = sizeof(flash_word);
+			src = (uint32_t *)&Data[index];
 		}
-		
-		/* 处理剩余不足4字节的数据 */
-		if (index < Length && row_index < 8)
+		else
 		{
-			temp = 0xFFFFFFFF;
-			bytePtr = (uint8_t *)&temp;
-			
-			for (uint32_t i = 0; i < 4 && index < Length; i++, index++)
+			if (count > sizeof(flash_word))
 			{
-				bytePtr[i] = Data[index];
+				count = sizeof(flash_word);
 			}
-			
-			flash_word[row_index] = temp;
-			row_index++;
+			/* 不足一个Flash字时用0xFF填充 */
+			memset(flash_word, 0xFF, sizeof(flash_word));
+			memcpy(flash_word, &Data[index], count);
+			src = flash_word;
 		}
 		
-		/* 如果不足8个字，用0xFF填充 */
-		while (row_index < 8)
+		/* 编程一个Flash字 */
+		status = Internal_Flash_ProgramWord(dest_addr, src);
+		if (status != INTERNAL_FLASH_OK)
 		{
-			flash_word[row_index] = 0xFFFFFFFF;
-			row_index++;
+			break;
 		}
 		
-		/* 编程一个Flash字 */
-		if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, (uint32_t)dest_addr, (uint32_t)flash_word) != HAL_OK)
+		index += count;
+		dest_addr += sizeof(flash_word);
+	}
+	
+	/* 锁定Flash */
+	Internal_Flash_Lock();
+	
+	/* 编程后使D-Cache中对应的旧数据失效，之后通过地址读取能得到新内容 */
+	SCB_InvalidateDCache_by_Addr((uint32_t *)(Address & ~0x1FU), (int32_t)(dest_addr - (Address & ~0x1FU)));
+	
+	return status;
+}
+
+/**
+  * @brief  初始化写合并流
+  * @param  Stream: 写合并流
+  * @param  Address: 流的起始地址 (必须32字节对齐)
+  * @param  Program: 编程整Flash字的函数，如Internal_Flash_Write
+  * @retval 操作状态
+  */
+uint32_t Internal_Flash_StreamInit(Internal_Flash_StreamTypeDef *Stream, uint32_t Address,
+								   uint32_t (*Program)(uint32_t Address, uint8_t *Data, uint32_t Length))
+{
+	/* 检查地址是否Flash字对齐 */
+	if ((Address & 0x1F) != 0)
+	{
+		return INTERNAL_FLASH_ALIGN_ERROR;
+	}
+	
+	Stream->Address = Address;
+	Stream->Count = 0;
+	Stream->Program = Program;
+	
+	return INTERNAL_FLASH_OK;
+}
+
+/**
+  * @brief  向写合并流追加数据
+  * @note   凑满的Flash字立即编程，不足一个Flash字的尾部留在Stream->Buffer中，
+  *         与下一次追加的数据合并，直到Internal_Flash_StreamFlush才填充0xFF写入
+  * @param  Stream: 写合并流
+  * @param  Data: 要写入的数据指针 (8位)
+  * @param  Length: 要写入的字节数
+  * @retval 操作状态
+  */
+uint32_t Internal_Flash_StreamWrite(Internal_Flash_StreamTypeDef *Stream, uint8_t *Data, uint32_t Length)
+{
+	uint32_t status = INTERNAL_FLASH_OK;
+	uint32_t index = 0;
+	uint32_t count;
+	
+	/* 先补满缓冲区中的部分Flash字 */
+	if (Stream->Count > 0)
+	{
+		index = sizeof(Stream->Buffer) - Stream->Count;
+		if (index > Length)
 		{
-			status = INTERNAL_FLASH_ERROR;
-			break;
+			index = Length;
+		}
+		memcpy((uint8_t *)Stream->Buffer + Stream->Count, Data, index);
+		Stream->Count += index;
+		if (Stream->Count < sizeof(Stream->Buffer))
+		{
+			return status;
 		}
 		
-		/* 等待编程操作完成 */
-		status = Internal_Flash_WaitForLastOperation(HAL_FLASH_TIMEOUT_VALUE);
+		status = Stream->Program(Stream->Address, (uint8_t *)Stream->Buffer, sizeof(Stream->Buffer));
 		if (status != INTERNAL_FLASH_OK)
 		{
-			break;
+			return status;
 		}
-		
-		/* 更新目标地址 */
-		dest_addr += 8;
+		Stream->Count = 0;
+		Stream->Address += sizeof(Stream->Buffer);
 	}
 	
-	/* 锁定Flash */
-	Internal_Flash_Lock();
+	/* 整Flash字部分一次编程，源数据对齐时Internal_Flash_Write直接从源数据编程 */
+	count = (Length - index) & ~(sizeof(Stream->Buffer) - 1);
+	if (count > 0)
+	{
+		status = Stream->Program(Stream->Address, &Data[index], count);
+		if (status != INTERNAL_FLASH_OK)
+		{
+			return status;
+		}
+		index += count;
+		Stream->Address += count;
+	}
+	
+	/* 剩余不足一个Flash字的部分留待下次合并 */
+	count = Length - index;
+	memcpy(Stream->Buffer, &Data[index], count);
+	Stream->Count = count;
+	
+	return status;
+}
+
+/**
+  * @brief  把写合并流中剩余的部分Flash字填充0xFF后写入
+  * @note   之后该Flash字不能再编程，流只能在下一个Flash字继续
+  * @param  Stream: 写合并流
+  * @retval 操作状态
+  */
+uint32_t Internal_Flash_StreamFlush(Internal_Flash_StreamTypeDef *Stream)
+{
+	uint32_t status = INTERNAL_FLASH_OK;
+	uint32_t count = Stream->Count;
+	
+	if (count == 0)
+	{
+		return status;
+	}
+	
+	memset((uint8_t *)Stream->Buffer + count, 0xFF, sizeof(Stream->Buffer) - count);
+	Stream->Count = 0;
+	status = Stream->Program(Stream->Address, (uint8_t *)Stream->Buffer, sizeof(Stream->Buffer));
+	Stream->Address += sizeof(Stream->Buffer);
 	
 	return status;
 }
@@ -190,17 +281,59 @@ uint32_t Internal_Flash_Write(uint32_t Address, uint8_t *Data, uint32_t Length)
   */
 uint32_t Internal_Flash_Read(uint32_t Address, uint8_t *Buffer, uint32_t Length)
 {
-	uint32_t i;
-	uint8_t *src_addr = (uint8_t *)Address;
-	uint32_t endAddress = Address + Length; // 计算结束地址
-		
-	/* 直接读取数据 */
-	for (i = 0; i < Length; i++)
+	/* Flash映射在AXI总线上，按字和cache行成块复制 */
+	memcpy(Buffer, (const uint8_t *)Address, Length);
+	
+	return INTERNAL_FLASH_OK;
+}
+
+/**
+  * @brief  检查一段Flash能否读取：掉电时正在编程或擦除的Flash字ECC校验不过，
+  *         直接读取会产生总线错误。这里在屏蔽总线错误的情况下逐个Flash字读一次，
+  *         读取期间出现双位ECC错误即返回错误，调用者不再读取这一段
+  * @param  Address: 起始地址
+  * @param  Length: 字节数
+  * @retval 操作状态
+  */
+uint32_t Internal_Flash_Check(uint32_t Address, uint32_t Length)
+{
+	volatile const uint32_t *p;
+	uint32_t end = Address + Length;
+	uint32_t faultmask;
+	uint32_t status = INTERNAL_FLASH_OK;
+	
+	if (Address < FLASH_SECTOR0_BASE || end > APP_END + 1 || end < Address)
 	{
-		Buffer[i] = src_addr[i];
+		return INTERNAL_FLASH_INVALID_ADDR;
 	}
 	
-	return INTERNAL_FLASH_OK;
+	/* 每个Flash字读其中一个字，ECC按整个Flash字校验 */
+	p = (volatile const uint32_t *)(Address & ~(FLASH_NB_32BITWORD_IN_FLASHWORD * 4U - 1U));
+	faultmask = __get_FAULTMASK();
+	__HAL_FLASH_CLEAR_FLAG_BANK1(FLASH_FLAG_SNECCERR_BANK1 | FLASH_FLAG_DBECCERR_BANK1);
+	/* 只在FAULTMASK置位时忽略总线错误，每次只屏蔽一个Flash字的读取，不长时间关中断 */
+	SCB->CCR |= SCB_CCR_BFHFNMIGN_Msk;
+	__DSB();
+	__ISB();
+	for (; (uint32_t)p < end; p += FLASH_NB_32BITWORD_IN_FLASHWORD)
+	{
+		__set_FAULTMASK(1);
+		(void)*p;
+		__DSB();
+		__set_FAULTMASK(faultmask);
+		if (READ_BIT(FLASH->SR1, FLASH_SR_DBECCERR) != 0U)
+		{
+			status = INTERNAL_FLASH_ERROR;
+			break;
+		}
+	}
+	SCB->CCR &= ~SCB_CCR_BFHFNMIGN_Msk;
+	__DSB();
+	__ISB();
+	/* 留下的ECC标志会让之后的擦写报错 */
+	__HAL_FLASH_CLEAR_FLAG_BANK1(FLASH_FLAG_SNECCERR_BANK1 | FLASH_FLAG_DBECCERR_BANK1);
+	
+	return status;
 }
 
 /**
@@ -223,6 +356,23 @@ static uint32_t Internal_Flash_WaitForLastOperation(uint32_t Timeout)
 	return INTERNAL_FLASH_OK;
 }
 
+/**
+  * @brief  编程一个Flash字并等待完成，调用前Flash已解锁
+  * @param  Address: Flash字地址 (32字节对齐)
+  * @param  Data: 8个32位字的源数据 (4字节对齐)
+  * @retval 操作状态
+  */
+static uint32_t Internal_Flash_ProgramWord(uint32_t Address, uint32_t *Data)
+{
+	if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_FLASHWORD, Address, (uint32_t)Data) != HAL_OK)
+	{
+		return INTERNAL_FLASH_ERROR;
+	}
+	
+	/* 等待编程操作完成 */
+	return Internal_Flash_WaitForLastOperation(HAL_FLASH_TIMEOUT_VALUE);
+}
+
 /**
   * @brief  解锁Flash
   * @param  无
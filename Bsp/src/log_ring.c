@@ -0,0 +1,113 @@
+#include "log_ring.h"
+
+static uint8_t ring_push(struct log_ring_t *this, const uint8_t *data, uint32_t len);
+static uint32_t ring_pop(struct log_ring_t *this, uint8_t *buf, uint32_t size);
+
+uint8_t log_ring_init(struct log_ring_t *this, struct log_ring_slot_t *slot, uint32_t count)
+{
+	uint32_t i;
+
+	if (slot == NULL || count < 2 || (count & (count - 1)) != 0) {
+		return LOG_RING_FAIL;
+	}
+
+	for (i = 0; i < count; i++) {
+		slot[i].seq = i;
+		slot[i].len = 0;
+	}
+	this->slot		= slot;
+	this->mask		= count - 1;
+	this->head		= 0;
+	this->tail		= 0;
+	this->dropped	= 0;
+	this->push		= ring_push;
+	this->pop		= ring_pop;
+
+	return LOG_RING_SUCCESS;
+}
+
+// 抢占写位置，环满时返回LOG_RING_FAIL
+static uint8_t ring_claim(struct log_ring_t *this, uint32_t *pos)
+{
+	struct log_ring_slot_t *s;
+	int32_t diff;
+
+	*pos = __atomic_load_n(&this->head, __ATOMIC_RELAXED);
+	while (1) {
+		s = &this->slot[*pos & this->mask];
+		diff = (int32_t)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - *pos);
+		if (diff == 0) {
+			// CAS失败时pos被更新为最新的写位置
+			if (__atomic_compare_exchange_n(&this->head, pos, *pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				return LOG_RING_SUCCESS;
+			}
+		} else if (diff < 0) {
+			return LOG_RING_FAIL;
+		} else {
+			*pos = __atomic_load_n(&this->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static uint8_t ring_push(struct log_ring_t *this, const uint8_t *data, uint32_t len)
+{
+	struct log_ring_slot_t *s;
+	uint32_t pos;
+
+	if (ring_claim(this, &pos) != LOG_RING_SUCCESS) {
+		// 丢弃最旧的一条腾出位置，只再试一次，不在这里自旋
+		if (ring_pop(this, NULL, 0) > 0) {
+			__atomic_fetch_add(&this->dropped, 1, __ATOMIC_RELAXED);
+		}
+		if (ring_claim(this, &pos) != LOG_RING_SUCCESS) {
+			__atomic_fetch_add(&this->dropped, 1, __ATOMIC_RELAXED);
+			return LOG_RING_FAIL;
+		}
+	}
+
+	s = &this->slot[pos & this->mask];
+	if (len > LOG_RING_DATA_SIZE) {
+		len = LOG_RING_DATA_SIZE;
+	}
+	memcpy(s->data, data, len);
+	s->len = len;
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return LOG_RING_SUCCESS;
+}
+
+static uint32_t ring_pop(struct log_ring_t *this, uint8_t *buf, uint32_t size)
+{
+	struct log_ring_slot_t *s;
+	uint32_t pos;
+	uint32_t len;
+	int32_t diff;
+
+	pos = __atomic_load_n(&this->tail, __ATOMIC_RELAXED);
+	while (1) {
+		s = &this->slot[pos & this->mask];
+		diff = (int32_t)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&this->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			// 环为空，或最旧的一条还没写完
+			return 0;
+		} else {
+			pos = __atomic_load_n(&this->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	len = s->len;
+	if (buf != NULL) {
+		if (len > size) {
+			len = size;
+		}
+		memcpy(buf, s->data, len);
+	}
+	// 槽留给绕一圈后的写位置
+	__atomic_store_n(&s->seq, pos + this->mask + 1, __ATOMIC_RELEASE);
+
+	return len;
+}
@@ -59,6 +59,7 @@ void TIM6_DAC_IRQHandler(void);
 void ETH_IRQHandler(void);
 void USART10_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+void FLASH_IRQHandler(void);
 
 /* USER CODE END EFP */
 
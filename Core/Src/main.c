@@ -26,6 +26,7 @@
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "firmware_slot.h"
 
 /* USER CODE END Includes */
 
@@ -82,6 +83,8 @@ int main(void)
 {
 
   /* USER CODE BEGIN 1 */
+  // A/B槽布局下先启动活动槽，必须在开启cache和初始化外设之前
+  firmware_slot_boot();
 
   /* USER CODE END 1 */
 
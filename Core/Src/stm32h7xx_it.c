@@ -22,6 +22,7 @@
 #include "stm32h7xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "flash_engine.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -247,5 +248,14 @@ void USART10_IRQHandler(void)
 }
 
 /* USER CODE BEGIN 1 */
+/**
+  * @brief This function handles FLASH global interrupt.
+  */
+void FLASH_IRQHandler(void)
+{
+  HAL_FLASH_IRQHandler();
+  /* HAL完成本次操作的收尾后，由擦写引擎开始下一步 */
+  flash_engine_irq();
+}
 
 /* USER CODE END 1 */
@@ -32,6 +32,26 @@
 #define NX_IP_REASSEMBLY_ENABLE
 #define NX_IP_FRAGMENT_ENABLE
 
+/*
+ * TCP大块接收配置，用于固件上传。
+ * 定义为0时回到8个包的包池和1KB接收窗口，只靠200ms延迟确认，便于对比goodput。
+ */
+#ifndef NX_USER_TCP_BULK
+#define NX_USER_TCP_BULK                1
+#endif
+
+#if NX_USER_TCP_BULK
+#define NX_USER_PACKET_POOL_COUNT       18      //RAM_D2扣除DMA描述符和ARP表后能放下的包数
+#define NX_USER_TCP_BULK_WINDOW         (12 * 1460)     //包池扣除以太网接收描述符占用的4个包和2个发送包
+#define NX_ENABLE_TCP_WINDOW_SCALING            //包池放到更大的RAM后窗口可超过64KB
+#define NX_TCP_ACK_EVERY_N_PACKETS      2       //每收到2个段立即确认，发送端不必等延迟确认
+#define NX_TCP_FAST_TIMER_RATE          50      //快速定时器20ms
+#define NX_TCP_ACK_TIMER_RATE           25      //不足2个段时延迟确认40ms
+#else
+#define NX_USER_PACKET_POOL_COUNT       8
+#define NX_USER_TCP_BULK_WINDOW         1024
+#endif
+
 
 
 #endif /* NETXDUO_USER_NX_USER_H_ */
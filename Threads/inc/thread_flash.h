@@ -0,0 +1,94 @@
+#ifndef THREAD_FLASH_H
+#define THREAD_FLASH_H
+
+#include "main.h"
+#include "firmware_opt.h"
+
+// 帧接收缓冲区数量，2为乒乓缓冲，3为三缓冲
+#define FIRMWARE_RX_BUF_COUNT   2u
+
+// 没有消息这么多tick后开始空闲擦除
+#define FLASH_IDLE_DELAY        2000u
+
+// 会话所有者这么多tick没有活动时，其他传输方式可以接管会话
+#define FLASH_SESSION_TIMEOUT   30000u
+
+/*
+ * 升级会话的所有者。同一时间只有一种传输方式能开始会话并向写flash线程投递数据，
+ * 其他传输方式在此期间不能复位会话，也不为上传占用帧缓冲区。
+ * 所有者结束上传或断开时释放，中途失联的所有者在FLASH_SESSION_TIMEOUT后可以被接管。
+ */
+enum flash_owner {
+    FLASH_OWNER_NONE = 0,
+    FLASH_OWNER_TCP,
+    FLASH_OWNER_WS,
+    FLASH_OWNER_MQTT,
+    FLASH_OWNER_TFTP,
+    FLASH_OWNER_HTTP,
+    FLASH_OWNER_MCAST,
+};
+
+enum flash_msg_type {
+    FLASH_MSG_SESSION = 0,  // 开始新的升级会话
+    FLASH_MSG_FRAME,        // frame为一个完整的协议帧，offset为投递方的enum flash_owner
+    FLASH_MSG_STAGE,        // frame为镜像中从offset开始的一段数据
+    FLASH_MSG_STAGE_END,    // 按偏移写入结束，offset为镜像总长
+    FLASH_MSG_SHARD_OPEN,   // frame指向struct firmware_shard_info_t，开始分片传输会话
+    FLASH_MSG_SHARD,        // frame为一个FEC块，len为要写入的分片位图，offset为块号
+    FLASH_MSG_SYNC,         // frame指向TX_SEMAPHORE，之前的消息处理完后释放
+};
+
+// 写flash线程的消息
+struct flash_msg_t {
+    ULONG type;             // enum flash_msg_type
+    uint8_t *frame;         // 缓冲区，处理完后归还空闲队列
+    ULONG len;
+    ULONG offset;
+};
+#define FLASH_MSG_SIZE      (sizeof(struct flash_msg_t) / sizeof(ULONG))
+
+// 函数声明
+void thread_flash_entry(ULONG thread_input);
+
+// 取一个空闲的帧缓冲区，缓冲区全部在途时阻塞
+uint8_t *flash_buffer_get(ULONG wait_option);
+// 归还一个帧缓冲区，置位flash_buffer_notify登记的事件标志
+void flash_buffer_put(uint8_t *buffer);
+// 登记缓冲区归还时置位的事件标志，只能登记一个，供不能阻塞在flash_buffer_get中的事件线程使用
+void flash_buffer_notify(TX_EVENT_FLAGS_GROUP *events, ULONG flags);
+// 把组装好的帧交给写flash线程，owner为投递方的传输方式，CMD帧据此检查会话所有权
+UINT flash_frame_post(uint8_t *frame, ULONG len, ULONG owner);
+// 取得会话所有权并通知写flash线程开始新会话，其他传输方式持有会话时返回TX_NOT_AVAILABLE
+UINT flash_session_open(ULONG owner);
+// 与flash_session_open相同地取得所有权，但不复位写flash线程的会话状态，用于续接断线前的会话
+UINT flash_session_claim(ULONG owner);
+// 确认仍持有会话并刷新活动时间，会话已被接管时返回TX_NOT_AVAILABLE
+UINT flash_session_hold(ULONG owner);
+// 释放会话所有权，已接收的数据保留，之后可以由任何传输方式续传或重新开始
+void flash_session_close(ULONG owner);
+// 当前的会话所有者，没有时为FLASH_OWNER_NONE
+ULONG flash_session_owner(void);
+// 把镜像中从offset开始的一段数据交给写flash线程
+UINT flash_stage_post(uint8_t *buffer, ULONG offset, ULONG len);
+// 通知写flash线程按偏移写入结束
+UINT flash_stage_end_post(ULONG total_byte);
+// 开始分片传输会话，info在会话期间必须保持有效
+UINT flash_shard_open_post(const struct firmware_shard_info_t *info);
+// 把一个FEC块中mask指定的分片交给写flash线程
+UINT flash_shard_post(uint8_t *buffer, ULONG block, ULONG mask);
+// 等待之前投递的消息全部处理完
+UINT flash_sync(TX_SEMAPHORE *done);
+// 取写flash线程最近一次处理帧后的接收状态，不等待队列中的帧
+void flash_status_get(struct firmware_ack_t *ack);
+
+// 外部变量声明 - 这些变量在thread_init.c中定义
+extern TX_THREAD thread_flash_block;
+extern TX_QUEUE flash_frame_queue;
+extern TX_QUEUE flash_free_queue;
+extern struct flash_engine_t flash_engine;
+
+// 以下变量在thread_flash.c中定义
+extern uint8_t iap_protocol_buffer[FIRMWARE_RX_BUF_COUNT][IAP_PROTOCOL_BUFFER_SIZE];
+extern struct firmware_opt_t firmware_opt;
+
+#endif // THREAD_FLASH_H
@@ -0,0 +1,26 @@
+#ifndef THREAD_HTTP_H
+#define THREAD_HTTP_H
+
+#include "main.h"
+#include "nx_api.h"
+
+// 制品服务器，板子定期从这里拉取镜像
+#define HTTP_SERVER_ADDRESS     IP_ADDRESS(192, 168, 0, 100)
+#define HTTP_SERVER_PORT        8000u           // python -m http.server的缺省端口
+#define HTTP_IMAGE_PATH         "/firmware.bin"
+
+#define HTTP_RANGE_SIZE         FLASH_SECTOR_SIZE   // 每个Range请求的长度，一个flash扇区
+#define HTTP_PIPELINE_DEPTH     2u              // 同时在途的Range请求数
+#define HTTP_WINDOW_SIZE        NX_USER_TCP_BULK_WINDOW  // 接收窗口按包池大小设置，见nx_user.h
+#define HTTP_TIMEOUT            (5u * NX_IP_PERIODIC_RATE)
+#define HTTP_POLL_INTERVAL      (30u * 1000u)   // 两次检查之间的间隔，单位ms
+#define HTTP_LINE_SIZE          256u            // 响应头单行的最大长度，超出部分丢弃
+#define HTTP_DATE_SIZE          40u             // Last-Modified的最大长度
+
+// 函数声明
+void thread_http_entry(ULONG thread_input);
+
+// 外部变量声明 - 这些变量在thread_init.c中定义
+extern TX_THREAD thread_http_block;
+
+#endif // THREAD_HTTP_H
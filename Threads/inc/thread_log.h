@@ -0,0 +1,69 @@
+#ifndef THREAD_LOG_H
+#define THREAD_LOG_H
+
+#include "main.h"
+#include "nx_api.h"
+#include "log_ring.h"
+
+#define LOG_RING_SLOTS          32u     // 日志环的条目数，2的幂
+#define LOG_BATCH_SIZE          1460u   // 一次发送的最大长度，一个MSS
+#define LOG_DRAIN_INTERVAL      10u     // 环为空时日志线程的轮询间隔，单位ms
+
+/*
+ * 二进制日志：格式串不进flash，放在不加载的.logstr段中，日志只记录格式串在段中的偏移、
+ * 时间戳和原始参数，由主机用tools/log_decode.py对照ELF还原成文本，省掉vsnprintf。
+ * 二进制日志只发给控制端口，上传端和浏览器收不到日志。
+ * 参数最多4个，整数按32位记录，char *按字符串复制，不支持浮点和64位整数。
+ */
+#ifndef LOG_BINARY
+#define LOG_BINARY              0
+#endif
+
+// 二进制日志记录头，之后依次为各参数：整数4字节，字符串1字节长度加内容
+struct log_record_t {
+    uint16_t len;               // 整条记录的长度
+    uint16_t id;                // 格式串在.logstr段中的偏移
+    uint32_t time;              // HAL_GetTick()
+};
+
+// 函数声明
+void thread_log_entry(ULONG thread_input);
+
+// 格式化一条日志放入日志环，不等待网络，环满时丢弃最旧的日志
+UINT log_text(char* format, ...);
+// 记录一条二进制日志，types的bit n置位表示第n个参数是字符串，通过iap_log宏调用
+void log_binary(uint32_t id, uint32_t types, uint32_t nargs, ...);
+
+#define LOG_CAT_(a, b)          a##b
+#define LOG_CAT(a, b)           LOG_CAT_(a, b)
+#define LOG_NARGS(...)          LOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, n, ...)  n
+#define LOG_IS_STR(x)           _Generic((x), char *: 1u, const char *: 1u, default: 0u)
+#define LOG_ARG(x)              _Generic((x), char *: (x), const char *: (x), default: (uint32_t)(uintptr_t)(x))
+
+#define LOG_TYPES_0()           0u
+#define LOG_TYPES_1(a)          LOG_IS_STR(a)
+#define LOG_TYPES_2(a, b)       (LOG_TYPES_1(a) | LOG_IS_STR(b) << 1)
+#define LOG_TYPES_3(a, b, c)    (LOG_TYPES_2(a, b) | LOG_IS_STR(c) << 2)
+#define LOG_TYPES_4(a, b, c, d) (LOG_TYPES_3(a, b, c) | LOG_IS_STR(d) << 3)
+#define LOG_ARGS_0()
+#define LOG_ARGS_1(a)           , LOG_ARG(a)
+#define LOG_ARGS_2(a, b)        LOG_ARGS_1(a), LOG_ARG(b)
+#define LOG_ARGS_3(a, b, c)     LOG_ARGS_2(a, b), LOG_ARG(c)
+#define LOG_ARGS_4(a, b, c, d)  LOG_ARGS_3(a, b, c), LOG_ARG(d)
+
+#if LOG_BINARY
+#define iap_log(format, ...) do { \
+        static const char log_format[] __attribute__((section(".logstr"), used)) = format; \
+        log_binary((uint32_t)(uintptr_t)log_format, LOG_CAT(LOG_TYPES_, LOG_NARGS(__VA_ARGS__))(__VA_ARGS__), \
+                   LOG_NARGS(__VA_ARGS__) LOG_CAT(LOG_ARGS_, LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)); \
+    } while (0)
+#else
+#define iap_log                 log_text
+#endif
+
+// 外部变量声明 - 这些变量在thread_init.c中定义
+extern TX_THREAD thread_log_block;
+extern struct log_ring_t log_ring;
+
+#endif // THREAD_LOG_H
@@ -0,0 +1,59 @@
+#ifndef THREAD_MCAST_H
+#define THREAD_MCAST_H
+
+#include "main.h"
+#include "nx_api.h"
+#include "firmware_opt.h"
+
+#define MCAST_GROUP_ADDRESS     IP_ADDRESS(239, 255, 0, 70)
+#define MCAST_DATA_PORT         7002u   // 组播分片和轮询
+#define MCAST_REPORT_PORT       7003u   // 发送端接收缺失报告的端口
+#define MCAST_MAX_SHARD_SIZE    1408u   // 分片加32字节头不超过以太网MTU，flash字的整数倍
+#define MCAST_MAX_BLOCK         FIRMWARE_MAX_FRAME  // 分片不小于1KB，块数不超过最大帧数
+#define MCAST_REPORT_SLOT       (NX_IP_PERIODIC_RATE / 50)  // 各板按IP错开20ms回复轮询
+
+/*
+ * 组播分片格式：32字节头 + 分片数据，crc为CRC32，覆盖头（crc字段按0计算）和数据。
+ * 镜像按shard_size切分，每k个分片为一个FEC块，shard小于k为数据分片，否则为第shard-k个校验分片，
+ * 编码见fec.h。最后一个分片不足shard_size时按0补齐参与编码，最后一块不足k个分片时缺少的分片按全0参与编码。
+ * 发送端每轮发完后发送POLL，各板回复每块还需要的分片数，下一轮只补发这些数量的校验分片。
+ */
+#define FIRMWARE_MCAST_MAGIC        0x31434D46u // "FMC1"
+#define FIRMWARE_MCAST_REPORT_MAGIC 0x52434D46u // "FMCR"
+
+enum firmware_mcast_type {
+    FIRMWARE_MCAST_SHARD = 1,   // 数据或校验分片
+    FIRMWARE_MCAST_POLL,        // 一轮发送结束，请各板报告缺失情况
+};
+
+struct firmware_mcast_header_t {
+    uint32_t magic;         // FIRMWARE_MCAST_MAGIC
+    uint8_t type;           // enum firmware_mcast_type
+    uint8_t k;              // 每块数据分片数
+    uint8_t shard;          // 块内分片号
+    uint8_t reserved;
+    uint32_t session;       // 发送端为每个镜像选定的会话号，非0
+    uint32_t total_byte;    // 镜像总字节数
+    uint32_t image_crc;     // 镜像CRC32
+    uint16_t block;         // FEC块号
+    uint16_t shard_size;    // 分片长度
+    uint32_t len;           // 本分片数据长度
+    uint32_t crc;           // CRC32
+} __attribute__((aligned(32)));
+
+// 缺失报告，单播发往发送端
+struct firmware_mcast_report_t {
+    uint32_t magic;         // FIRMWARE_MCAST_REPORT_MAGIC
+    uint32_t session;
+    uint32_t total_block;
+    uint32_t missing;       // 尚未恢复的块数，0表示镜像已完整
+    uint8_t need[];         // 每块还需要的分片数
+};
+
+// 函数声明
+void thread_mcast_entry(ULONG thread_input);
+
+// 外部变量声明 - 这些变量在thread_init.c中定义
+extern TX_THREAD thread_mcast_block;
+
+#endif // THREAD_MCAST_H
@@ -0,0 +1,38 @@
+#ifndef THREAD_MQTT_H
+#define THREAD_MQTT_H
+
+#include "main.h"
+#include "nx_api.h"
+#include "nxd_mqtt_client.h"
+
+// MQTT代理，所有板子连接同一个代理，一次发布由代理分发给每块板子
+#define MQTT_BROKER_ADDRESS     IP_ADDRESS(192, 168, 0, 100)
+#define MQTT_BROKER_PORT        NXD_MQTT_PORT
+#define MQTT_KEEPALIVE          30u             // 秒
+#define MQTT_TIMEOUT            (5u * NX_IP_PERIODIC_RATE)
+#define MQTT_RETRY_INTERVAL     (5u * 1000u)    // 连接失败后重试的间隔，单位ms
+
+/*
+ * 主题，<id>为芯片UID的24位十六进制字符串：
+ *   fw/all/frame      所有板子订阅，QoS1，每条消息为一个完整的v1或v2协议帧
+ *   fw/<id>/frame     单板订阅，QoS1，用于给个别板子补发缺失的帧
+ *   fw/<id>/progress  板子发布，QoS0，内容为struct firmware_ack_t
+ * 消息必须能放进包池，v2会话的START帧应提议frame_size为1024。
+ */
+#define MQTT_TOPIC_PREFIX       "fw/"
+#define MQTT_TOPIC_GROUP        "fw/all/frame"
+#define MQTT_TOPIC_SIZE         64u
+#define MQTT_PROGRESS_INTERVAL  16u             // 每收到这么多帧报告一次进度
+#define MQTT_PROGRESS_IDLE      (NX_IP_PERIODIC_RATE / 5)   // 消息停顿这么久后报告一次进度
+
+// MQTT客户端内部线程
+#define MQTT_CLIENT_STACK_SIZE  4096u
+#define MQTT_CLIENT_PRIO        25u
+
+// 函数声明
+void thread_mqtt_entry(ULONG thread_input);
+
+// 外部变量声明 - 这些变量在thread_init.c中定义
+extern TX_THREAD thread_mqtt_block;
+
+#endif // THREAD_MQTT_H
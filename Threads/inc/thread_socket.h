@@ -3,12 +3,18 @@
 
 #include "main.h"
 #include "nx_api.h"
+#include "thread_log.h"
+
+#define TCP_SERVER_PORT         7000    // 数据端口：上传固件
+#define TCP_CONTROL_PORT        7002    // 控制端口：查询状态、接收日志
 
 // 函数声明
 void thread_socket_entry(ULONG thread_input);
 
 // 消息发送函数
 UINT send_message_with_timestamp(const char* message);
+UINT iap_send(VOID *data, ULONG len);
+void tcp_log_send(VOID *data, ULONG len);
 
 // 外部变量声明 - 这些变量在thread_init.c中定义
 extern TX_THREAD thread_socket_block;
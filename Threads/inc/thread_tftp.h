@@ -0,0 +1,22 @@
+#ifndef THREAD_TFTP_H
+#define THREAD_TFTP_H
+
+#include "main.h"
+#include "nx_api.h"
+
+#define TFTP_SERVER_PORT        69u
+
+// 协商参数上限
+#define TFTP_DEFAULT_BLKSIZE    512u    // RFC 1350规定的块长
+#define TFTP_MAX_BLKSIZE        1468u   // 以太网MTU内不分片的最大块长
+#define TFTP_MAX_WINDOWSIZE     (NX_USER_PACKET_POOL_COUNT / 2u)   // 一个窗口的数据包同时占用包池，受包池大小限制
+#define TFTP_DEFAULT_TIMEOUT    1u      // 秒
+#define TFTP_MAX_RETRIES        5u
+
+// 函数声明
+void thread_tftp_entry(ULONG thread_input);
+
+// 外部变量声明 - 这些变量在thread_init.c中定义
+extern TX_THREAD thread_tftp_block;
+
+#endif // THREAD_TFTP_H
@@ -0,0 +1,23 @@
+#ifndef THREAD_WS_H
+#define THREAD_WS_H
+
+#include "main.h"
+#include "nx_api.h"
+#include "nx_websocket_client.h"
+
+#define WS_SERVER_PORT          7001u   // 浏览器连接ws://<ip>:7001/
+#define WS_WINDOW_SIZE          NX_USER_TCP_BULK_WINDOW
+#define WS_TIMEOUT              (5u * NX_IP_PERIODIC_RATE)
+#define WS_LINE_SIZE            128u    // 握手请求单行的最大长度，超出部分丢弃
+#define WS_CONTROL_SIZE         125u    // 控制帧负载的最大长度（RFC 6455）
+
+// 函数声明
+void thread_ws_entry(ULONG thread_input);
+
+// 向浏览器发送一条消息，opcode为NX_WEBSOCKET_OPCODE_TEXT_FRAME或NX_WEBSOCKET_OPCODE_BINARY_FRAME，未连接时直接返回
+UINT ws_send(UINT opcode, VOID *data, ULONG len);
+
+// 外部变量声明 - 这些变量在thread_init.c中定义
+extern TX_THREAD thread_ws_block;
+
+#endif // THREAD_WS_H
@@ -0,0 +1,323 @@
+#include "thread_flash.h"
+#include "thread_socket.h"
+#include "firmware_cmd.h"
+
+/*
+ * 写flash线程
+ * 接收线程把帧组装进空闲缓冲区后投递到flash_frame_queue，本线程负责校验和编程flash，
+ * 编程完成后把缓冲区放回flash_free_queue。网络接收与flash编程因此可以重叠进行。
+ * 各传输方式先用flash_session_open取得会话所有权，同一时间只有一个所有者投递数据。
+ * 所有缓冲区都在途时，接收线程不再从socket取数据（TCP事件线程等待flash_buffer_notify的事件，
+ * 其他接收线程阻塞在flash_buffer_get中），NetX的接收窗口随之收缩直至关闭，
+ * 主机被TCP流控自然限速，包池不会被耗尽。
+ * 擦写由flash_engine在中断中推进，本线程等待期间让出CPU，优先级也低于接收线程。
+ */
+
+// 帧接收缓冲区，放在AXI SRAM中
+uint8_t iap_protocol_buffer[FIRMWARE_RX_BUF_COUNT][IAP_PROTOCOL_BUFFER_SIZE] __attribute__((aligned(32), section(".AxiSramSection")));
+
+// firmware
+struct firmware_opt_t firmware_opt;
+
+// 批量命令及其应答帧缓冲区
+static struct firmware_cmd_t firmware_cmd;
+static uint8_t cmd_reply[FIRMWARE_CMD_REPLY_SIZE] __attribute__((aligned(4)));
+
+// 最近一次的接收状态，供其他线程随时查询
+static struct firmware_ack_t flash_status;
+
+// 缓冲区归还时置位的事件标志
+static TX_EVENT_FLAGS_GROUP *flash_buffer_events;
+static ULONG flash_buffer_flags;
+
+// 会话所有者及其最近一次活动的时间
+static ULONG flash_owner;
+static ULONG flash_owner_time;
+
+uint8_t *flash_buffer_get(ULONG wait_option)
+{
+    ULONG msg = 0;
+
+    if (tx_queue_receive(&flash_free_queue, &msg, wait_option) != TX_SUCCESS) {
+        return NULL;
+    }
+
+    return (uint8_t *)msg;
+}
+
+void flash_buffer_put(uint8_t *buffer)
+{
+    ULONG msg = (ULONG)buffer;
+
+    tx_queue_send(&flash_free_queue, &msg, TX_NO_WAIT);
+    if (flash_buffer_events != NULL) {
+        tx_event_flags_set(flash_buffer_events, flash_buffer_flags, TX_OR);
+    }
+}
+
+void flash_buffer_notify(TX_EVENT_FLAGS_GROUP *events, ULONG flags)
+{
+    flash_buffer_flags = flags;
+    flash_buffer_events = events;
+}
+
+UINT flash_frame_post(uint8_t *frame, ULONG len, ULONG owner)
+{
+    struct flash_msg_t msg = {FLASH_MSG_FRAME, frame, len, owner};
+
+    return tx_queue_send(&flash_frame_queue, &msg, TX_WAIT_FOREVER);
+}
+
+UINT flash_session_claim(ULONG owner)
+{
+    ULONG now = tx_time_get();
+    ULONG previous;
+    UINT posture;
+
+    posture = tx_interrupt_control(TX_INT_DISABLE);
+    previous = flash_owner;
+    if (previous != FLASH_OWNER_NONE && previous != owner && now - flash_owner_time < FLASH_SESSION_TIMEOUT) {
+        tx_interrupt_control(posture);
+        return TX_NOT_AVAILABLE;
+    }
+    flash_owner = owner;
+    flash_owner_time = now;
+    tx_interrupt_control(posture);
+
+    if (previous != FLASH_OWNER_NONE && previous != owner) {
+        iap_log("upload session taken over from idle owner %lu", previous);
+    }
+
+    return TX_SUCCESS;
+}
+
+UINT flash_session_open(ULONG owner)
+{
+    struct flash_msg_t msg = {FLASH_MSG_SESSION, NULL, 0, 0};
+
+    if (flash_session_claim(owner) != TX_SUCCESS) {
+        return TX_NOT_AVAILABLE;
+    }
+
+    return tx_queue_send(&flash_frame_queue, &msg, TX_WAIT_FOREVER);
+}
+
+UINT flash_session_hold(ULONG owner)
+{
+    UINT status = TX_NOT_AVAILABLE;
+    UINT posture;
+
+    posture = tx_interrupt_control(TX_INT_DISABLE);
+    if (flash_owner == owner) {
+        flash_owner_time = tx_time_get();
+        status = TX_SUCCESS;
+    }
+    tx_interrupt_control(posture);
+
+    return status;
+}
+
+void flash_session_close(ULONG owner)
+{
+    UINT posture;
+
+    posture = tx_interrupt_control(TX_INT_DISABLE);
+    if (flash_owner == owner) {
+        flash_owner = FLASH_OWNER_NONE;
+    }
+    tx_interrupt_control(posture);
+}
+
+ULONG flash_session_owner(void)
+{
+    return flash_owner;
+}
+
+UINT flash_stage_post(uint8_t *buffer, ULONG offset, ULONG len)
+{
+    struct flash_msg_t msg = {FLASH_MSG_STAGE, buffer, len, offset};
+
+    return tx_queue_send(&flash_frame_queue, &msg, TX_WAIT_FOREVER);
+}
+
+UINT flash_stage_end_post(ULONG total_byte)
+{
+    struct flash_msg_t msg = {FLASH_MSG_STAGE_END, NULL, 0, total_byte};
+
+    return tx_queue_send(&flash_frame_queue, &msg, TX_WAIT_FOREVER);
+}
+
+UINT flash_shard_open_post(const struct firmware_shard_info_t *info)
+{
+    struct flash_msg_t msg = {FLASH_MSG_SHARD_OPEN, (uint8_t *)info, 0, 0};
+
+    return tx_queue_send(&flash_frame_queue, &msg, TX_WAIT_FOREVER);
+}
+
+UINT flash_shard_post(uint8_t *buffer, ULONG block, ULONG mask)
+{
+    struct flash_msg_t msg = {FLASH_MSG_SHARD, buffer, mask, block};
+
+    return tx_queue_send(&flash_frame_queue, &msg, TX_WAIT_FOREVER);
+}
+
+UINT flash_sync(TX_SEMAPHORE *done)
+{
+    struct flash_msg_t msg = {FLASH_MSG_SYNC, (uint8_t *)done, 0, 0};
+    UINT status;
+
+    status = tx_queue_send(&flash_frame_queue, &msg, TX_WAIT_FOREVER);
+    if (status != TX_SUCCESS) {
+        return status;
+    }
+
+    return tx_semaphore_get(done, TX_WAIT_FOREVER);
+}
+
+void flash_status_get(struct firmware_ack_t *ack)
+{
+    UINT posture;
+
+    posture = tx_interrupt_control(TX_INT_DISABLE);
+    *ack = flash_status;
+    tx_interrupt_control(posture);
+}
+
+static void flash_status_set(const struct firmware_ack_t *ack)
+{
+    UINT posture;
+
+    posture = tx_interrupt_control(TX_INT_DISABLE);
+    flash_status = *ack;
+    tx_interrupt_control(posture);
+}
+
+// 镜像接收完成，写入app区域
+static void firmware_commit(struct firmware_opt_t *iap)
+{
+    iap_log("firmware received, %lu bytes", iap->total_byte);
+    if (iap->write(iap) != FIRMWARE_OPT_WRITE_CPLT) {
+        iap_log("firmware write error");
+    } else {
+        iap_log("firmware write complete");
+    }
+}
+
+// 线程入口函数
+void thread_flash_entry(ULONG thread_input)
+{
+    struct flash_msg_t msg;
+    struct firmware_opt_t *iap = &firmware_opt;
+    struct firmware_ack_t ack;
+    ULONG pending;
+    ULONG wait;
+    ULONG owner;
+    uint8_t status;
+    ULONG len;
+
+    firmware_cmd_init(&firmware_cmd, iap, cmd_reply, sizeof(cmd_reply));
+    firmware_opt_init(iap);
+    // 上次写入app区域时掉电，从中断的扇区继续，firmware区域中的镜像不需要重新传输
+    status = iap->recover(iap);
+    if (status == FIRMWARE_OPT_WRITE_CPLT) {
+        iap_log("app write resumed and complete");
+    } else if (status == FIRMWARE_OPT_FAIL) {
+        iap_log("app write cannot resume, firmware area invalid");
+    }
+    iap->ack(iap, &ack);
+    flash_status_set(&ack);
+
+    wait = FLASH_IDLE_DELAY;
+    while (1) {
+        // 一段时间没有消息时预先擦除firmware区域，每次一个扇区，期间到达的消息最多等一个扇区
+        if (tx_queue_receive(&flash_frame_queue, &msg, wait) != TX_SUCCESS) {
+            wait = iap->idle(iap) ? TX_NO_WAIT : TX_WAIT_FOREVER;
+            continue;
+        }
+        wait = FLASH_IDLE_DELAY;
+
+        // 新连接，复位会话状态，firmware区域在收到START帧或第一个v1帧后再擦除或续传
+        if (msg.type == FLASH_MSG_SESSION) {
+            firmware_opt_init(iap);
+            iap->ack(iap, &ack);
+            flash_status_set(&ack);
+            continue;
+        }
+
+        // 按偏移写入的传输（TFTP）由发送方自己应答，这里不回复
+        if (msg.type == FLASH_MSG_STAGE) {
+            status = iap->stage(iap, msg.offset, msg.frame, msg.len);
+            flash_buffer_put(msg.frame);
+            if (status != FIRMWARE_OPT_SUCCESS) {
+                iap_log("stage error at %lu", msg.offset);
+            }
+            continue;
+        }
+        if (msg.type == FLASH_MSG_SHARD_OPEN) {
+            if (iap->shard_open(iap, (const struct firmware_shard_info_t *)msg.frame) != FIRMWARE_OPT_SUCCESS) {
+                iap_log("shard session error");
+            }
+            continue;
+        }
+        if (msg.type == FLASH_MSG_SHARD) {
+            status = iap->shard_place(iap, msg.offset, msg.frame, msg.len);
+            flash_buffer_put(msg.frame);
+            if (status == FIRMWARE_OPT_FAIL) {
+                iap_log("shard error in block %lu", msg.offset);
+            } else if (status == FIRMWARE_OPT_RECV_CPLT) {
+                firmware_commit(iap);
+            }
+            continue;
+        }
+        if (msg.type == FLASH_MSG_SYNC) {
+            tx_semaphore_put((TX_SEMAPHORE *)msg.frame);
+            continue;
+        }
+        if (msg.type == FLASH_MSG_STAGE_END) {
+            if (iap->stage_finish(iap, msg.offset) == FIRMWARE_OPT_RECV_CPLT) {
+                firmware_commit(iap);
+            } else {
+                iap_log("stage incomplete, %lu bytes", msg.offset);
+            }
+            continue;
+        }
+
+        // CMD帧整批执行后立即应答，不参与帧传输会话的应答合并
+        if (firmware_cmd_match(msg.frame, msg.len)) {
+            // 会话由其他传输方式持有时只执行只读命令，不打断它的上传
+            owner = flash_session_owner();
+            firmware_cmd.read_only = owner != FLASH_OWNER_NONE && owner != msg.offset;
+            len = firmware_cmd.exec(&firmware_cmd, msg.frame, msg.len);
+            flash_buffer_put(msg.frame);
+            if (len == 0) {
+                iap_log("command frame error");
+                continue;
+            }
+            iap_send(cmd_reply, len);
+            if (firmware_cmd.reboot) {
+                iap_log("reboot");
+                sleep_ms(100);
+                NVIC_SystemReset();
+            }
+            continue;
+        }
+
+        status = iap->recv(iap, msg.frame, msg.len);
+        // 帧已经写入flash，缓冲区立即归还给接收线程
+        flash_buffer_put(msg.frame);
+
+        if (status == FIRMWARE_OPT_FAIL) {
+            iap_log("frame error, expect %lu", iap->index);
+        } else if (status == FIRMWARE_OPT_RECV_CPLT) {
+            firmware_commit(iap);
+        }
+
+        // 队列中还有待写的帧时合并应答，只在队列空或出错时回复
+        iap->ack(iap, &ack);
+        flash_status_set(&ack);
+        tx_queue_info_get(&flash_frame_queue, NULL, &pending, NULL, NULL, NULL, NULL);
+        if (pending == 0 || status != FIRMWARE_OPT_SUCCESS) {
+            iap_send(&ack, sizeof(ack));
+        }
+    }
+}
@@ -0,0 +1,530 @@
+#include "thread_http.h"
+#include "thread_socket.h"
+#include "thread_flash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * HTTP/1.1拉取模式：定期向制品服务器请求HTTP_IMAGE_PATH，把响应体按偏移交给写flash线程，
+ * 与TFTP共用firmware_opt的按偏移写入路径。
+ * 第一个请求只取第一个扇区，从Content-Range得到镜像总长后，其余扇区以Range请求流水线方式发出，
+ * 始终保持HTTP_PIPELINE_DEPTH个请求在途，服务器发完一个响应可以立即发下一个，不必等一个RTT。
+ * 服务器不支持Range时返回200和整个文件，同样按顺序接收；服务器在响应后关闭连接时重新连接，
+ * 从已收到的位置继续请求，因此python -m http.server这样最简单的服务器也可以作为分发后端。
+ * 后续检查带If-Modified-Since，文件没有变化时服务器回复304，不再传输。
+ * 镜像与app区域现有内容相同时不擦写flash，只有发现第一处不同后才开始会话，前面相同的部分从app区域补齐。
+ */
+
+struct http_response_t {
+    uint32_t status;            // 状态码
+    uint32_t length;            // Content-Length
+    uint32_t range_start;       // Content-Range的起始偏移
+    uint32_t range_total;       // Content-Range的总长
+    uint8_t close;              // 服务器将在本响应后关闭连接
+    char last_modified[HTTP_DATE_SIZE];
+};
+
+struct http_client_t {
+    NX_PACKET *packet;          // 正在读取的数据包
+    ULONG pos;                  // 包中已读取的字节数
+    uint32_t total;             // 镜像总长
+    uint32_t received;          // 已收到的响应体字节数，即镜像中的偏移
+    uint32_t requested;         // 已请求到的偏移
+    uint32_t outstanding;       // 在途的请求数
+    uint8_t *buffer;            // 写flash线程的缓冲区
+    uint32_t fill;              // 缓冲区中的字节数
+    uint32_t offset;            // 缓冲区第一个字节在镜像中的偏移
+    uint8_t same;               // 到目前为止与app区域内容相同，还没有开始会话
+    char line[HTTP_LINE_SIZE];
+    char last_modified[HTTP_DATE_SIZE];     // 最近一次成功处理的镜像的Last-Modified
+};
+
+static NX_TCP_SOCKET http_socket;
+static struct http_client_t http_client;
+
+static UINT http_connect(struct http_client_t *c)
+{
+    UINT status;
+
+    status = nx_tcp_client_socket_bind(&http_socket, NX_ANY_PORT, NX_NO_WAIT);
+    if (status != NX_SUCCESS) {
+        return status;
+    }
+    status = nx_tcp_client_socket_connect(&http_socket, HTTP_SERVER_ADDRESS, HTTP_SERVER_PORT, HTTP_TIMEOUT);
+    if (status != NX_SUCCESS) {
+        nx_tcp_client_socket_unbind(&http_socket);
+        return status;
+    }
+    c->packet = NULL;
+    c->pos = 0;
+    c->outstanding = 0;
+
+    return NX_SUCCESS;
+}
+
+static void http_disconnect(struct http_client_t *c)
+{
+    if (c->packet != NULL) {
+        nx_packet_release(c->packet);
+        c->packet = NULL;
+    }
+    nx_tcp_socket_disconnect(&http_socket, HTTP_TIMEOUT);
+    nx_tcp_client_socket_unbind(&http_socket);
+}
+
+// 请求镜像中[start, end)这一段，conditional置位时带上次的Last-Modified
+static UINT http_request(struct http_client_t *c, uint32_t start, uint32_t end, uint8_t conditional)
+{
+    NX_PACKET *packet_ptr;
+    char req[HTTP_LINE_SIZE + HTTP_DATE_SIZE];
+    int len;
+    UINT status;
+
+    len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %lu.%lu.%lu.%lu:%u\r\nRange: bytes=%lu-%lu\r\n",
+                   HTTP_IMAGE_PATH,
+                   (HTTP_SERVER_ADDRESS >> 24) & 0xFF, (HTTP_SERVER_ADDRESS >> 16) & 0xFF,
+                   (HTTP_SERVER_ADDRESS >> 8) & 0xFF, HTTP_SERVER_ADDRESS & 0xFF,
+                   HTTP_SERVER_PORT, (unsigned long)start, (unsigned long)end - 1);
+    if (conditional && c->last_modified[0] != 0) {
+        len += snprintf(&req[len], sizeof(req) - len, "If-Modified-Since: %s\r\n", c->last_modified);
+    }
+    len += snprintf(&req[len], sizeof(req) - len, "\r\n");
+
+    status = nx_packet_allocate(&pool_0, &packet_ptr, NX_TCP_PACKET, HTTP_TIMEOUT);
+    if (status != NX_SUCCESS) {
+        return status;
+    }
+    status = nx_packet_data_append(packet_ptr, req, len, &pool_0, HTTP_TIMEOUT);
+    if (status != NX_SUCCESS) {
+        nx_packet_release(packet_ptr);
+        return status;
+    }
+    status = nx_tcp_socket_send(&http_socket, packet_ptr, HTTP_TIMEOUT);
+    if (status != NX_SUCCESS) {
+        nx_packet_release(packet_ptr);
+        return status;
+    }
+    c->requested = end;
+    c->outstanding++;
+
+    return NX_SUCCESS;
+}
+
+// 补足在途请求，每个请求一个扇区
+static UINT http_pipeline(struct http_client_t *c)
+{
+    uint32_t end;
+    UINT status;
+
+    while (c->outstanding < HTTP_PIPELINE_DEPTH && c->requested < c->total) {
+        end = c->requested + HTTP_RANGE_SIZE;
+        if (end > c->total) {
+            end = c->total;
+        }
+        status = http_request(c, c->requested, end, 0);
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+    }
+
+    return NX_SUCCESS;
+}
+
+// 保证当前包中还有未读的数据
+static UINT http_fill(struct http_client_t *c)
+{
+    UINT status;
+
+    if (c->packet != NULL && c->pos < c->packet->nx_packet_length) {
+        return NX_SUCCESS;
+    }
+    if (c->packet != NULL) {
+        nx_packet_release(c->packet);
+        c->packet = NULL;
+    }
+    status = nx_tcp_socket_receive(&http_socket, &c->packet, HTTP_TIMEOUT);
+    if (status != NX_SUCCESS) {
+        c->packet = NULL;
+        return status;
+    }
+    c->pos = 0;
+
+    return NX_SUCCESS;
+}
+
+// 读取一行响应头，去掉行尾的CRLF，过长的部分丢弃
+static UINT http_read_line(struct http_client_t *c)
+{
+    uint32_t len = 0;
+    ULONG copied;
+    UCHAR ch;
+    UINT status;
+
+    while (1) {
+        status = http_fill(c);
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+        nx_packet_data_extract_offset(c->packet, c->pos, &ch, 1, &copied);
+        c->pos++;
+        if (ch == '\n') {
+            break;
+        }
+        if (ch != '\r' && len < HTTP_LINE_SIZE - 1) {
+            c->line[len++] = ch;
+        }
+    }
+    c->line[len] = 0;
+
+    return NX_SUCCESS;
+}
+
+// 读取状态行和响应头，只关心升级用到的几个字段
+static UINT http_read_header(struct http_client_t *c, struct http_response_t *r)
+{
+    char *p;
+    UINT status;
+
+    memset(r, 0, sizeof(*r));
+
+    status = http_read_line(c);
+    if (status != NX_SUCCESS) {
+        return status;
+    }
+    if (strncmp(c->line, "HTTP/1.", 7) != 0 || (p = strchr(c->line, ' ')) == NULL) {
+        return NX_INVALID_PACKET;
+    }
+    r->status = strtoul(p + 1, NULL, 10);
+    // HTTP/1.0缺省不保持连接
+    r->close = (c->line[7] == '0');
+
+    while (1) {
+        status = http_read_line(c);
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+        if (c->line[0] == 0) {
+            break;
+        }
+        if (strncasecmp(c->line, "Content-Length:", 15) == 0) {
+            r->length = strtoul(&c->line[15], NULL, 10);
+        } else if (strncasecmp(c->line, "Content-Range:", 14) == 0) {
+            // bytes start-end/total
+            p = strstr(&c->line[14], "bytes");
+            if (p != NULL) {
+                r->range_start = strtoul(p + 5, &p, 10);
+                p = strchr(p, '/');
+                if (p != NULL) {
+                    r->range_total = strtoul(p + 1, NULL, 10);
+                }
+            }
+        } else if (strncasecmp(c->line, "Connection:", 11) == 0) {
+            for (p = &c->line[11]; *p == ' '; p++) {
+            }
+            if (strncasecmp(p, "close", 5) == 0) {
+                r->close = 1;
+            } else if (strncasecmp(p, "keep-alive", 10) == 0) {
+                r->close = 0;
+            }
+        } else if (strncasecmp(c->line, "Last-Modified:", 14) == 0) {
+            for (p = &c->line[14]; *p == ' '; p++) {
+            }
+            strncpy(r->last_modified, p, HTTP_DATE_SIZE - 1);
+        }
+    }
+
+    return NX_SUCCESS;
+}
+
+// 镜像前面与app相同的部分没有写入firmware区域，开始会话并从app区域补齐
+// 其他传输方式正在升级时返回TX_NOT_AVAILABLE，不开始会话
+static UINT http_backfill(struct http_client_t *c)
+{
+    uint8_t *buffer;
+    uint32_t off;
+    uint32_t len;
+    UINT status;
+
+    status = flash_session_open(FLASH_OWNER_HTTP);
+    if (status != TX_SUCCESS) {
+        iap_log("http download deferred, another upload in progress");
+        return status;
+    }
+    for (off = 0; off < c->offset; off += len) {
+        len = c->offset - off;
+        if (len > IAP_PROTOCOL_BUFFER_SIZE) {
+            len = IAP_PROTOCOL_BUFFER_SIZE;
+        }
+        buffer = flash_buffer_get(TX_WAIT_FOREVER);
+        memcpy(buffer, (uint8_t *)firmware_opt.app_start_addr + off, len);
+        flash_stage_post(buffer, off, len);
+    }
+
+    return TX_SUCCESS;
+}
+
+// 其他传输方式持有会话，本线程不应占用帧缓冲区和包池
+static uint8_t http_busy(void)
+{
+    ULONG owner = flash_session_owner();
+
+    return owner != FLASH_OWNER_NONE && owner != FLASH_OWNER_HTTP;
+}
+
+// app在镜像长度之后是否为擦除状态，写入镜像时这部分会被擦空
+// 只检查到BOOTLOADER_FIRMWARE_DATA_SIZE，A/B槽末尾的日志和记录不属于镜像
+static uint8_t http_app_tail_blank(uint32_t total)
+{
+    const uint8_t *app = (const uint8_t *)firmware_opt.app_start_addr;
+    uint32_t off = total;
+
+    for (; off < BOOTLOADER_FIRMWARE_DATA_SIZE && (off & 3u) != 0; off++) {
+        if (app[off] != 0xFFu) {
+            return 0;
+        }
+    }
+    for (; off < BOOTLOADER_FIRMWARE_DATA_SIZE; off += 4) {
+        if (*(const uint32_t *)(app + off) != 0xFFFFFFFFu) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// 缓冲区写满或镜像结束时调用，与app相同的部分只比较不写入
+// 不能开始会话或会话已被其他传输方式接管时返回TX_NOT_AVAILABLE，缓冲区仍由调用者持有
+static UINT http_flush(struct http_client_t *c)
+{
+    UINT status;
+
+    if (c->same) {
+        // 还在比较阶段时其他传输方式开始了升级，放弃这次检查，把缓冲区让出来
+        if (http_busy()) {
+            iap_log("http check deferred, another upload in progress");
+            return TX_NOT_AVAILABLE;
+        }
+        if (c->offset + c->fill <= APP_SIZE &&
+            memcmp(c->buffer, (uint8_t *)firmware_opt.app_start_addr + c->offset, c->fill) == 0) {
+            c->offset += c->fill;
+            c->fill = 0;
+            return TX_SUCCESS;
+        }
+        status = http_backfill(c);
+        if (status != TX_SUCCESS) {
+            return status;
+        }
+        c->same = 0;
+    } else {
+        status = flash_session_hold(FLASH_OWNER_HTTP);
+        if (status != TX_SUCCESS) {
+            return status;
+        }
+    }
+    flash_stage_post(c->buffer, c->offset, c->fill);
+    c->offset += c->fill;
+    c->fill = 0;
+    c->buffer = flash_buffer_get(TX_WAIT_FOREVER);
+
+    return TX_SUCCESS;
+}
+
+// 把len字节响应体拼接到缓冲区
+static UINT http_read_body(struct http_client_t *c, uint32_t len)
+{
+    ULONG n;
+    ULONG copied;
+    UINT status;
+
+    while (len > 0) {
+        status = http_fill(c);
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+        n = c->packet->nx_packet_length - c->pos;
+        if (n > len) {
+            n = len;
+        }
+        if (n > IAP_PROTOCOL_BUFFER_SIZE - c->fill) {
+            n = IAP_PROTOCOL_BUFFER_SIZE - c->fill;
+        }
+        nx_packet_data_extract_offset(c->packet, c->pos, &c->buffer[c->fill], n, &copied);
+        c->pos += n;
+        c->fill += n;
+        c->received += n;
+        len -= n;
+
+        if (c->fill == IAP_PROTOCOL_BUFFER_SIZE) {
+            status = http_flush(c);
+            if (status != TX_SUCCESS) {
+                return status;
+            }
+        }
+    }
+
+    return NX_SUCCESS;
+}
+
+// 服务器关闭了连接，重新连接并从已收到的位置重新请求
+static UINT http_reconnect(struct http_client_t *c)
+{
+    UINT status;
+
+    http_disconnect(c);
+    status = http_connect(c);
+    if (status != NX_SUCCESS) {
+        return status;
+    }
+    c->requested = c->received;
+
+    return http_pipeline(c);
+}
+
+/*
+ * 接收第一个响应之后的部分。每个206响应必须紧接着已收到的位置，
+ * 读响应体之前先补足流水线，让服务器在我们读取时继续发送。
+ */
+static UINT http_transfer(struct http_client_t *c, struct http_response_t *r)
+{
+    UINT status;
+
+    while (c->received < c->total) {
+        if (r->close) {
+            status = http_reconnect(c);
+        } else {
+            status = http_pipeline(c);
+        }
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+        status = http_read_header(c, r);
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+        if (r->status != 206 || r->range_start != c->received || r->range_total != c->total ||
+            r->length == 0 || c->received + r->length > c->total) {
+            return NX_INVALID_PACKET;
+        }
+        c->outstanding--;
+        status = http_read_body(c, r->length);
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+    }
+
+    return NX_SUCCESS;
+}
+
+// 检查一次服务器上的镜像，有变化时下载并写入
+static void http_fetch(struct http_client_t *c)
+{
+    struct http_response_t r;
+    uint32_t first;
+    UINT status;
+
+    // 其他传输方式正在升级时跳过这次检查，不与它争用帧缓冲区和包池
+    if (http_busy() || http_connect(c) != NX_SUCCESS) {
+        return;
+    }
+    c->total = 0;
+    c->received = 0;
+    status = http_request(c, 0, HTTP_RANGE_SIZE, 1);
+    if (status == NX_SUCCESS) {
+        status = http_read_header(c, &r);
+    }
+    if (status != NX_SUCCESS || r.status == 304) {
+        http_disconnect(c);
+        return;
+    }
+
+    // 200为整个文件，206为第一个扇区
+    if (r.status == 200) {
+        c->total = r.length;
+        first = r.length;
+    } else if (r.status == 206 && r.range_start == 0) {
+        c->total = r.range_total;
+        first = r.length;
+    } else {
+        iap_log("http status %lu", r.status);
+        http_disconnect(c);
+        return;
+    }
+    if (c->total == 0 || c->total > BOOTLOADER_FIRMWARE_DATA_SIZE || first > c->total) {
+        iap_log("http image size %lu rejected", c->total);
+        http_disconnect(c);
+        return;
+    }
+
+    if (http_busy()) {
+        http_disconnect(c);
+        return;
+    }
+    iap_log("http download, %lu bytes", c->total);
+    c->outstanding--;
+    c->buffer = flash_buffer_get(TX_WAIT_FOREVER);
+    c->fill = 0;
+    c->offset = 0;
+    c->same = 1;
+
+    status = http_read_body(c, first);
+    if (status == NX_SUCCESS) {
+        status = http_transfer(c, &r);
+    }
+    http_disconnect(c);
+
+    if (status == NX_SUCCESS) {
+        status = http_flush(c);
+    }
+    // 服务器上的镜像只是app的前缀时内容仍然不同，把整个镜像从app补进暂存区
+    if (status == NX_SUCCESS && c->same && !http_app_tail_blank(c->total)) {
+        status = http_backfill(c);
+        if (status == TX_SUCCESS) {
+            c->same = 0;
+        }
+    }
+    if (status == NX_SUCCESS) {
+        strncpy(c->last_modified, r.last_modified, HTTP_DATE_SIZE - 1);
+        flash_buffer_put(c->buffer);
+        if (c->same) {
+            iap_log("http image unchanged");
+        } else {
+            flash_stage_end_post(c->total);
+            flash_session_close(FLASH_OWNER_HTTP);
+        }
+        return;
+    }
+
+    // 中途失败，已经开始的会话由写flash线程按长度不符拒绝；没有开始会话或会话已被接管时不再投递
+    iap_log("http download aborted at %lu", c->received);
+    if (c->same || flash_session_hold(FLASH_OWNER_HTTP) != TX_SUCCESS) {
+        flash_buffer_put(c->buffer);
+        return;
+    }
+    if (c->fill > 0) {
+        flash_stage_post(c->buffer, c->offset, c->fill);
+    } else {
+        flash_buffer_put(c->buffer);
+    }
+    flash_stage_end_post(0);
+    flash_session_close(FLASH_OWNER_HTTP);
+}
+
+// 线程入口函数
+void thread_http_entry(ULONG thread_input)
+{
+    UINT status;
+
+    status = nx_tcp_socket_create(&ip_0, &http_socket, "HTTP Client Socket",
+                                  NX_IP_NORMAL, NX_FRAGMENT_OKAY, NX_IP_TIME_TO_LIVE,
+                                  HTTP_WINDOW_SIZE, NX_NULL, NX_NULL);
+    if (status != NX_SUCCESS)
+    {
+        return;
+    }
+
+    while (1) {
+        http_fetch(&http_client);
+        sleep_ms(HTTP_POLL_INTERVAL);
+    }
+}
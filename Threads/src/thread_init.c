@@ -1,6 +1,13 @@
 #include "thread_init.h"
 #include "nx_stm32_eth_driver.h"
 #include "thread_socket.h"
+#include "thread_flash.h"
+#include "thread_tftp.h"
+#include "thread_mcast.h"
+#include "thread_http.h"
+#include "thread_mqtt.h"
+#include "thread_ws.h"
+#include "thread_log.h"
 
 // ---------thread parameters
 // thread init parameters
@@ -16,10 +23,65 @@ void thread_init(ULONG input);
 TX_THREAD thread_socket_block;
 uint64_t thread_socket_stack[THREAD_SOCKET_STACK_SIZE/8];
 
+// thread flash parameters，优先级低于socket线程，flash擦写等待期间不影响网络接收
+#define THREAD_FLASH_STACK_SIZE     4096u
+#define THREAD_FLASH_PRIO           26u
+TX_THREAD thread_flash_block;
+uint64_t thread_flash_stack[THREAD_FLASH_STACK_SIZE/8];
+
+// thread tftp parameters
+#define THREAD_TFTP_STACK_SIZE      4096u
+#define THREAD_TFTP_PRIO            25u
+TX_THREAD thread_tftp_block;
+uint64_t thread_tftp_stack[THREAD_TFTP_STACK_SIZE/8];
+
+// thread multicast parameters
+#define THREAD_MCAST_STACK_SIZE     4096u
+#define THREAD_MCAST_PRIO           25u
+TX_THREAD thread_mcast_block;
+uint64_t thread_mcast_stack[THREAD_MCAST_STACK_SIZE/8];
+
+// thread http parameters
+#define THREAD_HTTP_STACK_SIZE      4096u
+#define THREAD_HTTP_PRIO            25u
+TX_THREAD thread_http_block;
+uint64_t thread_http_stack[THREAD_HTTP_STACK_SIZE/8];
+
+// thread mqtt parameters
+#define THREAD_MQTT_STACK_SIZE      4096u
+#define THREAD_MQTT_PRIO            25u
+TX_THREAD thread_mqtt_block;
+uint64_t thread_mqtt_stack[THREAD_MQTT_STACK_SIZE/8];
+
+// thread websocket parameters
+#define THREAD_WS_STACK_SIZE        4096u
+#define THREAD_WS_PRIO              25u
+TX_THREAD thread_ws_block;
+uint64_t thread_ws_stack[THREAD_WS_STACK_SIZE/8];
+
+// thread log parameters，优先级最低，只在其他线程空闲时发送日志
+#define THREAD_LOG_STACK_SIZE       4096u
+#define THREAD_LOG_PRIO             27u
+TX_THREAD thread_log_block;
+uint64_t thread_log_stack[THREAD_LOG_STACK_SIZE/8];
+
+// 日志环
+struct log_ring_t log_ring;
+static struct log_ring_slot_t log_ring_slots[LOG_RING_SLOTS];
+
+// flash擦写引擎
+struct flash_engine_t flash_engine;
+
+// 接收线程与写flash线程之间的队列
+TX_QUEUE flash_frame_queue;
+TX_QUEUE flash_free_queue;
+static ULONG flash_frame_queue_area[(FIRMWARE_RX_BUF_COUNT + 1) * FLASH_MSG_SIZE];
+static ULONG flash_free_queue_area[FIRMWARE_RX_BUF_COUNT];
+
 // ---------netxduo parameters
 NX_PACKET_POOL    pool_0;
 NX_IP             ip_0;
-#define NX_PACKET_POOL_SIZE ((1536 + sizeof(NX_PACKET)) * 8)
+#define NX_PACKET_POOL_SIZE ((1536 + sizeof(NX_PACKET)) * NX_USER_PACKET_POOL_COUNT)
 ULONG  packet_pool_area[NX_PACKET_POOL_SIZE/4 + 4] __attribute__((section(".NetXPoolSection")));
 ULONG  arp_space_area[52*20 / sizeof(ULONG)] __attribute__((section(".NetXPoolSection")));
 
@@ -58,6 +120,7 @@ void  tx_application_define(void *first_unused_memory)
 	nx_init_status |= nx_tcp_enable(&ip_0);
 	nx_init_status |= nx_udp_enable(&ip_0);
 	nx_init_status |= nx_icmp_enable(&ip_0);
+	nx_init_status |= nx_igmp_enable(&ip_0);
 
 	ULONG gateway_ip = ip0_address;
 	gateway_ip = (gateway_ip & 0xFFFFFF00) | 0x01;
@@ -81,6 +144,48 @@ void  tx_application_define(void *first_unused_memory)
 
 void thread_init(ULONG input)  // 将UINT改为ULONG
 {
+	ULONG buffer;
+
+	// 创建日志环，之后各线程才能记录日志
+	log_ring_init(&log_ring, log_ring_slots, LOG_RING_SLOTS);
+
+	// 启动flash擦写引擎，之后的擦写都由FLASH中断驱动
+	flash_engine_init(&flash_engine);
+
+	// 创建帧缓冲区队列，所有缓冲区初始为空闲
+	tx_queue_create(&flash_frame_queue, "flash frame", FLASH_MSG_SIZE,
+		flash_frame_queue_area, sizeof(flash_frame_queue_area));
+	tx_queue_create(&flash_free_queue, "flash free", TX_1_ULONG,
+		flash_free_queue_area, sizeof(flash_free_queue_area));
+	for (uint32_t i = 0; i < FIRMWARE_RX_BUF_COUNT; i++) {
+		buffer = (ULONG)iap_protocol_buffer[i];
+		tx_queue_send(&flash_free_queue, &buffer, TX_NO_WAIT);
+	}
+
+	// 创建日志线程
+	tx_thread_create(&thread_log_block,
+		"tx_log",
+		thread_log_entry,
+		0,
+		&thread_log_stack[0],
+		THREAD_LOG_STACK_SIZE,
+		THREAD_LOG_PRIO,
+		THREAD_LOG_PRIO,
+		TX_NO_TIME_SLICE,
+		TX_AUTO_START);
+
+	// 创建写flash线程
+	tx_thread_create(&thread_flash_block,
+		"tx_flash",
+		thread_flash_entry,
+		0,
+		&thread_flash_stack[0],
+		THREAD_FLASH_STACK_SIZE,
+		THREAD_FLASH_PRIO,
+		THREAD_FLASH_PRIO,
+		TX_NO_TIME_SLICE,
+		TX_AUTO_START);
+
 	// 创建socket线程
 	tx_thread_create(&thread_socket_block,
 		"tx_socket",
@@ -92,6 +197,66 @@ void thread_init(ULONG input)  // 将UINT改为ULONG
 		THREAD_SOCKET_PRIO,
 		TX_NO_TIME_SLICE,
 		TX_AUTO_START);
+
+	// 创建TFTP线程
+	tx_thread_create(&thread_tftp_block,
+		"tx_tftp",
+		thread_tftp_entry,
+		0,
+		&thread_tftp_stack[0],
+		THREAD_TFTP_STACK_SIZE,
+		THREAD_TFTP_PRIO,
+		THREAD_TFTP_PRIO,
+		TX_NO_TIME_SLICE,
+		TX_AUTO_START);
+
+	// 创建组播接收线程
+	tx_thread_create(&thread_mcast_block,
+		"tx_mcast",
+		thread_mcast_entry,
+		0,
+		&thread_mcast_stack[0],
+		THREAD_MCAST_STACK_SIZE,
+		THREAD_MCAST_PRIO,
+		THREAD_MCAST_PRIO,
+		TX_NO_TIME_SLICE,
+		TX_AUTO_START);
+
+	// 创建HTTP拉取线程
+	tx_thread_create(&thread_http_block,
+		"tx_http",
+		thread_http_entry,
+		0,
+		&thread_http_stack[0],
+		THREAD_HTTP_STACK_SIZE,
+		THREAD_HTTP_PRIO,
+		THREAD_HTTP_PRIO,
+		TX_NO_TIME_SLICE,
+		TX_AUTO_START);
+
+	// 创建MQTT接收线程
+	tx_thread_create(&thread_mqtt_block,
+		"tx_mqtt",
+		thread_mqtt_entry,
+		0,
+		&thread_mqtt_stack[0],
+		THREAD_MQTT_STACK_SIZE,
+		THREAD_MQTT_PRIO,
+		THREAD_MQTT_PRIO,
+		TX_NO_TIME_SLICE,
+		TX_AUTO_START);
+
+	// 创建WebSocket线程
+	tx_thread_create(&thread_ws_block,
+		"tx_ws",
+		thread_ws_entry,
+		0,
+		&thread_ws_stack[0],
+		THREAD_WS_STACK_SIZE,
+		THREAD_WS_PRIO,
+		THREAD_WS_PRIO,
+		TX_NO_TIME_SLICE,
+		TX_AUTO_START);
 	
 	while (1) {
 		sleep_ms(100);
@@ -0,0 +1,130 @@
+#include "thread_log.h"
+#include "thread_socket.h"
+#include "thread_ws.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * 异步日志：iap_log只在调用者的栈上格式化一行，写入无锁日志环后立即返回，
+ * 不分配包、不等socket，接收线程和写flash线程记录日志不会被慢客户端拖住。
+ * 日志线程优先级最低，把环中的日志拼成接近一个MSS的批次，
+ * 发给TCP控制连接和WebSocket，对端来不及接收时整批丢弃。
+ * 上传端的TCP字节流只承载应答，日志不发给它。
+ */
+
+static uint8_t log_batch[LOG_BATCH_SIZE];
+
+UINT log_text(char* format, ...)
+{
+    char line[LOG_RING_DATA_SIZE];
+    ULONG current_time = HAL_GetTick(); // 获取HAL时间戳
+    ULONG ip_address = ip0_address;
+    uint32_t len;
+    va_list args;
+
+    // 添加时间戳、IP地址和端口号，IP地址是静态配置，不去拿IP实例的互斥锁
+    len = snprintf(line, sizeof(line), "[%lu ms][%lu.%lu.%lu.%lu:%d] ",
+                   current_time,
+                   (ip_address >> 24) & 0xFF,
+                   (ip_address >> 16) & 0xFF,
+                   (ip_address >> 8) & 0xFF,
+                   ip_address & 0xFF,
+                   TCP_SERVER_PORT);
+    if (len < sizeof(line) - 1) {
+        va_start(args, format);
+        vsnprintf(line + len, sizeof(line) - len, format, args);
+        va_end(args);
+    }
+    // 超长的行被截断，换行符占用结尾'\0'的位置
+    len = strlen(line);
+    line[len++] = '\n';
+
+    return log_ring.push(&log_ring, (uint8_t *)line, len) == LOG_RING_SUCCESS ? NX_SUCCESS : NX_OVERFLOW;
+}
+
+/*
+ * 不格式化，只复制参数，记录头和整数参数共十几个字，主要开销是写入日志环。
+ * 放不下的参数截掉，记录仍然完整。
+ */
+void log_binary(uint32_t id, uint32_t types, uint32_t nargs, ...)
+{
+    uint8_t record[LOG_RING_DATA_SIZE] __attribute__((aligned(4)));
+    struct log_record_t *h = (struct log_record_t *)record;
+    uint32_t len = sizeof(*h);
+    const char *str;
+    uint32_t value;
+    uint32_t n;
+    uint32_t i;
+    va_list args;
+
+    va_start(args, nargs);
+    for (i = 0; i < nargs; i++) {
+        if (types & (1u << i)) {
+            str = va_arg(args, const char *);
+            n = strnlen(str, 255);
+            if (len + 1 + n > sizeof(record)) {
+                break;
+            }
+            record[len++] = n;
+            memcpy(&record[len], str, n);
+            len += n;
+        } else {
+            value = va_arg(args, uint32_t);
+            if (len + sizeof(value) > sizeof(record)) {
+                break;
+            }
+            memcpy(&record[len], &value, sizeof(value));
+            len += sizeof(value);
+        }
+    }
+    va_end(args);
+
+    h->len = len;
+    h->id = id;
+    h->time = HAL_GetTick();
+    log_ring.push(&log_ring, record, len);
+}
+
+static void log_flush(uint32_t len)
+{
+#if LOG_BINARY
+    // 二进制日志只发给控制端口上的解码器
+    tcp_log_send(log_batch, len);
+#else
+    // WebSocket用文本帧发送日志，与二进制帧的应答可以区分
+    ws_send(NX_WEBSOCKET_OPCODE_TEXT_FRAME, log_batch, len);
+    tcp_log_send(log_batch, len);
+#endif
+}
+
+// 线程入口函数
+void thread_log_entry(ULONG thread_input)
+{
+    uint32_t len = 0;
+    uint32_t n;
+    uint32_t dropped = 0;
+
+    while (1) {
+        n = log_ring.pop(&log_ring, log_batch + len, LOG_BATCH_SIZE - len);
+        len += n;
+        // 批次还放得下一整条时继续取
+        if (n > 0 && LOG_BATCH_SIZE - len >= LOG_RING_DATA_SIZE) {
+            continue;
+        }
+        if (len > 0) {
+            log_flush(len);
+            len = 0;
+        }
+        if (n > 0) {
+            continue;
+        }
+
+        // 环已取空，报告期间丢弃的条数
+        if (log_ring.dropped != dropped) {
+            iap_log("log dropped %lu", log_ring.dropped - dropped);
+            dropped = log_ring.dropped;
+            continue;
+        }
+        sleep_ms(LOG_DRAIN_INTERVAL);
+    }
+}
@@ -0,0 +1,362 @@
+#include "thread_mcast.h"
+#include "thread_socket.h"
+#include "thread_flash.h"
+#include "fec.h"
+#include <string.h>
+
+/*
+ * 组播升级接收
+ * 同一网段的多块板加入同一个组播组，发送端只需发送一遍镜像和少量校验分片。
+ * 当前块的数据分片直接收在写flash线程的缓冲区中，校验分片暂存在RAM，
+ * 收到任意k个分片后恢复出完整的块，整块交给写flash线程写入firmware区域。
+ * 切换到下一块时当前块若仍不完整，已收到的数据分片先写入flash，校验分片丢弃，
+ * 之后补发的校验分片与flash中的数据分片一起解码，每块只需要补齐还缺的数量。
+ */
+
+struct mcast_session_t {
+    uint32_t id;                // 会话号，0表示没有会话
+    uint8_t done;               // 镜像已全部恢复
+    struct firmware_shard_info_t info;  // 交给写flash线程的会话参数
+    struct fec_t fec;
+    uint32_t k;
+    uint32_t shard_size;
+    uint32_t total_shard;
+    uint32_t total_block;
+    uint32_t block;             // 正在收集的块，等于total_block表示没有
+    uint8_t *buffer;            // 当前块的数据分片，来自写flash线程的缓冲区
+    uint32_t data_mask;         // 当前块收在buffer中的数据分片
+    uint32_t parity_count;      // 当前块收到的校验分片数
+    uint8_t rows[FEC_MAX_PARITY];           // 校验分片的行号
+    uint32_t stored[MCAST_MAX_BLOCK];       // 每块已交给写flash线程的数据分片
+};
+
+static NX_UDP_SOCKET mcast_socket;
+static TX_SEMAPHORE mcast_sync;
+static struct mcast_session_t mcast_session;
+static uint8_t mcast_parity[FEC_MAX_PARITY][MCAST_MAX_SHARD_SIZE];
+
+static inline uint32_t shard_bits(uint32_t n)
+{
+    return n >= 32 ? 0xFFFFFFFFu : (1u << n) - 1;
+}
+
+// 块中实际存在的数据分片，最后一块可能不足k个
+static uint32_t block_mask(struct mcast_session_t *s, uint32_t block)
+{
+    uint32_t n = s->total_shard - block * s->k;
+
+    return shard_bits(n < s->k ? n : s->k);
+}
+
+// 块内第shard个数据分片的有效长度
+static uint32_t shard_length(struct mcast_session_t *s, uint32_t block, uint32_t shard)
+{
+    uint32_t offset = (block * s->k + shard) * s->shard_size;
+    uint32_t len = s->info.total_byte - offset;
+
+    return len < s->shard_size ? len : s->shard_size;
+}
+
+static void mcast_block_reset(struct mcast_session_t *s)
+{
+    s->block = s->total_block;
+    s->data_mask = 0;
+    s->parity_count = 0;
+}
+
+static uint8_t mcast_session_open(struct mcast_session_t *s, struct firmware_mcast_header_t *h)
+{
+    if (h->session == 0 || h->k == 0 || h->k > FEC_MAX_DATA_SHARDS ||
+        h->shard_size < FIRMWARE_FRAME_DATA_SIZE || h->shard_size > MCAST_MAX_SHARD_SIZE ||
+        (h->shard_size & (FLASH_NB_32BITWORD_IN_FLASHWORD * 4u - 1u)) != 0 ||
+        (uint32_t)h->k * h->shard_size > IAP_PROTOCOL_BUFFER_SIZE ||
+        h->total_byte == 0 || h->total_byte > BOOTLOADER_FIRMWARE_DATA_SIZE) {
+        return FEC_FAIL;
+    }
+    // 其他传输方式正在升级时不开始组播会话，发送端的后续分片会再次尝试
+    if (flash_session_open(FLASH_OWNER_MCAST) != TX_SUCCESS) {
+        return FEC_FAIL;
+    }
+
+    if (s->buffer != NULL) {
+        flash_buffer_put(s->buffer);
+        s->buffer = NULL;
+    }
+
+    s->id = h->session;
+    s->done = 0;
+    s->k = h->k;
+    s->shard_size = h->shard_size;
+    s->total_shard = (h->total_byte + h->shard_size - 1) / h->shard_size;
+    s->total_block = (s->total_shard + s->k - 1) / s->k;
+    s->info.total_byte = h->total_byte;
+    s->info.shard_size = h->shard_size;
+    s->info.block_shards = h->k;
+    s->info.image_crc = h->image_crc;
+    memset(s->stored, 0, sizeof(s->stored));
+    mcast_block_reset(s);
+    fec_init(&s->fec, s->k, s->shard_size);
+
+    flash_shard_open_post(&s->info);
+    s->buffer = flash_buffer_get(TX_WAIT_FOREVER);
+    iap_log("multicast session %lu, %lu bytes, k %lu", s->id, h->total_byte, s->k);
+
+    return FEC_SUCCESS;
+}
+
+// 把buffer中尚未写入的数据分片交给写flash线程，换一个新缓冲区
+static void mcast_block_store(struct mcast_session_t *s, uint32_t mask)
+{
+    if (mask == 0) {
+        return;
+    }
+    flash_shard_post(s->buffer, s->block, mask);
+    s->stored[s->block] |= mask;
+    s->buffer = flash_buffer_get(TX_WAIT_FOREVER);
+}
+
+/*
+ * 当前块已收到足够的分片，恢复缺失的数据分片后整块写入。
+ * 之前已写入flash的分片直接从flash读取参与解码，读取前先等写flash线程处理完之前的消息。
+ * 分片的位置相对本会话的firmware区域，A/B布局下是写flash线程选定的非活动槽。
+ */
+static void mcast_block_complete(struct mcast_session_t *s)
+{
+    uint8_t *data[FEC_MAX_DATA_SHARDS];
+    uint8_t *parity[FEC_MAX_PARITY];
+    uint32_t full = block_mask(s, s->block);
+    uint32_t stored = s->stored[s->block];
+    uint32_t present = s->data_mask | stored | ~full;
+    uint32_t last = s->total_shard - 1 - s->block * s->k;
+    uint32_t len;
+    uint32_t j;
+
+    if ((present & full) != full) {
+        if (stored != 0) {
+            flash_sync(&mcast_sync);
+        }
+        for (j = 0; j < s->k; j++) {
+            data[j] = s->buffer + j * s->shard_size;
+            if (!(full & (1u << j))) {
+                // 最后一块中不存在的分片按全0参与编码
+                memset(data[j], 0, s->shard_size);
+            } else if (stored & (1u << j)) {
+                data[j] = (uint8_t *)(firmware_opt.firm_start_addr + (s->block * s->k + j) * s->shard_size);
+                // 最后一个分片在flash中的补齐部分为0xFF，拷出来按0补齐
+                if (j == last) {
+                    len = shard_length(s, s->block, j);
+                    memcpy(s->buffer + j * s->shard_size, data[j], len);
+                    memset(s->buffer + j * s->shard_size + len, 0, s->shard_size - len);
+                    data[j] = s->buffer + j * s->shard_size;
+                }
+            }
+        }
+        for (j = 0; j < s->parity_count; j++) {
+            parity[j] = mcast_parity[j];
+        }
+        if (s->fec.decode(&s->fec, data, present, parity, s->rows, s->parity_count) != FEC_SUCCESS) {
+            iap_log("multicast block %lu decode error", s->block);
+            s->data_mask = 0;
+            s->parity_count = 0;
+            return;
+        }
+    }
+
+    mcast_block_store(s, full & ~stored);
+    mcast_block_reset(s);
+
+    for (j = 0; j < s->total_block; j++) {
+        if (s->stored[j] != block_mask(s, j)) {
+            return;
+        }
+    }
+    s->done = 1;
+    flash_buffer_put(s->buffer);
+    s->buffer = NULL;
+    flash_session_close(FLASH_OWNER_MCAST);
+    iap_log("multicast image recovered");
+}
+
+// 切换到新的块，当前块不完整时先保存已收到的数据分片
+static void mcast_block_switch(struct mcast_session_t *s, uint32_t block)
+{
+    if (s->block < s->total_block) {
+        mcast_block_store(s, s->data_mask & ~s->stored[s->block]);
+    }
+    mcast_block_reset(s);
+    s->block = block;
+}
+
+static void mcast_shard(struct mcast_session_t *s, struct firmware_mcast_header_t *h, NX_PACKET *packet)
+{
+    struct firmware_mcast_header_t head;
+    uint32_t full;
+    uint32_t row;
+    uint32_t expect;
+    uint32_t have;
+    uint32_t crc;
+    uint32_t j;
+    ULONG copied;
+    uint8_t *dst;
+
+    if (h->block >= s->total_block || h->k != s->k || h->shard_size != s->shard_size) {
+        return;
+    }
+    full = block_mask(s, h->block);
+    if (s->done || s->stored[h->block] == full) {
+        return;
+    }
+    // 分片停顿太久时会话可能已被其他传输方式接管，放弃本会话，之后的分片重新申请
+    if (flash_session_hold(FLASH_OWNER_MCAST) != TX_SUCCESS) {
+        iap_log("multicast session %lu taken over", s->id);
+        flash_buffer_put(s->buffer);
+        s->buffer = NULL;
+        s->id = 0;
+        return;
+    }
+    if (h->block != s->block) {
+        mcast_block_switch(s, h->block);
+    }
+
+    if (h->shard < s->k) {
+        if (!(full & (1u << h->shard)) || ((s->data_mask | s->stored[s->block]) & (1u << h->shard))) {
+            return;
+        }
+        expect = shard_length(s, s->block, h->shard);
+        dst = s->buffer + h->shard * s->shard_size;
+    } else {
+        row = h->shard - s->k;
+        if (s->parity_count == FEC_MAX_PARITY) {
+            return;
+        }
+        for (j = 0; j < s->parity_count; j++) {
+            if (s->rows[j] == row) {
+                return;
+            }
+        }
+        expect = s->shard_size;
+        dst = mcast_parity[s->parity_count];
+    }
+    if (h->len != expect) {
+        return;
+    }
+
+    nx_packet_data_extract_offset(packet, sizeof(*h), dst, h->len, &copied);
+    head = *h;
+    head.crc = 0;
+    crc = firmware_crc32(0, (uint8_t *)&head, sizeof(head));
+    crc = firmware_crc32(crc, dst, h->len);
+    if (copied != h->len || crc != h->crc) {
+        return;
+    }
+    memset(dst + h->len, 0, s->shard_size - h->len);
+
+    if (h->shard < s->k) {
+        s->data_mask |= 1u << h->shard;
+    } else {
+        s->rows[s->parity_count++] = h->shard - s->k;
+    }
+
+    have = __builtin_popcount((s->data_mask | s->stored[s->block] | ~full) & shard_bits(s->k)) + s->parity_count;
+    if (have >= s->k) {
+        mcast_block_complete(s);
+    }
+}
+
+// 回复轮询：每块还需要多少个分片，发送端据此决定补发的校验分片数量
+static void mcast_report(struct mcast_session_t *s, ULONG sender_ip)
+{
+    uint8_t buf[sizeof(struct firmware_mcast_report_t) + MCAST_MAX_BLOCK];
+    struct firmware_mcast_report_t *r = (struct firmware_mcast_report_t *)buf;
+    NX_PACKET *packet_ptr;
+    uint32_t kmask = shard_bits(s->k);
+    uint32_t have;
+    uint32_t b;
+    ULONG ip = ip0_address;
+
+    r->magic = FIRMWARE_MCAST_REPORT_MAGIC;
+    r->session = s->id;
+    r->total_block = s->total_block;
+    r->missing = 0;
+    for (b = 0; b < s->total_block; b++) {
+        have = __builtin_popcount((s->stored[b] | ~block_mask(s, b)) & kmask);
+        if (b == s->block) {
+            have += __builtin_popcount(s->data_mask) + s->parity_count;
+        }
+        r->need[b] = have >= s->k ? 0 : s->k - have;
+        if (r->need[b] != 0) {
+            r->missing++;
+        }
+    }
+
+    // 按IP最后一段错开回复时间，避免所有板同时回复
+    tx_thread_sleep((ip & 0x1F) * MCAST_REPORT_SLOT);
+
+    if (nx_packet_allocate(&pool_0, &packet_ptr, NX_UDP_PACKET, NX_WAIT_FOREVER) != NX_SUCCESS) {
+        return;
+    }
+    if (nx_packet_data_append(packet_ptr, buf, sizeof(*r) + s->total_block, &pool_0, NX_WAIT_FOREVER) != NX_SUCCESS ||
+        nx_udp_socket_send(&mcast_socket, packet_ptr, sender_ip, MCAST_REPORT_PORT) != NX_SUCCESS) {
+        nx_packet_release(packet_ptr);
+    }
+}
+
+// 线程入口函数
+void thread_mcast_entry(ULONG thread_input)
+{
+    struct mcast_session_t *s = &mcast_session;
+    struct firmware_mcast_header_t h;
+    NX_PACKET *packet;
+    ULONG copied;
+    ULONG sender_ip;
+    UINT sender_port;
+    UINT status;
+
+    tx_semaphore_create(&mcast_sync, "mcast sync", 0);
+
+    status = nx_udp_socket_create(&ip_0, &mcast_socket, "Multicast Socket",
+                                  NX_IP_NORMAL, NX_FRAGMENT_OKAY, NX_IP_TIME_TO_LIVE, 4);
+    if (status != NX_SUCCESS)
+    {
+        return;
+    }
+    status = nx_udp_socket_bind(&mcast_socket, MCAST_DATA_PORT, TX_WAIT_FOREVER);
+    status |= nx_igmp_multicast_join(&ip_0, MCAST_GROUP_ADDRESS);
+    if (status != NX_SUCCESS)
+    {
+        nx_udp_socket_delete(&mcast_socket);
+        return;
+    }
+
+    while (1) {
+        status = nx_udp_socket_receive(&mcast_socket, &packet, NX_WAIT_FOREVER);
+        if (status != NX_SUCCESS) {
+            continue;
+        }
+
+        nx_packet_data_extract_offset(packet, 0, &h, sizeof(h), &copied);
+        if (copied != sizeof(h) || h.magic != FIRMWARE_MCAST_MAGIC ||
+            h.len > MCAST_MAX_SHARD_SIZE || packet->nx_packet_length != sizeof(h) + h.len) {
+            nx_packet_release(packet);
+            continue;
+        }
+
+        if (h.session != s->id) {
+            if (h.type != FIRMWARE_MCAST_SHARD || mcast_session_open(s, &h) != FEC_SUCCESS) {
+                nx_packet_release(packet);
+                continue;
+            }
+        }
+
+        if (h.type == FIRMWARE_MCAST_SHARD) {
+            mcast_shard(s, &h, packet);
+            nx_packet_release(packet);
+        } else if (h.type == FIRMWARE_MCAST_POLL) {
+            nx_udp_source_extract(packet, &sender_ip, &sender_port);
+            nx_packet_release(packet);
+            mcast_report(s, sender_ip);
+        } else {
+            nx_packet_release(packet);
+        }
+    }
+}
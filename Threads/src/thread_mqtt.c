@@ -0,0 +1,165 @@
+#include "thread_mqtt.h"
+#include "thread_socket.h"
+#include "thread_flash.h"
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * MQTT升级：连接代理后订阅组主题和本板主题，每条QoS1消息是一个完整的协议帧，
+ * 复制到写flash线程的缓冲区后与TCP升级一样交给firmware_opt处理，帧可以乱序和重复。
+ * 会话使用clean_session=0，断线期间代理为本板保存的QoS1消息在重连后补发。
+ * 写flash线程处理完之前的帧后，把与TCP相同的应答结构发布到进度主题，
+ * 发送端据此为个别板子在本板主题上补发缺失的帧。
+ * 连接代理本身不开始升级会话：START帧开始新会话，其他帧在没有别的传输方式升级时续接会话，
+ * 否则丢弃。帧缓冲区只在取出一条消息时占用，空闲的连接不占用缓冲区。
+ */
+
+static NXD_MQTT_CLIENT mqtt_client;
+static uint64_t mqtt_client_stack[MQTT_CLIENT_STACK_SIZE / 8];
+static TX_SEMAPHORE mqtt_receive_sem;
+static TX_SEMAPHORE mqtt_sync_sem;
+static volatile uint8_t mqtt_connected;
+
+static char mqtt_id[25];
+static char mqtt_topic_frame[MQTT_TOPIC_SIZE];
+static char mqtt_topic_progress[MQTT_TOPIC_SIZE];
+static UCHAR mqtt_topic_buffer[MQTT_TOPIC_SIZE];
+
+// 以下回调在MQTT客户端线程中执行，只唤醒本线程
+static VOID mqtt_receive_notify(NXD_MQTT_CLIENT *client_ptr, UINT number_of_messages)
+{
+    tx_semaphore_put(&mqtt_receive_sem);
+}
+
+static VOID mqtt_disconnect_notify(NXD_MQTT_CLIENT *client_ptr)
+{
+    mqtt_connected = 0;
+    tx_semaphore_put(&mqtt_receive_sem);
+}
+
+// 等写flash线程处理完已投递的帧，发布它最近一次保存的接收状态，不在本线程读firmware_opt
+static void mqtt_progress(void)
+{
+    struct firmware_ack_t ack;
+
+    flash_sync(&mqtt_sync_sem);
+    flash_status_get(&ack);
+    nxd_mqtt_client_publish(&mqtt_client, mqtt_topic_progress, strlen(mqtt_topic_progress),
+                            (CHAR *)&ack, sizeof(ack), NX_FALSE, 0, MQTT_TIMEOUT);
+}
+
+/*
+ * START帧开始新会话；其他帧需要本线程持有会话，没有其他所有者时重新取得所有权并续传。
+ * 重连后补发的帧属于断线前的会话，取得所有权时不能复位会话状态，否则DATA帧全部被拒绝。
+ */
+static UINT mqtt_claim(uint8_t *frame, UINT len)
+{
+    struct firmware_v2_header_t *h = (struct firmware_v2_header_t *)frame;
+    UINT status;
+
+    if (len >= sizeof(*h) && h->magic == FIRMWARE_V2_MAGIC && h->type == FIRMWARE_V2_TYPE_START) {
+        status = flash_session_open(FLASH_OWNER_MQTT);
+        if (status != TX_SUCCESS) {
+            iap_log("mqtt start dropped, another upload in progress");
+        }
+        return status;
+    }
+    if (flash_session_hold(FLASH_OWNER_MQTT) == TX_SUCCESS) {
+        return TX_SUCCESS;
+    }
+
+    return flash_session_claim(FLASH_OWNER_MQTT);
+}
+
+// 一次连接期间的接收循环，连接断开后返回
+static UINT mqtt_session(void)
+{
+    NXD_ADDRESS broker;
+    uint8_t *buffer;
+    UINT topic_len;
+    UINT len;
+    uint32_t pending = 0;
+    UINT status;
+
+    broker.nxd_ip_version = NX_IP_VERSION_V4;
+    broker.nxd_ip_address.v4 = MQTT_BROKER_ADDRESS;
+    status = nxd_mqtt_client_connect(&mqtt_client, &broker, MQTT_BROKER_PORT, MQTT_KEEPALIVE, NX_FALSE, MQTT_TIMEOUT);
+    if (status != NXD_MQTT_SUCCESS) {
+        return status;
+    }
+    mqtt_connected = 1;
+
+    status = nxd_mqtt_client_subscribe(&mqtt_client, MQTT_TOPIC_GROUP, strlen(MQTT_TOPIC_GROUP), 1);
+    status |= nxd_mqtt_client_subscribe(&mqtt_client, mqtt_topic_frame, strlen(mqtt_topic_frame), 1);
+    if (status != NXD_MQTT_SUCCESS) {
+        nxd_mqtt_client_disconnect(&mqtt_client);
+        return status;
+    }
+
+    iap_log("mqtt connected, id %s", mqtt_id);
+
+    while (mqtt_connected) {
+        // 消息停顿时补报一次进度
+        if (tx_semaphore_get(&mqtt_receive_sem, MQTT_PROGRESS_IDLE) != TX_SUCCESS) {
+            if (pending > 0) {
+                pending = 0;
+                mqtt_progress();
+            }
+            continue;
+        }
+
+        while (1) {
+            buffer = flash_buffer_get(TX_WAIT_FOREVER);
+            if (nxd_mqtt_client_message_get(&mqtt_client, mqtt_topic_buffer, sizeof(mqtt_topic_buffer), &topic_len,
+                                            buffer, IAP_PROTOCOL_BUFFER_SIZE, &len) != NXD_MQTT_SUCCESS) {
+                flash_buffer_put(buffer);
+                break;
+            }
+            if (mqtt_claim(buffer, len) != TX_SUCCESS) {
+                flash_buffer_put(buffer);
+                continue;
+            }
+            flash_frame_post(buffer, len, FLASH_OWNER_MQTT);
+            if (++pending >= MQTT_PROGRESS_INTERVAL) {
+                pending = 0;
+                mqtt_progress();
+            }
+        }
+    }
+
+    // 断开期间其他传输方式可以开始升级，重连后的帧再按上面的规则续接
+    flash_session_close(FLASH_OWNER_MQTT);
+    nxd_mqtt_client_disconnect(&mqtt_client);
+    iap_log("mqtt disconnected");
+
+    return NXD_MQTT_NOT_CONNECTED;
+}
+
+// 线程入口函数
+void thread_mqtt_entry(ULONG thread_input)
+{
+    UINT status;
+
+    snprintf(mqtt_id, sizeof(mqtt_id), "%08lX%08lX%08lX",
+             (unsigned long)HAL_GetUIDw0(), (unsigned long)HAL_GetUIDw1(), (unsigned long)HAL_GetUIDw2());
+    snprintf(mqtt_topic_frame, sizeof(mqtt_topic_frame), MQTT_TOPIC_PREFIX "%s/frame", mqtt_id);
+    snprintf(mqtt_topic_progress, sizeof(mqtt_topic_progress), MQTT_TOPIC_PREFIX "%s/progress", mqtt_id);
+
+    tx_semaphore_create(&mqtt_receive_sem, "mqtt receive", 0);
+    tx_semaphore_create(&mqtt_sync_sem, "mqtt sync", 0);
+
+    status = nxd_mqtt_client_create(&mqtt_client, "MQTT Client", mqtt_id, strlen(mqtt_id),
+                                    &ip_0, &pool_0, mqtt_client_stack, sizeof(mqtt_client_stack),
+                                    MQTT_CLIENT_PRIO, NX_NULL, 0);
+    if (status != NXD_MQTT_SUCCESS)
+    {
+        return;
+    }
+    nxd_mqtt_client_receive_notify_set(&mqtt_client, mqtt_receive_notify);
+    nxd_mqtt_client_disconnect_notify_set(&mqtt_client, mqtt_disconnect_notify);
+
+    while (1) {
+        mqtt_session();
+        sleep_ms(MQTT_RETRY_INTERVAL);
+    }
+}
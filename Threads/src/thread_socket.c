@@ -1,144 +1,459 @@
 #include "thread_socket.h"
 #include "firmware_opt.h"
+#include "frame_parser.h"
+#include "thread_flash.h"
+#include "thread_ws.h"
 #include <stdio.h>
 #include <string.h>
 
-// TCP socket相关参数定义在这个文件中
-NX_TCP_SOCKET tcp_socket;
-#define TCP_SERVER_PORT 7000  // 服务器监听端口
+/*
+ * TCP服务器：一个线程用事件驱动同时服务多个连接。
+ * 数据端口只接受一个上传连接，帧交给写flash线程，应答发回这个连接；
+ * 控制端口可以同时连接多个监视客户端，接收日志，发送4字节"FACK"查询当前接收状态。
+ * NetX的监听、握手完成、接收和断开回调只置事件标志，socket操作都在本线程中完成，都不阻塞：
+ * accept不等待握手，握手完成或失败的回调到来后再转为已连接或重新监听。
+ * 控制会话先于数据会话处理，写flash线程缓冲区用完时数据会话暂停读取、TCP窗口随之关闭，
+ * 缓冲区归还时写flash线程置TCP_EVENT_BUFFER，数据会话从暂停处继续，期间状态查询照常应答。
+ * 日志由日志线程批量发给控制连接，见thread_log.c。
+ */
 
-// 消息缓冲区
-#define MAX_MESSAGE_SIZE 512
-static uint8_t message_buffer[MAX_MESSAGE_SIZE];
+// TCP socket相关参数定义在这个文件中，端口号见thread_socket.h
+#define TCP_CONTROL_SESSIONS    2u      // 控制端口同时连接数
+#define TCP_SESSION_COUNT       (1u + TCP_CONTROL_SESSIONS)
+#define TCP_LISTEN_QUEUE        5u
+// 写flash线程发送应答时最多等待这么久，对端不读或包池被接收数据占满时放弃这一次应答
+#define TCP_REPLY_WAIT          (NX_IP_PERIODIC_RATE / 10u)
 
-UINT iap_log(char* format, ...)
+// 事件标志：bit0..为各会话握手结束、有数据或连接断开，高位为端口上有新连接和写flash线程归还了缓冲区
+#define TCP_EVENT_SESSION(i)    (1ul << (i))
+#define TCP_EVENT_LISTEN_DATA   (1ul << 16)
+#define TCP_EVENT_LISTEN_CONTROL (1ul << 17)
+#define TCP_EVENT_BUFFER        (1ul << 18)
+#define TCP_EVENT_ALL           (TCP_EVENT_LISTEN_DATA | TCP_EVENT_LISTEN_CONTROL | TCP_EVENT_BUFFER | \
+                                 (TCP_EVENT_SESSION(TCP_SESSION_COUNT) - 1))
+
+enum tcp_session_state {
+    TCP_SESSION_IDLE = 0,   // 未使用
+    TCP_SESSION_LISTEN,     // 在端口上监听
+    TCP_SESSION_ACCEPTING,  // 已accept，等待握手完成
+    TCP_SESSION_CONNECTED,  // 已建立连接
+};
+
+struct tcp_session_t {
+    NX_TCP_SOCKET socket;
+    UINT port;
+    uint8_t index;
+    volatile uint8_t state;     // enum tcp_session_state
+    uint8_t have;               // 控制会话：query中已收到的字节数
+    uint8_t query[sizeof(uint32_t)];
+};
+
+// 会话0为数据会话，其余为控制会话
+static struct tcp_session_t tcp_sessions[TCP_SESSION_COUNT];
+#define tcp_data_session        (&tcp_sessions[0])
+static TX_EVENT_FLAGS_GROUP tcp_events;
+// 端口是否已经调用过listen，之后换socket监听用relisten
+static uint8_t tcp_data_bound;
+static uint8_t tcp_control_bound;
+
+// 数据会话的吞吐统计：从收到第一个字节到最后一个字节
+static ULONG tcp_rx_bytes;
+static ULONG tcp_rx_first;
+static ULONG tcp_rx_last;
+
+// 发送一段数据，未连接时直接返回
+static UINT tcp_send(struct tcp_session_t *session, VOID *data, ULONG len, ULONG wait_option)
 {
     NX_PACKET *packet_ptr;
     UINT status;
-    ULONG current_time = HAL_GetTick(); // 获取HAL时间戳
-    ULONG ip_address = ip0_address;
-    UINT port;
-    uint16_t max_head_len = 256;
-    uint16_t max_msg_len = MAX_MESSAGE_SIZE;
-    uint16_t max_cplt_msg_len = 256 + MAX_MESSAGE_SIZE;
-    char message[max_msg_len];
-    char cplt_msg[max_cplt_msg_len];
-    va_list args;
-    
-    // 处理可变参数，格式化消息
-    va_start(args, format);
-    vsnprintf(message, MAX_MESSAGE_SIZE, format, args);
-    va_end(args);
-    
-    // 获取当前IP地址和端口号
-    nx_ip_address_get(&ip_0, &ip_address, NULL);
-    port = TCP_SERVER_PORT;
-    
-    // 格式化消息，添加时间戳、IP地址和端口号
-    snprintf(cplt_msg, max_cplt_msg_len, "[%lu ms][%lu.%lu.%lu.%lu:%d] %s", 
-             current_time, 
-             (ip_address >> 24) & 0xFF,
-             (ip_address >> 16) & 0xFF,
-             (ip_address >> 8) & 0xFF,
-             ip_address & 0xFF,
-             port,
-             message);
-    
-    // 分配数据包
-    status = nx_packet_allocate(&pool_0, &packet_ptr, NX_TCP_PACKET, NX_WAIT_FOREVER);
+
+    if (session->state != TCP_SESSION_CONNECTED) {
+        return NX_NOT_CONNECTED;
+    }
+
+    status = nx_packet_allocate(&pool_0, &packet_ptr, NX_TCP_PACKET, wait_option);
     if (status != NX_SUCCESS)
     {
         return status;
     }
-    
-    // 将消息附加到数据包
-    status = nx_packet_data_append(packet_ptr, 
-                                  (VOID *)cplt_msg, 
-                                  strlen(cplt_msg), 
-                                  &pool_0, 
-                                  NX_WAIT_FOREVER);
+
+    status = nx_packet_data_append(packet_ptr, data, len, &pool_0, wait_option);
     if (status != NX_SUCCESS)
     {
         nx_packet_release(packet_ptr);
         return status;
     }
-    
-    // 发送数据包
-    status = nx_tcp_socket_send(&tcp_socket, packet_ptr, NX_WAIT_FOREVER);
+
+    status = nx_tcp_socket_send(&session->socket, packet_ptr, wait_option);
     if (status != NX_SUCCESS)
     {
         nx_packet_release(packet_ptr);
     }
-    
+
     return status;
 }
 
-// firmware
-struct firmware_opt_t firmware_opt;
+// 发送一批日志给控制连接，只由日志线程调用，对端窗口或包池不足时丢弃
+// 上传端的字节流里只有应答，日志没有帧头，混进去主机无法区分
+void tcp_log_send(VOID *data, ULONG len)
+{
+    uint32_t i;
 
-// 线程入口函数
-void thread_socket_entry(ULONG thread_input)
+    for (i = 1; i < TCP_SESSION_COUNT; i++) {
+        tcp_send(&tcp_sessions[i], data, len, NX_NO_WAIT);
+    }
+}
+
+/*
+ * 发送一段二进制数据给上传端，由写flash线程调用，不能无限等待：
+ * 写flash线程阻塞时帧缓冲区不再归还，接收方向无法腾出包池，会与发送互相等待。
+ * 发送失败的应答直接丢弃，下一个应答是累计的，主机超时后也会重发请求。
+ * 应答只发给当前的会话所有者，只看日志的WebSocket页面收不到其他上传端的应答。
+ */
+UINT iap_send(VOID *data, ULONG len)
 {
+    switch (flash_session_owner()) {
+    case FLASH_OWNER_TCP:
+        return tcp_send(tcp_data_session, data, len, TCP_REPLY_WAIT);
+    case FLASH_OWNER_WS:
+        return ws_send(NX_WEBSOCKET_OPCODE_BINARY_FRAME, data, len);
+    default:
+        // 其他传输方式没有应答通道，或会话已经释放
+        return NX_NOT_CONNECTED;
+    }
+}
+
+// 帧重组器，直接组装到写flash线程的帧缓冲区中
+static struct frame_parser_t frame_parser;
+// 重组器暂停时还没处理完的包，有空闲缓冲区后从暂停处继续
+static NX_PACKET *tcp_held;
+
+// 收到一个完整帧，交给写flash线程，并换一个空闲缓冲区继续接收，没有空闲缓冲区时暂停，不阻塞
+static uint8_t on_frame(struct frame_parser_t *parser, uint8_t *frame, uint32_t len)
+{
+    flash_frame_post(frame, len, FLASH_OWNER_TCP);
+    parser->frame = flash_buffer_get(TX_NO_WAIT);
+
+    return parser->frame == NULL ? FRAME_PARSER_STALL : FRAME_PARSER_SUCCESS;
+}
+
+// 以下回调在IP线程中执行，只置事件标志
+static VOID tcp_listen_notify(NX_TCP_SOCKET *socket_ptr, UINT port)
+{
+    tx_event_flags_set(&tcp_events, port == TCP_SERVER_PORT ? TCP_EVENT_LISTEN_DATA : TCP_EVENT_LISTEN_CONTROL, TX_OR);
+}
+
+static VOID tcp_socket_notify(NX_TCP_SOCKET *socket_ptr)
+{
+    struct tcp_session_t *session = (struct tcp_session_t *)socket_ptr->nx_tcp_socket_reserved_ptr;
+
+    tx_event_flags_set(&tcp_events, TCP_EVENT_SESSION(session->index), TX_OR);
+}
+
+// 用端口上一个空闲的会话监听，没有空闲会话时新连接留在监听队列中
+static void tcp_listen(UINT port)
+{
+    uint8_t *bound = port == TCP_SERVER_PORT ? &tcp_data_bound : &tcp_control_bound;
+    struct tcp_session_t *session = NULL;
     UINT status;
-    NX_PACKET *receive_packet;
-    ULONG bytes_read;
-    struct firmware_opt_t *iap = &firmware_opt;
-    
-    // 初始化iap
-    // firmware_opt_init(iap);
-
-    // 创建TCP服务器套接字
-    status = nx_tcp_socket_create(&ip_0, &tcp_socket, "TCP Server Socket", 
-                                 NX_IP_NORMAL, NX_FRAGMENT_OKAY, NX_IP_TIME_TO_LIVE, 
-                                 1024, NX_NULL, NX_NULL);
-    if (status != NX_SUCCESS)
-    {
+    uint32_t i;
+
+    for (i = 0; i < TCP_SESSION_COUNT; i++) {
+        if (tcp_sessions[i].port != port) {
+            continue;
+        }
+        if (tcp_sessions[i].state == TCP_SESSION_LISTEN) {
+            return;
+        }
+        if (session == NULL && tcp_sessions[i].state == TCP_SESSION_IDLE) {
+            session = &tcp_sessions[i];
+        }
+    }
+    if (session == NULL) {
         return;
     }
-    
-    // 绑定TCP套接字到服务器端口
-    status = nx_tcp_server_socket_listen(&ip_0, TCP_SERVER_PORT, &tcp_socket, 5, NX_NULL);
-    if (status != NX_SUCCESS)
-    {
-        nx_tcp_socket_delete(&tcp_socket);
+
+    if (*bound == 0) {
+        status = nx_tcp_server_socket_listen(&ip_0, port, &session->socket, TCP_LISTEN_QUEUE, tcp_listen_notify);
+        *bound = status == NX_SUCCESS;
+    } else {
+        status = nx_tcp_server_socket_relisten(&ip_0, port, &session->socket);
+    }
+    if (status == NX_SUCCESS || status == NX_CONNECTION_PENDING) {
+        session->state = TCP_SESSION_LISTEN;
+    }
+    // 队列中已有等待的连接，不会再有监听回调
+    if (status == NX_CONNECTION_PENDING) {
+        tcp_listen_notify(&session->socket, port);
+    }
+}
+
+// 返回0表示连接被拒绝，需要关闭
+static uint8_t tcp_open(struct tcp_session_t *session)
+{
+    session->have = 0;
+    if (session != tcp_data_session) {
+        return 1;
+    }
+
+    // 每个上传连接都是一次新的升级会话，其他传输方式正在升级时拒绝，帧缓冲区在第一次读取前再取
+    frame_parser.reset(&frame_parser);
+    frame_parser.frame = NULL;
+    tcp_rx_bytes = 0;
+    if (flash_session_open(FLASH_OWNER_TCP) != TX_SUCCESS) {
+        iap_log("client refused, another upload in progress");
+        return 0;
+    }
+    iap_log("client connected");
+
+    return 1;
+}
+
+// 上传结束时报告持续goodput，包含等待写flash的时间，是端到端的实际速率
+static void tcp_report(void)
+{
+    ULONG ms;
+
+    if (tcp_rx_bytes == 0) {
+        return;
+    }
+    ms = (tcp_rx_last - tcp_rx_first) * 1000u / NX_IP_PERIODIC_RATE;
+    iap_log("received %lu bytes in %lu ms, %lu KB/s",
+            tcp_rx_bytes, ms, ms > 0 ? (ULONG)((uint64_t)tcp_rx_bytes * 1000u / 1024u / ms) : 0);
+}
+
+static void tcp_close(struct tcp_session_t *session)
+{
+    if (session == tcp_data_session) {
+        tcp_report();
+        // 未组装完的帧丢弃，缓冲区归还给其他传输方式使用
+        if (frame_parser.frame != NULL) {
+            flash_buffer_put(frame_parser.frame);
+            frame_parser.frame = NULL;
+        }
+        if (tcp_held != NX_NULL) {
+            nx_packet_release(tcp_held);
+            tcp_held = NX_NULL;
+        }
+        tcp_rx_bytes = 0;
+        flash_session_close(FLASH_OWNER_TCP);
+    }
+    session->state = TCP_SESSION_IDLE;
+    nx_tcp_socket_disconnect(&session->socket, NX_NO_WAIT);
+    nx_tcp_server_socket_unaccept(&session->socket);
+    tcp_listen(session->port);
+}
+
+// 握手结束：建立成功时转为已连接并换一个空闲会话继续监听，失败时重新监听，仍在握手时等下一个事件
+static void tcp_handshake(struct tcp_session_t *session)
+{
+    UINT port = session->port;
+
+    if (session->socket.nx_tcp_socket_state == NX_TCP_SYN_RECEIVED) {
         return;
     }
-    
+    if (session->socket.nx_tcp_socket_state != NX_TCP_ESTABLISHED) {
+        session->state = TCP_SESSION_IDLE;
+        nx_tcp_server_socket_unaccept(&session->socket);
+        tcp_listen(port);
+        return;
+    }
+
+    session->state = TCP_SESSION_CONNECTED;
+    if (!tcp_open(session)) {
+        tcp_close(session);
+        return;
+    }
+    tcp_listen(port);
+    // 握手期间到达的数据没有单独的事件
+    tcp_socket_notify(&session->socket);
+}
+
+// 端口上有新连接，由监听中的会话接受，不等待握手完成
+static void tcp_accept(UINT port)
+{
+    struct tcp_session_t *session = NULL;
+    UINT status;
+    uint32_t i;
+
+    for (i = 0; i < TCP_SESSION_COUNT; i++) {
+        if (tcp_sessions[i].port == port && tcp_sessions[i].state == TCP_SESSION_LISTEN) {
+            session = &tcp_sessions[i];
+            break;
+        }
+    }
+    if (session == NULL) {
+        return;
+    }
+
+    status = nx_tcp_server_socket_accept(&session->socket, NX_NO_WAIT);
+    if (status != NX_SUCCESS && status != NX_IN_PROGRESS) {
+        session->state = TCP_SESSION_IDLE;
+        nx_tcp_server_socket_unaccept(&session->socket);
+        tcp_listen(port);
+        return;
+    }
+    session->state = TCP_SESSION_ACCEPTING;
+    tcp_handshake(session);
+}
+
+/*
+ * 读取数据会话的包交给帧重组器，返回0表示已读空或连接已关闭，
+ * 返回1表示没有空闲缓冲区，重组器暂停、未处理完的包保留在tcp_held中，缓冲区归还后继续。
+ * 暂停期间不再从socket取包，TCP窗口随之关闭。
+ */
+static uint8_t tcp_data_service(struct tcp_session_t *session)
+{
+    NX_PACKET *receive_packet;
+    uint8_t result;
+    UINT status;
+
     while (1) {
-        // 等待客户端连接
-        status = nx_tcp_server_socket_accept(&tcp_socket, NX_WAIT_FOREVER);
+        // 长时间没有数据时会话可能已被其他传输方式接管，之后的数据不再投递
+        if (flash_session_hold(FLASH_OWNER_TCP) != TX_SUCCESS) {
+            iap_log("upload session taken over, closing");
+            tcp_close(session);
+            return 0;
+        }
+        if (frame_parser.frame == NULL) {
+            frame_parser.frame = flash_buffer_get(TX_NO_WAIT);
+            if (frame_parser.frame == NULL) {
+                return 1;
+            }
+        }
+
+        if (tcp_held != NX_NULL) {
+            receive_packet = tcp_held;
+            tcp_held = NX_NULL;
+        } else {
+            status = nx_tcp_socket_receive(&session->socket, &receive_packet, NX_NO_WAIT);
+            if (status != NX_SUCCESS) {
+                break;
+            }
+            if (tcp_rx_bytes == 0) {
+                tcp_rx_first = tx_time_get();
+            }
+            tcp_rx_last = tx_time_get();
+            tcp_rx_bytes += receive_packet->nx_packet_length;
+        }
+        // 从包链拷贝一次到帧缓冲区，帧缓冲区直接交给写flash线程
+        result = frame_parser.feed(&frame_parser, receive_packet);
+        if (result == FRAME_PARSER_STALL) {
+            tcp_held = receive_packet;
+            return 1;
+        }
+        if (result != FRAME_PARSER_SUCCESS) {
+            iap_log("frame stream error");
+        }
+        nx_packet_release(receive_packet);
+    }
+
+    if (status == NX_NOT_CONNECTED) {
+        tcp_close(session);
+    }
+
+    return 0;
+}
+
+// 控制会话：每收满4字节"FACK"回复一次写flash线程最近的接收状态
+static void tcp_control_service(struct tcp_session_t *session)
+{
+    NX_PACKET *receive_packet;
+    NX_PACKET *p;
+    struct firmware_ack_t ack;
+    uint32_t magic;
+    uint8_t *data;
+    UINT status;
+
+    while ((status = nx_tcp_socket_receive(&session->socket, &receive_packet, NX_NO_WAIT)) == NX_SUCCESS) {
+        for (p = receive_packet; p != NX_NULL; p = p->nx_packet_next) {
+            for (data = p->nx_packet_prepend_ptr; data < p->nx_packet_append_ptr; data++) {
+                session->query[session->have++] = *data;
+                if (session->have < sizeof(session->query)) {
+                    continue;
+                }
+                session->have = 0;
+                memcpy(&magic, session->query, sizeof(magic));
+                if (magic == FIRMWARE_ACK_MAGIC) {
+                    flash_status_get(&ack);
+                    tcp_send(session, &ack, sizeof(ack), NX_NO_WAIT);
+                }
+            }
+        }
+        nx_packet_release(receive_packet);
+    }
+
+    if (status == NX_NOT_CONNECTED) {
+        tcp_close(session);
+    }
+}
+
+// 线程入口函数
+void thread_socket_entry(ULONG thread_input)
+{
+    struct tcp_session_t *session;
+    ULONG events;
+    ULONG pending = 0;
+    UINT status;
+    uint32_t i;
+
+    tx_event_flags_create(&tcp_events, "tcp events");
+    flash_buffer_notify(&tcp_events, TCP_EVENT_BUFFER);
+    frame_parser_init(&frame_parser, NULL, IAP_PROTOCOL_BUFFER_SIZE, on_frame, NULL);
+
+    // 创建全部会话的套接字，数据会话使用数据端口，其余使用控制端口
+    for (i = 0; i < TCP_SESSION_COUNT; i++) {
+        session = &tcp_sessions[i];
+        session->port = i == 0 ? TCP_SERVER_PORT : TCP_CONTROL_PORT;
+        session->index = i;
+        session->state = TCP_SESSION_IDLE;
+        status = nx_tcp_socket_create(&ip_0, &session->socket, i == 0 ? "TCP Server Socket" : "TCP Control Socket",
+                                      NX_IP_NORMAL, NX_FRAGMENT_OKAY, NX_IP_TIME_TO_LIVE,
+                                      i == 0 ? NX_USER_TCP_BULK_WINDOW : 1024, NX_NULL, tcp_socket_notify);
         if (status != NX_SUCCESS)
         {
-            nx_tcp_server_socket_unaccept(&tcp_socket);
-            nx_tcp_server_socket_unlisten(&ip_0, TCP_SERVER_PORT);
-            nx_tcp_socket_delete(&tcp_socket);
             return;
         }
+        session->socket.nx_tcp_socket_reserved_ptr = session;
+        nx_tcp_socket_receive_notify(&session->socket, tcp_socket_notify);
+        // 握手完成，以及握手中途失败（不会调用断开回调）
+        nx_tcp_socket_establish_notify(&session->socket, tcp_socket_notify);
+        nx_tcp_socket_disconnect_complete_notify(&session->socket, tcp_socket_notify);
+    }
+    tcp_listen(TCP_SERVER_PORT);
+    tcp_listen(TCP_CONTROL_PORT);
 
-        // 发送连接成功消息
-        iap_log("client connected");
+    while (1) {
+        if (tx_event_flags_get(&tcp_events, TCP_EVENT_ALL, TX_OR_CLEAR, &events, TX_WAIT_FOREVER) != TX_SUCCESS) {
+            continue;
+        }
+        // 数据会话在等空闲缓冲区，归还后继续
+        if (events & TCP_EVENT_BUFFER) {
+            events |= pending;
+        }
 
-        while (1)
-        {
-            // 接收数据包
-            status = nx_tcp_socket_receive(&tcp_socket, &receive_packet, NX_WAIT_FOREVER);
-            if (status == NX_SUCCESS) {
-                // 读取数据包内容
-                status = nx_packet_data_retrieve(receive_packet, message_buffer, &bytes_read);
-                if (status == NX_SUCCESS && bytes_read > 0) {
-                    // 确保字符串以null结尾
-                    message_buffer[bytes_read < MAX_MESSAGE_SIZE? bytes_read : MAX_MESSAGE_SIZE - 1] = '\0';
-                    // 添加时间戳并回显收到的消息
-                    iap_log((char *)message_buffer);
-                }
-                // 释放数据包
-                nx_packet_release(receive_packet);
-            } else if (status == NX_NOT_CONNECTED) {
-                // 接受新连接
-                nx_tcp_server_socket_unaccept(&tcp_socket);
-                nx_tcp_server_socket_relisten(&ip_0, TCP_SERVER_PORT, &tcp_socket);
-                break;
+        // 握手结束的会话
+        for (i = 0; i < TCP_SESSION_COUNT; i++) {
+            if ((events & TCP_EVENT_SESSION(i)) && tcp_sessions[i].state == TCP_SESSION_ACCEPTING) {
+                tcp_handshake(&tcp_sessions[i]);
             }
-        }  
+        }
+
+        if (events & TCP_EVENT_LISTEN_CONTROL) {
+            tcp_accept(TCP_CONTROL_PORT);
+        }
+        if (events & TCP_EVENT_LISTEN_DATA) {
+            tcp_accept(TCP_SERVER_PORT);
+        }
+
+        // 控制会话先处理，状态查询不排在大块数据之后
+        for (i = 1; i < TCP_SESSION_COUNT; i++) {
+            if ((events & TCP_EVENT_SESSION(i)) && tcp_sessions[i].state == TCP_SESSION_CONNECTED) {
+                tcp_control_service(&tcp_sessions[i]);
+            }
+        }
+        if ((events & TCP_EVENT_SESSION(0)) && tcp_data_session->state == TCP_SESSION_CONNECTED) {
+            pending = tcp_data_service(tcp_data_session) ? TCP_EVENT_SESSION(0) : 0;
+        }
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,443 @@
+#include "thread_tftp.h"
+#include "thread_socket.h"
+#include "thread_flash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * TFTP写服务器（RFC 1350），支持blksize（RFC 2348）、tsize/timeout（RFC 2349）和windowsize（RFC 7440）选项。
+ * 只接受octet模式的WRQ，文件名忽略，收到的文件即新的app镜像。
+ * 每次传输使用一个新绑定的UDP端口，数据块按序拼接到写flash线程的缓冲区中，
+ * 缓冲区满后交给写flash线程按偏移写入firmware区域，与TCP升级共用缓冲区和firmware_opt。
+ * 缓冲区全部在途时本线程阻塞在flash_buffer_get中，窗口的ACK随之推迟，发送方被限速。
+ * 收到WRQ时用flash_session_open取得会话，其他传输方式正持有会话时回复ERROR拒绝这次请求，
+ * 不复位写flash线程中的会话状态；取得会话后才复位并开始接收。
+ * 传输停顿超过FLASH_SESSION_TIMEOUT后会话可能被其他传输方式接管，之后的数据块回复ERROR并结束传输。
+ */
+
+enum tftp_opcode {
+    TFTP_RRQ = 1,
+    TFTP_WRQ,
+    TFTP_DATA,
+    TFTP_ACK,
+    TFTP_ERROR,
+    TFTP_OACK,
+};
+
+enum tftp_error_code {
+    TFTP_ERR_UNDEFINED = 0,
+    TFTP_ERR_ACCESS = 2,
+    TFTP_ERR_DISK_FULL = 3,
+    TFTP_ERR_ILLEGAL_OP = 4,
+    TFTP_ERR_UNKNOWN_TID = 5,
+    TFTP_ERR_OPTION = 8,
+};
+
+#define TFTP_HEADER_SIZE        4u      // opcode + 块号
+#define TFTP_REQUEST_SIZE       512u    // WRQ最大长度
+#define TFTP_REPLY_SIZE         128u    // OACK最大长度
+
+struct tftp_session_t {
+    ULONG peer_ip;
+    UINT peer_port;
+    uint32_t blksize;
+    uint32_t windowsize;
+    ULONG timeout;              // 单位tick
+    uint32_t tsize;             // 客户端声明的文件长度，0表示未知
+    uint16_t block;             // 最后一个按序收到的块号
+    uint32_t count;             // 当前窗口已收到的块数
+    uint8_t nacked;             // 已为当前缺口发送过ACK
+    uint8_t *buffer;            // 写flash线程的缓冲区
+    uint32_t fill;              // 缓冲区中的字节数
+    uint32_t offset;            // 缓冲区第一个字节在镜像中的偏移
+    uint8_t reply[TFTP_REPLY_SIZE];     // 最近一次的应答，超时后重发
+    uint32_t reply_len;
+};
+
+static NX_UDP_SOCKET tftp_listen_socket;
+static NX_UDP_SOCKET tftp_data_socket;
+static struct tftp_session_t tftp_session;
+
+static UINT tftp_send(NX_UDP_SOCKET *socket, ULONG ip, UINT port, VOID *data, ULONG len)
+{
+    NX_PACKET *packet_ptr;
+    UINT status;
+
+    status = nx_packet_allocate(&pool_0, &packet_ptr, NX_UDP_PACKET, NX_WAIT_FOREVER);
+    if (status != NX_SUCCESS)
+    {
+        return status;
+    }
+
+    status = nx_packet_data_append(packet_ptr, data, len, &pool_0, NX_WAIT_FOREVER);
+    if (status != NX_SUCCESS)
+    {
+        nx_packet_release(packet_ptr);
+        return status;
+    }
+
+    status = nx_udp_socket_send(socket, packet_ptr, ip, port);
+    if (status != NX_SUCCESS)
+    {
+        nx_packet_release(packet_ptr);
+    }
+
+    return status;
+}
+
+static void tftp_error(NX_UDP_SOCKET *socket, ULONG ip, UINT port, uint16_t code, const char *msg)
+{
+    uint8_t buf[TFTP_HEADER_SIZE + 64];
+    uint32_t len = strlen(msg);
+
+    if (len > sizeof(buf) - TFTP_HEADER_SIZE - 1) {
+        len = sizeof(buf) - TFTP_HEADER_SIZE - 1;
+    }
+    buf[0] = 0;
+    buf[1] = TFTP_ERROR;
+    buf[2] = code >> 8;
+    buf[3] = code & 0xFF;
+    memcpy(&buf[TFTP_HEADER_SIZE], msg, len);
+    buf[TFTP_HEADER_SIZE + len] = 0;
+
+    tftp_send(socket, ip, port, buf, TFTP_HEADER_SIZE + len + 1);
+}
+
+// 应答最后一个按序收到的块，并留作超时重发
+static void tftp_ack(struct tftp_session_t *s)
+{
+    s->reply[0] = 0;
+    s->reply[1] = TFTP_ACK;
+    s->reply[2] = s->block >> 8;
+    s->reply[3] = s->block & 0xFF;
+    s->reply_len = TFTP_HEADER_SIZE;
+    s->count = 0;
+
+    tftp_send(&tftp_data_socket, s->peer_ip, s->peer_port, s->reply, s->reply_len);
+}
+
+// 在OACK中追加一个选项
+static void tftp_oack_append(struct tftp_session_t *s, const char *name, uint32_t value)
+{
+    int n;
+
+    n = snprintf((char *)&s->reply[s->reply_len], TFTP_REPLY_SIZE - s->reply_len, "%s%c%lu",
+                 name, 0, (unsigned long)value);
+    if (n > 0 && s->reply_len + n + 1 <= TFTP_REPLY_SIZE) {
+        s->reply_len += n + 1;
+    }
+}
+
+/*
+ * 解析WRQ：filename, mode, 然后是若干选项名/值对，均以'\0'结尾。
+ * 不认识的选项按RFC 2347忽略，认识的选项按本机上限裁剪后写入OACK。
+ * 返回0表示成功，否则为TFTP错误码。
+ */
+static uint16_t tftp_wrq_parse(struct tftp_session_t *s, char *req, uint32_t len)
+{
+    char *p = req + 2;
+    char *end = req + len;
+    char *mode;
+    char *name;
+    char *value;
+    uint32_t v;
+
+    s->blksize = TFTP_DEFAULT_BLKSIZE;
+    s->windowsize = 1;
+    s->timeout = TFTP_DEFAULT_TIMEOUT * NX_IP_PERIODIC_RATE;
+    s->tsize = 0;
+    s->reply[0] = 0;
+    s->reply[1] = TFTP_OACK;
+    s->reply_len = 2;
+
+    if (len < 2 || end[-1] != 0) {
+        return TFTP_ERR_ILLEGAL_OP;
+    }
+    // 跳过文件名
+    p += strlen(p) + 1;
+    if (p >= end) {
+        return TFTP_ERR_ILLEGAL_OP;
+    }
+    mode = p;
+    p += strlen(p) + 1;
+    if (strcasecmp(mode, "octet") != 0) {
+        return TFTP_ERR_ILLEGAL_OP;
+    }
+
+    while (p < end) {
+        name = p;
+        p += strlen(p) + 1;
+        if (p >= end) {
+            break;
+        }
+        value = p;
+        p += strlen(p) + 1;
+        v = strtoul(value, NULL, 10);
+
+        if (strcasecmp(name, "blksize") == 0) {
+            if (v < 8) {
+                return TFTP_ERR_OPTION;
+            }
+            s->blksize = v < TFTP_MAX_BLKSIZE ? v : TFTP_MAX_BLKSIZE;
+            tftp_oack_append(s, "blksize", s->blksize);
+        } else if (strcasecmp(name, "windowsize") == 0) {
+            if (v < 1) {
+                return TFTP_ERR_OPTION;
+            }
+            s->windowsize = v < TFTP_MAX_WINDOWSIZE ? v : TFTP_MAX_WINDOWSIZE;
+            tftp_oack_append(s, "windowsize", s->windowsize);
+        } else if (strcasecmp(name, "timeout") == 0) {
+            if (v < 1 || v > 255) {
+                return TFTP_ERR_OPTION;
+            }
+            s->timeout = v * NX_IP_PERIODIC_RATE;
+            tftp_oack_append(s, "timeout", v);
+        } else if (strcasecmp(name, "tsize") == 0) {
+            if (v > BOOTLOADER_FIRMWARE_DATA_SIZE) {
+                return TFTP_ERR_DISK_FULL;
+            }
+            s->tsize = v;
+            tftp_oack_append(s, "tsize", v);
+        }
+    }
+
+    return 0;
+}
+
+// 把一个数据块拼接到缓冲区，缓冲区满时交给写flash线程
+static void tftp_stage(struct tftp_session_t *s, NX_PACKET *packet, uint32_t len)
+{
+    ULONG pos = TFTP_HEADER_SIZE;
+    ULONG n;
+    ULONG copied;
+
+    while (len > 0) {
+        n = IAP_PROTOCOL_BUFFER_SIZE - s->fill;
+        if (n > len) {
+            n = len;
+        }
+        nx_packet_data_extract_offset(packet, pos, &s->buffer[s->fill], n, &copied);
+        s->fill += n;
+        pos += n;
+        len -= n;
+
+        if (s->fill == IAP_PROTOCOL_BUFFER_SIZE) {
+            flash_stage_post(s->buffer, s->offset, s->fill);
+            s->offset += s->fill;
+            s->fill = 0;
+            s->buffer = flash_buffer_get(TX_WAIT_FOREVER);
+        }
+    }
+}
+
+// 最后一块到达后重传ACK，直到客户端不再重发最后一块
+static void tftp_dally(struct tftp_session_t *s)
+{
+    NX_PACKET *packet;
+
+    while (nx_udp_socket_receive(&tftp_data_socket, &packet, s->timeout) == NX_SUCCESS) {
+        nx_packet_release(packet);
+        tftp_send(&tftp_data_socket, s->peer_ip, s->peer_port, s->reply, s->reply_len);
+    }
+}
+
+/*
+ * 接收数据块。按序的块拼入缓冲区，凑满一个窗口或收到最后一块时ACK；
+ * 出现缺口时立即ACK最后一个按序块，发送方从缺口处重发整个窗口（RFC 7440）。
+ * 返回NX_SUCCESS表示文件接收完整。
+ */
+static UINT tftp_transfer(struct tftp_session_t *s)
+{
+    NX_PACKET *packet;
+    ULONG ip;
+    UINT port;
+    UCHAR head[TFTP_HEADER_SIZE];
+    ULONG copied;
+    uint32_t len;
+    uint32_t retries = 0;
+    uint16_t block;
+    UINT status;
+
+    while (1) {
+        status = nx_udp_socket_receive(&tftp_data_socket, &packet, s->timeout);
+        if (status != NX_SUCCESS) {
+            if (++retries > TFTP_MAX_RETRIES) {
+                return NX_NO_PACKET;
+            }
+            s->count = 0;
+            tftp_send(&tftp_data_socket, s->peer_ip, s->peer_port, s->reply, s->reply_len);
+            continue;
+        }
+
+        nx_udp_source_extract(packet, &ip, &port);
+        if (ip != s->peer_ip || port != s->peer_port) {
+            nx_packet_release(packet);
+            tftp_error(&tftp_data_socket, ip, port, TFTP_ERR_UNKNOWN_TID, "unknown transfer id");
+            continue;
+        }
+        nx_packet_data_extract_offset(packet, 0, head, sizeof(head), &copied);
+        if (copied < sizeof(head) || head[1] != TFTP_DATA || head[0] != 0) {
+            nx_packet_release(packet);
+            if (copied < 2 || head[1] != TFTP_ERROR) {
+                tftp_error(&tftp_data_socket, ip, port, TFTP_ERR_ILLEGAL_OP, "expect data");
+            }
+            return NX_INVALID_PACKET;
+        }
+
+        block = ((uint16_t)head[2] << 8) | head[3];
+        len = packet->nx_packet_length - TFTP_HEADER_SIZE;
+        if (block != (uint16_t)(s->block + 1) || len > s->blksize) {
+            nx_packet_release(packet);
+            if (!s->nacked) {
+                s->nacked = 1;
+                tftp_ack(s);
+            }
+            continue;
+        }
+        if (s->offset + s->fill + len > BOOTLOADER_FIRMWARE_DATA_SIZE) {
+            nx_packet_release(packet);
+            tftp_error(&tftp_data_socket, ip, port, TFTP_ERR_DISK_FULL, "image too large");
+            return NX_OVERFLOW;
+        }
+
+        // 传输停顿太久时会话可能已被其他传输方式接管
+        if (flash_session_hold(FLASH_OWNER_TFTP) != TX_SUCCESS) {
+            nx_packet_release(packet);
+            tftp_error(&tftp_data_socket, ip, port, TFTP_ERR_UNDEFINED, "upload taken over");
+            return NX_NOT_CONNECTED;
+        }
+        tftp_stage(s, packet, len);
+        nx_packet_release(packet);
+        s->block = block;
+        s->nacked = 0;
+        s->count++;
+        retries = 0;
+
+        if (len < s->blksize) {
+            return NX_SUCCESS;
+        }
+        if (s->count >= s->windowsize) {
+            tftp_ack(s);
+        }
+    }
+}
+
+// 处理一个WRQ，完成整个文件的接收
+static void tftp_request(NX_PACKET *request)
+{
+    struct tftp_session_t *s = &tftp_session;
+    char req[TFTP_REQUEST_SIZE];
+    ULONG copied;
+    uint16_t err;
+    uint8_t owned;
+    UINT status;
+
+    nx_udp_source_extract(request, &s->peer_ip, &s->peer_port);
+    nx_packet_data_extract_offset(request, 0, req, sizeof(req), &copied);
+    nx_packet_release(request);
+
+    if (copied < 2 || req[0] != 0 || req[1] != TFTP_WRQ) {
+        tftp_error(&tftp_listen_socket, s->peer_ip, s->peer_port, TFTP_ERR_ILLEGAL_OP, "write only");
+        return;
+    }
+
+    // 传输使用新的端口作为本端TID
+    if (nx_udp_socket_bind(&tftp_data_socket, NX_ANY_PORT, NX_NO_WAIT) != NX_SUCCESS) {
+        tftp_error(&tftp_listen_socket, s->peer_ip, s->peer_port, TFTP_ERR_UNDEFINED, "busy");
+        return;
+    }
+    err = tftp_wrq_parse(s, req, copied);
+    if (err != 0) {
+        tftp_error(&tftp_data_socket, s->peer_ip, s->peer_port, err, "bad request");
+        nx_udp_socket_unbind(&tftp_data_socket);
+        return;
+    }
+
+    // 其他传输方式正在升级时拒绝请求
+    if (flash_session_open(FLASH_OWNER_TFTP) != TX_SUCCESS) {
+        tftp_error(&tftp_data_socket, s->peer_ip, s->peer_port, TFTP_ERR_UNDEFINED, "upload busy");
+        nx_udp_socket_unbind(&tftp_data_socket);
+        return;
+    }
+
+    iap_log("tftp write request, blksize %lu, windowsize %lu", s->blksize, s->windowsize);
+    s->block = 0;
+    s->nacked = 0;
+    s->fill = 0;
+    s->offset = 0;
+    s->buffer = flash_buffer_get(TX_WAIT_FOREVER);
+
+    // 带选项时回复OACK，否则ACK 0号块
+    if (s->reply_len > 2) {
+        s->count = 0;
+        tftp_send(&tftp_data_socket, s->peer_ip, s->peer_port, s->reply, s->reply_len);
+    } else {
+        tftp_ack(s);
+    }
+
+    status = tftp_transfer(s);
+    if (status == NX_SUCCESS && s->tsize != 0 && s->offset + s->fill != s->tsize) {
+        tftp_error(&tftp_data_socket, s->peer_ip, s->peer_port, TFTP_ERR_UNDEFINED, "size mismatch");
+        status = NX_INVALID_PACKET;
+    }
+
+    // 剩余数据交给写flash线程，会话不完整时写flash线程按长度不符拒绝写入app区域
+    // 会话已被接管时不再投递
+    owned = flash_session_hold(FLASH_OWNER_TFTP) == TX_SUCCESS;
+    if (owned && s->fill > 0) {
+        flash_stage_post(s->buffer, s->offset, s->fill);
+    } else {
+        flash_buffer_put(s->buffer);
+    }
+    if (owned) {
+        flash_stage_end_post(status == NX_SUCCESS ? s->offset + s->fill : 0);
+        flash_session_close(FLASH_OWNER_TFTP);
+    }
+
+    if (status == NX_SUCCESS) {
+        tftp_ack(s);
+        tftp_dally(s);
+    } else {
+        iap_log("tftp transfer aborted at block %u", s->block);
+    }
+    nx_udp_socket_unbind(&tftp_data_socket);
+}
+
+// 线程入口函数
+void thread_tftp_entry(ULONG thread_input)
+{
+    UINT status;
+    NX_PACKET *packet;
+
+    status = nx_udp_socket_create(&ip_0, &tftp_listen_socket, "TFTP Server Socket",
+                                  NX_IP_NORMAL, NX_FRAGMENT_OKAY, NX_IP_TIME_TO_LIVE, 4);
+    status |= nx_udp_socket_create(&ip_0, &tftp_data_socket, "TFTP Data Socket",
+                                   NX_IP_NORMAL, NX_FRAGMENT_OKAY, NX_IP_TIME_TO_LIVE, TFTP_MAX_WINDOWSIZE + 1);
+    if (status != NX_SUCCESS)
+    {
+        return;
+    }
+
+    status = nx_udp_socket_bind(&tftp_listen_socket, TFTP_SERVER_PORT, TX_WAIT_FOREVER);
+    if (status != NX_SUCCESS)
+    {
+        nx_udp_socket_delete(&tftp_listen_socket);
+        nx_udp_socket_delete(&tftp_data_socket);
+        return;
+    }
+
+    while (1) {
+        status = nx_udp_socket_receive(&tftp_listen_socket, &packet, NX_WAIT_FOREVER);
+        if (status != NX_SUCCESS) {
+            continue;
+        }
+        tftp_request(packet);
+
+        // 传输期间客户端重发的WRQ已经过时，丢弃
+        while (nx_udp_socket_receive(&tftp_listen_socket, &packet, NX_NO_WAIT) == NX_SUCCESS) {
+            nx_packet_release(packet);
+        }
+    }
+}
@@ -0,0 +1,430 @@
+#include "thread_ws.h"
+#include "thread_socket.h"
+#include "thread_flash.h"
+#include "frame_parser.h"
+#include "nx_sha1.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * WebSocket服务端（RFC 6455），供浏览器直接升级和查看日志。
+ * NetX Duo的websocket插件只有客户端，这里只借用它的常量和SHA-1，握手和分帧自己处理。
+ * 浏览器发来的二进制消息按字节流处理，与TCP端口7000上的数据完全相同，
+ * 去掩码后直接送入帧重组器，消息边界与协议帧边界无关。
+ * iap_log的日志以文本消息发回浏览器；本连接开始了升级会话时，iap_send的应答以二进制消息发回。
+ * 第一段二进制数据到达时才开始升级会话并占用帧缓冲区，只看日志的连接不影响其他传输方式；
+ * 其他传输方式正在升级时以1013（稍后再试）关闭连接。
+ * 同一时间只服务一个连接。
+ */
+
+#define WS_ACCEPT_GUID          "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_KEY_SIZE             32u     // Sec-WebSocket-Key为16字节的base64编码，24个字符
+#define WS_ACCEPT_SIZE          32u     // SHA-1摘要的base64编码，28个字符
+#define WS_CLOSE_TRY_AGAIN      1013u   // 关闭码：服务暂时不可用
+
+struct ws_conn_t {
+    NX_PACKET *packet;          // 正在读取的数据包链
+    NX_PACKET *seg;             // 包链中正在读取的包
+    UCHAR *ptr;                 // seg中下一个未读字节
+    UINT message_opcode;        // 分片消息第一帧的opcode
+    char line[WS_LINE_SIZE];
+    char key[WS_KEY_SIZE];
+    uint8_t control[WS_CONTROL_SIZE];
+};
+
+static NX_TCP_SOCKET ws_socket;
+static struct ws_conn_t ws_conn;
+static volatile uint8_t ws_connected;
+static NX_SHA1 ws_sha1;
+
+// 帧重组器，直接组装到写flash线程的帧缓冲区中，没有上传时frame为NULL
+static struct frame_parser_t ws_parser;
+
+static uint8_t ws_on_frame(struct frame_parser_t *parser, uint8_t *frame, uint32_t len)
+{
+    flash_frame_post(frame, len, FLASH_OWNER_WS);
+    parser->frame = flash_buffer_get(TX_WAIT_FOREVER);
+
+    return FRAME_PARSER_SUCCESS;
+}
+
+static UINT ws_raw_send(VOID *head, ULONG head_len, VOID *data, ULONG len)
+{
+    NX_PACKET *packet_ptr;
+    UINT status;
+
+    status = nx_packet_allocate(&pool_0, &packet_ptr, NX_TCP_PACKET, WS_TIMEOUT);
+    if (status != NX_SUCCESS)
+    {
+        return status;
+    }
+
+    status = nx_packet_data_append(packet_ptr, head, head_len, &pool_0, WS_TIMEOUT);
+    if (status == NX_SUCCESS && len > 0)
+    {
+        status = nx_packet_data_append(packet_ptr, data, len, &pool_0, WS_TIMEOUT);
+    }
+    if (status != NX_SUCCESS)
+    {
+        nx_packet_release(packet_ptr);
+        return status;
+    }
+
+    status = nx_tcp_socket_send(&ws_socket, packet_ptr, WS_TIMEOUT);
+    if (status != NX_SUCCESS)
+    {
+        nx_packet_release(packet_ptr);
+    }
+
+    return status;
+}
+
+// 服务端发出的帧不加掩码，一条消息一个帧，一个帧放在一个包链里，多个线程同时发送也不会交错
+UINT ws_send(UINT opcode, VOID *data, ULONG len)
+{
+    UCHAR head[4];
+    ULONG head_len;
+
+    if (!ws_connected) {
+        return NX_NOT_CONNECTED;
+    }
+    if (len > 0xFFFF) {
+        return NX_INVALID_PARAMETERS;
+    }
+
+    head[0] = NX_WEBSOCKET_FIN | opcode;
+    if (len < 126) {
+        head[1] = len;
+        head_len = 2;
+    } else {
+        head[1] = 126;
+        head[2] = len >> 8;
+        head[3] = len & 0xFF;
+        head_len = 4;
+    }
+
+    return ws_raw_send(head, head_len, data, len);
+}
+
+/*
+ * 一段去掩码后的上传数据送入帧重组器，第一段数据到达时开始会话并取帧缓冲区。
+ * 其他传输方式持有会话，或长时间停顿后会话被接管时，发送关闭帧并返回NX_NOT_CONNECTED。
+ */
+static UINT ws_upload(UCHAR *data, ULONG len)
+{
+    UCHAR reason[2] = {WS_CLOSE_TRY_AGAIN >> 8, WS_CLOSE_TRY_AGAIN & 0xFF};
+
+    if (ws_parser.frame == NULL) {
+        if (flash_session_open(FLASH_OWNER_WS) != TX_SUCCESS) {
+            iap_log("websocket upload refused, another upload in progress");
+            ws_send(NX_WEBSOCKET_OPCODE_CONNECTION_CLOSE, reason, sizeof(reason));
+            return NX_NOT_CONNECTED;
+        }
+        frame_parser_init(&ws_parser, flash_buffer_get(TX_WAIT_FOREVER), IAP_PROTOCOL_BUFFER_SIZE, ws_on_frame, NULL);
+    } else if (flash_session_hold(FLASH_OWNER_WS) != TX_SUCCESS) {
+        iap_log("websocket upload taken over, closing");
+        ws_send(NX_WEBSOCKET_OPCODE_CONNECTION_CLOSE, reason, sizeof(reason));
+        return NX_NOT_CONNECTED;
+    }
+
+    if (ws_parser.write(&ws_parser, data, len) != FRAME_PARSER_SUCCESS) {
+        iap_log("frame stream error");
+    }
+
+    return NX_SUCCESS;
+}
+
+// 取当前包中最多max个连续字节，包读完后接收下一个包
+static UINT ws_next(struct ws_conn_t *c, UCHAR **data, ULONG max, ULONG *n)
+{
+    UINT status;
+
+    while (c->seg == NX_NULL || c->ptr >= c->seg->nx_packet_append_ptr) {
+        if (c->seg != NX_NULL && c->seg->nx_packet_next != NX_NULL) {
+            c->seg = c->seg->nx_packet_next;
+            c->ptr = c->seg->nx_packet_prepend_ptr;
+            continue;
+        }
+        if (c->packet != NX_NULL) {
+            nx_packet_release(c->packet);
+            c->packet = NX_NULL;
+            c->seg = NX_NULL;
+        }
+        status = nx_tcp_socket_receive(&ws_socket, &c->packet, NX_WAIT_FOREVER);
+        if (status != NX_SUCCESS) {
+            c->packet = NX_NULL;
+            return status;
+        }
+        c->seg = c->packet;
+        c->ptr = c->packet->nx_packet_prepend_ptr;
+    }
+
+    *n = (ULONG)(c->seg->nx_packet_append_ptr - c->ptr);
+    if (*n > max) {
+        *n = max;
+    }
+    *data = c->ptr;
+    c->ptr += *n;
+
+    return NX_SUCCESS;
+}
+
+static UINT ws_read(struct ws_conn_t *c, uint8_t *buf, ULONG len)
+{
+    UCHAR *data;
+    ULONG n;
+    UINT status;
+
+    while (len > 0) {
+        status = ws_next(c, &data, len, &n);
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+        memcpy(buf, data, n);
+        buf += n;
+        len -= n;
+    }
+
+    return NX_SUCCESS;
+}
+
+// 读取一行握手请求，去掉行尾的CRLF，过长的部分丢弃
+static UINT ws_read_line(struct ws_conn_t *c)
+{
+    uint32_t len = 0;
+    UCHAR ch;
+    UINT status;
+
+    while (1) {
+        status = ws_read(c, &ch, 1);
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+        if (ch == '\n') {
+            break;
+        }
+        if (ch != '\r' && len < WS_LINE_SIZE - 1) {
+            c->line[len++] = ch;
+        }
+    }
+    c->line[len] = 0;
+
+    return NX_SUCCESS;
+}
+
+// 去掉头部字段值前面的空格
+static char *ws_header_value(char *line, uint32_t name_len)
+{
+    char *p = line + name_len;
+
+    while (*p == ' ') {
+        p++;
+    }
+
+    return p;
+}
+
+/*
+ * 处理HTTP升级请求：Sec-WebSocket-Accept = base64(SHA1(key + GUID))
+ * 不是WebSocket请求时回复400并断开。
+ */
+static UINT ws_handshake(struct ws_conn_t *c)
+{
+    static const char bad_request[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+    UCHAR digest[20];
+    UCHAR accept[WS_ACCEPT_SIZE];
+    char reply[160];
+    uint8_t upgrade = 0;
+    UINT accept_len;
+    UINT status;
+    int len;
+
+    c->key[0] = 0;
+    status = ws_read_line(c);
+    if (status != NX_SUCCESS) {
+        return status;
+    }
+    if (strncmp(c->line, "GET ", 4) != 0) {
+        ws_raw_send((VOID *)bad_request, sizeof(bad_request) - 1, NX_NULL, 0);
+        return NX_INVALID_PACKET;
+    }
+
+    while (1) {
+        status = ws_read_line(c);
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+        if (c->line[0] == 0) {
+            break;
+        }
+        if (strncasecmp(c->line, "Sec-WebSocket-Key:", 18) == 0) {
+            strncpy(c->key, ws_header_value(c->line, 18), WS_KEY_SIZE - 1);
+            c->key[WS_KEY_SIZE - 1] = 0;
+        } else if (strncasecmp(c->line, "Upgrade:", 8) == 0) {
+            upgrade = (strncasecmp(ws_header_value(c->line, 8), "websocket", 9) == 0);
+        }
+    }
+    if (!upgrade || c->key[0] == 0) {
+        ws_raw_send((VOID *)bad_request, sizeof(bad_request) - 1, NX_NULL, 0);
+        return NX_INVALID_PACKET;
+    }
+
+    _nx_sha1_initialize(&ws_sha1);
+    _nx_sha1_update(&ws_sha1, (UCHAR *)c->key, strlen(c->key));
+    _nx_sha1_update(&ws_sha1, (UCHAR *)WS_ACCEPT_GUID, sizeof(WS_ACCEPT_GUID) - 1);
+    _nx_sha1_digest_calculate(&ws_sha1, digest);
+    _nx_utility_base64_encode(digest, sizeof(digest), accept, sizeof(accept), &accept_len);
+
+    len = snprintf(reply, sizeof(reply),
+                   "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                   "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+
+    return ws_raw_send(reply, len, NX_NULL, 0);
+}
+
+// 接收并处理一个WebSocket帧，对方关闭连接时返回NX_NOT_CONNECTED
+static UINT ws_frame(struct ws_conn_t *c)
+{
+    UCHAR head[2];
+    UCHAR ext[8];
+    UCHAR mask[NX_WEBSOCKET_MASKING_KEY_SIZE];
+    UCHAR *data;
+    UINT opcode;
+    ULONG len;
+    ULONG pos = 0;
+    ULONG n;
+    ULONG i;
+    UINT status;
+
+    status = ws_read(c, head, sizeof(head));
+    if (status != NX_SUCCESS) {
+        return status;
+    }
+    opcode = head[0] & NX_WEBSOCKET_OPCODE_MASK;
+    len = head[1] & NX_WEBSOCKET_PAYLOAD_LEN_MASK;
+    if (len == 126) {
+        status = ws_read(c, ext, 2);
+        len = ((ULONG)ext[0] << 8) | ext[1];
+    } else if (len == 127) {
+        status = ws_read(c, ext, 8);
+        if (ext[0] | ext[1] | ext[2] | ext[3]) {
+            return NX_INVALID_PACKET;
+        }
+        len = ((ULONG)ext[4] << 24) | ((ULONG)ext[5] << 16) | ((ULONG)ext[6] << 8) | ext[7];
+    }
+    if (status != NX_SUCCESS) {
+        return status;
+    }
+    // 客户端发来的帧必须带掩码
+    if ((head[1] & NX_WEBSOCKET_MASK) == 0) {
+        return NX_INVALID_PACKET;
+    }
+    status = ws_read(c, mask, sizeof(mask));
+    if (status != NX_SUCCESS) {
+        return status;
+    }
+
+    // 控制帧
+    if (opcode & 0x08) {
+        if (len > WS_CONTROL_SIZE) {
+            return NX_INVALID_PACKET;
+        }
+        status = ws_read(c, c->control, len);
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+        for (i = 0; i < len; i++) {
+            c->control[i] ^= mask[i & 3];
+        }
+        if (opcode == NX_WEBSOCKET_OPCODE_PING) {
+            ws_send(NX_WEBSOCKET_OPCODE_PONG, c->control, len);
+        } else if (opcode == NX_WEBSOCKET_OPCODE_CONNECTION_CLOSE) {
+            ws_send(NX_WEBSOCKET_OPCODE_CONNECTION_CLOSE, c->control, len < 2 ? len : 2);
+            return NX_NOT_CONNECTED;
+        }
+        return NX_SUCCESS;
+    }
+
+    if (opcode == NX_WEBSOCKET_OPCODE_CONTINUATION_FRAME) {
+        opcode = c->message_opcode;
+    } else {
+        c->message_opcode = opcode;
+    }
+
+    // 负载在包中原地去掩码，二进制数据送入帧重组器，文本消息忽略
+    while (pos < len) {
+        status = ws_next(c, &data, len - pos, &n);
+        if (status != NX_SUCCESS) {
+            return status;
+        }
+        for (i = 0; i < n; i++) {
+            data[i] ^= mask[(pos + i) & 3];
+        }
+        if (opcode == NX_WEBSOCKET_OPCODE_BINARY_FRAME) {
+            status = ws_upload(data, n);
+            if (status != NX_SUCCESS) {
+                return status;
+            }
+        }
+        pos += n;
+    }
+
+    return NX_SUCCESS;
+}
+
+// 线程入口函数
+void thread_ws_entry(ULONG thread_input)
+{
+    struct ws_conn_t *c = &ws_conn;
+    UINT status;
+
+    status = nx_tcp_socket_create(&ip_0, &ws_socket, "WebSocket Server Socket",
+                                  NX_IP_NORMAL, NX_FRAGMENT_OKAY, NX_IP_TIME_TO_LIVE,
+                                  WS_WINDOW_SIZE, NX_NULL, NX_NULL);
+    if (status != NX_SUCCESS)
+    {
+        return;
+    }
+
+    status = nx_tcp_server_socket_listen(&ip_0, WS_SERVER_PORT, &ws_socket, 1, NX_NULL);
+    if (status != NX_SUCCESS)
+    {
+        nx_tcp_socket_delete(&ws_socket);
+        return;
+    }
+
+    while (1) {
+        status = nx_tcp_server_socket_accept(&ws_socket, NX_WAIT_FOREVER);
+        if (status == NX_SUCCESS) {
+            c->packet = NX_NULL;
+            c->seg = NX_NULL;
+            c->message_opcode = NX_WEBSOCKET_OPCODE_BINARY_FRAME;
+            status = ws_handshake(c);
+        }
+
+        if (status == NX_SUCCESS) {
+            ws_connected = 1;
+            iap_log("websocket connected");
+
+            // 会话和帧缓冲区在第一段上传数据到达时再取，见ws_upload
+            ws_parser.frame = NULL;
+            while (ws_frame(c) == NX_SUCCESS) {
+            }
+            ws_connected = 0;
+            if (ws_parser.frame != NULL) {
+                flash_buffer_put(ws_parser.frame);
+                ws_parser.frame = NULL;
+                flash_session_close(FLASH_OWNER_WS);
+            }
+        }
+
+        if (c->packet != NX_NULL) {
+            nx_packet_release(c->packet);
+            c->packet = NX_NULL;
+        }
+        nx_tcp_socket_disconnect(&ws_socket, WS_TIMEOUT);
+        nx_tcp_server_socket_unaccept(&ws_socket);
+        nx_tcp_server_socket_relisten(&ip_0, WS_SERVER_PORT, &ws_socket);
+    }
+}
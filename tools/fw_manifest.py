@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+# 生成v2协议的镜像清单（FIRMWARE_V2_TYPE_MANIFEST帧的数据段），格式见Bsp/inc/firmware_manifest.h
+# 用法: fw_manifest.py image.bin frame_size out.bin key.pem
+# 签名调用openssl，key.pem为P-256私钥，固件中的公钥由构建时从同一密钥生成，见tools/fw_pubkey.py
+import hashlib
+import struct
+import subprocess
+import sys
+
+MANIFEST_MAGIC = 0x4E414D46
+SIG_MAX = 72
+
+
+def leaf_hash(data):
+    return hashlib.sha256(b'\x00' + data).digest()
+
+
+def node_hash(left, right):
+    return hashlib.sha256(b'\x01' + left + right).digest()
+
+
+# RFC 6962：左子树取小于叶子数的最大2的幂
+def merkle_root(leaves):
+    if len(leaves) == 1:
+        return leaves[0]
+    k = 1
+    while k * 2 < len(leaves):
+        k *= 2
+    return node_hash(merkle_root(leaves[:k]), merkle_root(leaves[k:]))
+
+
+def main():
+    if len(sys.argv) < 5:
+        sys.exit('usage: fw_manifest.py image.bin frame_size out.bin key.pem')
+    image = open(sys.argv[1], 'rb').read()
+    frame_size = int(sys.argv[2], 0)
+    key = sys.argv[4]
+
+    leaves = [leaf_hash(image[i:i + frame_size]) for i in range(0, len(image), frame_size)]
+    signed = struct.pack('<4I', MANIFEST_MAGIC, len(image), frame_size, len(leaves)) + merkle_root(leaves)
+    sig = subprocess.run(['openssl', 'dgst', '-sha256', '-sign', key], input=signed,
+                         stdout=subprocess.PIPE, check=True).stdout
+    if len(sig) > SIG_MAX:
+        sys.exit('signature too long')
+
+    with open(sys.argv[3], 'wb') as f:
+        f.write(signed + struct.pack('<I', len(sig)) + sig.ljust(SIG_MAX, b'\x00') + struct.pack('<I', 0))
+        f.write(b''.join(leaves))
+
+
+if __name__ == '__main__':
+    main()
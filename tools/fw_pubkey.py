@@ -0,0 +1,33 @@
+#!/usr/bin/env python3
+# 从P-256密钥（私钥或公钥PEM）生成固件中的验签公钥头文件，由构建调用，见CMakeLists.txt中的MANIFEST_PUBLIC_KEY
+# 用法: fw_pubkey.py key.pem manifest_key.h
+import subprocess
+import sys
+
+# P-256公钥的SubjectPublicKeyInfo：26字节算法标识 + 未压缩点 0x04 || X || Y
+SPKI_P256_PREFIX = bytes.fromhex('3059301306072a8648ce3d020106082a8648ce3d030107034200')
+
+
+def public_point(path):
+    pem = open(path, 'rb').read()
+    args = ['openssl', 'pkey', '-in', path, '-pubout', '-outform', 'DER']
+    if b'PUBLIC KEY' in pem:
+        args.insert(2, '-pubin')
+    der = subprocess.run(args, stdout=subprocess.PIPE, check=True).stdout
+    if not der.startswith(SPKI_P256_PREFIX) or len(der) != len(SPKI_P256_PREFIX) + 65:
+        sys.exit('%s is not a P-256 key' % path)
+    return der[len(SPKI_P256_PREFIX):]
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: fw_pubkey.py key.pem manifest_key.h')
+    point = public_point(sys.argv[1])
+    rows = ['\t' + ' '.join('0x%02X,' % b for b in point[i:i + 13]) for i in range(0, len(point), 13)]
+    with open(sys.argv[2], 'w') as f:
+        f.write('// 由tools/fw_pubkey.py从%s生成，不要修改\n' % sys.argv[1].replace('\\', '/'))
+        f.write('#define MANIFEST_PUBLIC_KEY { \\\n%s \\\n}\n' % ' \\\n'.join(rows))
+
+
+if __name__ == '__main__':
+    main()
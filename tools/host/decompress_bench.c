@@ -0,0 +1,240 @@
+/*
+ * 解压吞吐量基准和往返测试，在主机上运行
+ * 用参考压缩器压缩测试镜像，再用Bsp/src/decompress.c按随机长度的分帧解压，
+ * 检查输出与原始数据一致，并报告解压速率（按解压后的字节数计）。
+ * 用法: decompress_bench [image.bin]   不给文件时使用生成的类固件数据
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "decompress.h"
+#include "lzss_encode.h"
+
+#define BENCH_IMAGE_SIZE	(380u * 1024u)		// 与firmware区域可用大小相同
+#define BENCH_MIN_SECONDS	0.2
+#define BENCH_FRAME_MAX		1024u				// 分帧测试中每帧压缩数据的最大长度
+
+struct bench_sink_t {
+	uint8_t *out;
+	uint32_t capacity;
+	uint32_t expect;		// 下一块输出应有的偏移
+	uint8_t check;			// 是否检查并保存输出
+};
+
+static uint8_t window[DECOMPRESS_WINDOW_SIZE];
+
+// 按heatshrink码流格式手工编码的"abcabcabc"，window_bits=8，lookahead_bits=4
+static const uint8_t golden_stream[] = {0xB0, 0xD8, 0xAC, 0x60, 0x25};
+static const char golden_text[] = "abcabcabc";
+
+static uint32_t rand_state = 0x12345678u;
+
+static uint32_t rand_next(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * 生成类似固件的数据：代码段由少量常见指令字和随机立即数组成，
+ * 其后是稀疏的常量表和0填充，末尾一小段不可压缩的数据
+ */
+static void image_generate(uint8_t *image, uint32_t size)
+{
+	static const uint16_t opcodes[] = {
+		0xB580, 0xAF00, 0x6878, 0x4618, 0xBD80, 0x2300, 0x4B00, 0x681B,
+		0xF000, 0xF800, 0x3301, 0x2B00, 0xD1F0, 0x4770, 0x6013, 0xE7FE,
+	};
+	uint32_t code = size * 6 / 10;
+	uint32_t table = size * 9 / 10;
+	uint32_t i;
+	uint16_t op;
+
+	for (i = 0; i + 1 < code; i += 2) {
+		op = (rand_next() & 3) ? opcodes[rand_next() & 15] : (uint16_t)rand_next();
+		image[i] = (uint8_t)op;
+		image[i + 1] = (uint8_t)(op >> 8);
+	}
+	for (; i < table; i++) {
+		image[i] = (i & 63) < 8 ? (uint8_t)(i >> 6) : 0;
+	}
+	for (; i < size; i++) {
+		image[i] = (uint8_t)rand_next();
+	}
+}
+
+static uint8_t sink_output(struct decompress_t *decomp, uint32_t offset, uint8_t *data, uint32_t len)
+{
+	struct bench_sink_t *sink = decomp->arg;
+
+	if (!sink->check) {
+		return DECOMPRESS_SUCCESS;
+	}
+	// 除最后一块外每块都是DECOMPRESS_CHUNK_SIZE，偏移连续
+	if (offset != sink->expect || offset + len > sink->capacity || len > DECOMPRESS_CHUNK_SIZE) {
+		return DECOMPRESS_FAIL;
+	}
+	memcpy(&sink->out[offset], data, len);
+	sink->expect = offset + len;
+
+	return DECOMPRESS_SUCCESS;
+}
+
+// 解压一个码流，frame为0时整段输入，否则按不超过frame的随机长度分帧输入
+static uint8_t stream_decode(const uint8_t *stream, size_t stream_len, uint8_t window_bits, uint8_t lookahead_bits,
+		uint32_t frame, struct bench_sink_t *sink)
+{
+	struct decompress_t decomp;
+	size_t pos = 0;
+	size_t n;
+
+	sink->expect = 0;
+	if (decompress_init(&decomp, window, window_bits, lookahead_bits, sink->capacity, sink_output, sink) != DECOMPRESS_SUCCESS) {
+		return DECOMPRESS_FAIL;
+	}
+	while (pos < stream_len) {
+		n = frame ? 1 + rand_next() % frame : stream_len;
+		if (n > stream_len - pos) {
+			n = stream_len - pos;
+		}
+		if (decomp.input(&decomp, (uint8_t *)&stream[pos], (uint32_t)n) != DECOMPRESS_SUCCESS) {
+			return DECOMPRESS_FAIL;
+		}
+		pos += n;
+	}
+
+	return decomp.finish(&decomp);
+}
+
+static int golden_test(void)
+{
+	uint8_t out[sizeof(golden_text)];
+	uint8_t stream[16];
+	struct bench_sink_t sink = {out, sizeof(golden_text) - 1, 0, 1};
+	size_t len;
+
+	len = lzss_encode((const uint8_t *)golden_text, sizeof(golden_text) - 1, 8, 4, stream, sizeof(stream));
+	if (len != sizeof(golden_stream) || memcmp(stream, golden_stream, len) != 0) {
+		printf("FAIL: reference encoder does not match the golden stream\n");
+		return 1;
+	}
+	if (stream_decode(golden_stream, sizeof(golden_stream), 8, 4, 0, &sink) != DECOMPRESS_SUCCESS ||
+		sink.expect != sizeof(golden_text) - 1 || memcmp(out, golden_text, sink.expect) != 0) {
+		printf("FAIL: golden stream does not decode\n");
+		return 1;
+	}
+	// 输出超过上限必须报错
+	sink.capacity = sizeof(golden_text) - 2;
+	if (stream_decode(golden_stream, sizeof(golden_stream), 8, 4, 0, &sink) == DECOMPRESS_SUCCESS) {
+		printf("FAIL: output limit not enforced\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int bench_one(const uint8_t *image, uint32_t size, uint8_t window_bits, uint8_t lookahead_bits)
+{
+	size_t capacity = size + size / 8 + 16;
+	uint8_t *stream = malloc(capacity);
+	uint8_t *out = malloc(size);
+	struct bench_sink_t sink = {out, size, 0, 1};
+	size_t stream_len;
+	uint32_t rounds = 0;
+	double start;
+	double elapsed;
+	int fail = 0;
+
+	if (stream == NULL || out == NULL) {
+		free(stream);
+		free(out);
+		return 1;
+	}
+
+	stream_len = lzss_encode(image, size, window_bits, lookahead_bits, stream, capacity);
+	if (stream_len == 0) {
+		printf("FAIL: w%u l%u encoder overflow\n", window_bits, lookahead_bits);
+		fail = 1;
+		goto out;
+	}
+
+	// 往返：随机分帧，模拟码流在任意字节处被帧截断
+	memset(out, 0xA5, size);
+	if (stream_decode(stream, stream_len, window_bits, lookahead_bits, BENCH_FRAME_MAX, &sink) != DECOMPRESS_SUCCESS ||
+		sink.expect != size || memcmp(out, image, size) != 0) {
+		printf("FAIL: w%u l%u round trip mismatch\n", window_bits, lookahead_bits);
+		fail = 1;
+		goto out;
+	}
+
+	// 吞吐量：整段输入，输出回调只计数，测的是解码本身
+	sink.check = 0;
+	start = now();
+	do {
+		stream_decode(stream, stream_len, window_bits, lookahead_bits, 0, &sink);
+		rounds++;
+		elapsed = now() - start;
+	} while (elapsed < BENCH_MIN_SECONDS);
+
+	printf("w%-2u l%-2u  %7u -> %7zu bytes (%5.1f%%)  %8.1f MB/s out  %8.1f MB/s in\n",
+		   window_bits, lookahead_bits, size, stream_len, 100.0 * stream_len / size,
+		   (double)size * rounds / elapsed / 1e6, (double)stream_len * rounds / elapsed / 1e6);
+
+out:
+	free(stream);
+	free(out);
+	return fail;
+}
+
+int main(int argc, char *argv[])
+{
+	static const uint8_t params[][2] = {{8, 4}, {10, 4}, {11, 4}, {12, 5}, {13, 6}, {15, 8}};
+	uint8_t *image;
+	uint32_t size = BENCH_IMAGE_SIZE;
+	FILE *f;
+	long len;
+	uint32_t i;
+	int fail;
+
+	fail = golden_test();
+
+	if (argc > 1) {
+		f = fopen(argv[1], "rb");
+		if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) <= 0) {
+			printf("cannot read %s\n", argv[1]);
+			return 1;
+		}
+		size = (uint32_t)len;
+		image = malloc(size);
+		rewind(f);
+		if (image == NULL || fread(image, 1, size, f) != size) {
+			printf("cannot read %s\n", argv[1]);
+			return 1;
+		}
+		fclose(f);
+	} else {
+		image = malloc(size);
+		if (image == NULL) {
+			return 1;
+		}
+		image_generate(image, size);
+	}
+
+	for (i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+		fail |= bench_one(image, size, params[i][0], params[i][1]);
+	}
+	free(image);
+
+	printf(fail ? "FAILED\n" : "PASSED\n");
+	return fail;
+}
@@ -0,0 +1,299 @@
+/*
+ * 增量补丁的往返测试，在主机上运行
+ * 随机生成参考镜像和一串bsdiff记录（控制字、差分数据、新增数据），同时按记录算出新镜像，
+ * 再把补丁切成帧交给Bsp/src/delta_patch.c还原，检查输出与新镜像一致。
+ * 记录包括长度为0的差分或新增段、负的seek和移到参考镜像之外的参考位置。
+ * 分帧方式：随机长度、逐字节、恰好切在控制字/差分/新增各段的边界上、切在边界前后几个字节。
+ * 截断的补丁、超出还原长度和长度为负的控制字必须被拒绝。
+ * 用法: delta_patch_test [trials]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "delta_patch.h"
+
+#define TEST_TRIALS			40u
+#define TEST_REF_MAX		(64u * 1024u)
+#define TEST_OUT_MAX		(96u * 1024u)
+#define TEST_PATCH_MAX		(256u * 1024u)
+#define TEST_BOUNDARY_MAX	8192u
+#define TEST_FRAME_MAX		2048u
+
+enum split_mode {
+	SPLIT_RANDOM = 0,		// 随机长度
+	SPLIT_BYTE,				// 每帧1字节
+	SPLIT_BOUNDARY,			// 恰好在各段边界
+	SPLIT_NEAR,				// 边界前后几个字节
+	SPLIT_MODES,
+};
+
+struct test_sink_t {
+	uint8_t out[TEST_OUT_MAX];
+	uint32_t len;			// 已输出的字节数
+	uint32_t errors;
+};
+
+static uint8_t ref[TEST_REF_MAX];
+static uint8_t expect[TEST_OUT_MAX];
+static uint8_t patch[TEST_PATCH_MAX];
+static uint32_t boundary[TEST_BOUNDARY_MAX];	// 补丁中各段的起始位置
+static uint8_t chunk[DELTA_PATCH_CHUNK_SIZE];
+static struct test_sink_t sink;
+
+static uint32_t rand_state = 0x6A09E667u;
+
+static uint32_t rand_next(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+// bsdiff的offtout：8字节小端，最高位为符号位
+static void offtout(int64_t x, uint8_t *buf)
+{
+	uint64_t y = x < 0 ? (uint64_t)-x : (uint64_t)x;
+	uint32_t i;
+
+	for (i = 0; i < 8; i++) {
+		buf[i] = y >> (8 * i);
+	}
+	if (x < 0) {
+		buf[7] |= 0x80;
+	}
+}
+
+// 输出必须按顺序，除最后一块外每块都是整个输出缓冲区
+static uint8_t sink_output(struct delta_patch_t *this, uint32_t offset, uint8_t *data, uint32_t len)
+{
+	struct test_sink_t *s = this->arg;
+
+	if (offset != s->len || offset + len > TEST_OUT_MAX ||
+		(len != DELTA_PATCH_CHUNK_SIZE && offset + len != this->out_limit)) {
+		s->errors++;
+		return DELTA_PATCH_FAIL;
+	}
+	memcpy(&s->out[offset], data, len);
+	s->len += len;
+
+	return DELTA_PATCH_SUCCESS;
+}
+
+/*
+ * 生成参考镜像和补丁，返回补丁长度，out_len为新镜像长度，bounds为段边界数。
+ * 差分数据大多为0（与参考相同），少数字节改动，接近真实固件的补丁
+ */
+static uint32_t make_patch(uint32_t *ref_len, uint32_t *out_len, uint32_t *bounds)
+{
+	uint32_t patch_len = 0;
+	uint32_t out = 0;
+	uint32_t n = 0;
+	uint32_t limit;
+	uint32_t diff_len;
+	uint32_t extra_len;
+	int64_t ref_pos = 0;
+	int64_t seek;
+	uint8_t old;
+	uint8_t d;
+	uint32_t i;
+
+	*ref_len = 1024u + rand_next() % (TEST_REF_MAX - 1024u);
+	for (i = 0; i < *ref_len; i++) {
+		ref[i] = rand_next();
+	}
+	limit = 1024u + rand_next() % (TEST_OUT_MAX - 1024u);
+
+	while (out < limit && n + 3 <= TEST_BOUNDARY_MAX) {
+		switch (rand_next() % 8u) {
+		case 0:
+			diff_len = 0;
+			break;
+		case 1:
+			diff_len = 1u + rand_next() % 16u;
+			break;
+		default:
+			diff_len = rand_next() % 6000u;
+			break;
+		}
+		extra_len = rand_next() % 4u == 0 ? rand_next() % 600u : 0;
+		if (out + diff_len + extra_len > limit) {
+			diff_len = limit - out;
+			extra_len = 0;
+		}
+		// 多数向前跳一小段，也有向后跳和跳到参考镜像之外
+		switch (rand_next() % 8u) {
+		case 0:
+			seek = -(int64_t)(rand_next() % 20000u);
+			break;
+		case 1:
+			seek = (int64_t)*ref_len + 100;
+			break;
+		case 2:
+			seek = -ref_pos;
+			break;
+		default:
+			seek = rand_next() % 64u;
+			break;
+		}
+		if (patch_len + 24 + diff_len + extra_len > TEST_PATCH_MAX) {
+			break;
+		}
+
+		boundary[n++] = patch_len;
+		offtout(diff_len, &patch[patch_len]);
+		offtout(extra_len, &patch[patch_len + 8]);
+		offtout(seek, &patch[patch_len + 16]);
+		patch_len += 24;
+
+		boundary[n++] = patch_len;
+		for (i = 0; i < diff_len; i++) {
+			d = rand_next() % 16u == 0 ? rand_next() : 0;
+			old = ref_pos >= 0 && ref_pos < *ref_len ? ref[ref_pos] : 0;
+			patch[patch_len++] = d;
+			expect[out++] = old + d;
+			ref_pos++;
+		}
+
+		boundary[n++] = patch_len;
+		for (i = 0; i < extra_len; i++) {
+			patch[patch_len] = rand_next();
+			expect[out++] = patch[patch_len++];
+		}
+		ref_pos += seek;
+	}
+
+	*out_len = out;
+	*bounds = n;
+	return patch_len;
+}
+
+// 下一帧的结束位置
+static uint32_t next_cut(uint8_t mode, uint32_t pos, uint32_t patch_len, uint32_t bounds, uint32_t *b)
+{
+	uint32_t cut;
+
+	switch (mode) {
+	case SPLIT_BYTE:
+		return pos + 1;
+	case SPLIT_BOUNDARY:
+	case SPLIT_NEAR:
+		while (*b < bounds && boundary[*b] <= pos) {
+			(*b)++;
+		}
+		if (*b == bounds) {
+			return patch_len;
+		}
+		cut = boundary[*b];
+		if (mode == SPLIT_NEAR) {
+			cut += rand_next() % 5u;
+			cut = cut > 2 ? cut - 2 : cut;
+		}
+		return cut > pos ? (cut < patch_len ? cut : patch_len) : pos + 1;
+	default:
+		cut = pos + 1u + rand_next() % TEST_FRAME_MAX;
+		return cut < patch_len ? cut : patch_len;
+	}
+}
+
+// 按mode分帧还原一次，返回失败数
+static uint32_t patch_trial(uint32_t trial, uint8_t mode, uint32_t ref_len, uint32_t out_len,
+							uint32_t patch_len, uint32_t bounds)
+{
+	struct delta_patch_t p;
+	uint32_t pos = 0;
+	uint32_t cut;
+	uint32_t b = 0;
+
+	sink.len = 0;
+	sink.errors = 0;
+	if (delta_patch_init(&p, ref, ref_len, chunk, out_len, sink_output, &sink) != DELTA_PATCH_SUCCESS) {
+		printf("FAIL: delta_patch_init\n");
+		return 1;
+	}
+	while (pos < patch_len) {
+		cut = next_cut(mode, pos, patch_len, bounds, &b);
+		if (p.input(&p, &patch[pos], cut - pos) != DELTA_PATCH_SUCCESS) {
+			printf("FAIL: trial %u split %u: input rejected at %u\n", trial, mode, pos);
+			return 1;
+		}
+		pos = cut;
+	}
+	if (p.finish(&p) != DELTA_PATCH_SUCCESS || sink.errors != 0) {
+		printf("FAIL: trial %u split %u: finish failed\n", trial, mode);
+		return 1;
+	}
+	if (sink.len != out_len || memcmp(sink.out, expect, out_len) != 0) {
+		printf("FAIL: trial %u split %u: %u of %u bytes, output differs\n", trial, mode, sink.len, out_len);
+		return 1;
+	}
+	return 0;
+}
+
+// 错误的补丁必须被拒绝
+static uint32_t reject_test(void)
+{
+	struct delta_patch_t p;
+	uint8_t bad[24];
+	uint32_t fail = 0;
+
+	// 补丁在记录中间结束
+	delta_patch_init(&p, ref, 1024, chunk, 100, sink_output, &sink);
+	offtout(100, &bad[0]);
+	offtout(0, &bad[8]);
+	offtout(0, &bad[16]);
+	sink.len = 0;
+	if (p.input(&p, bad, sizeof(bad)) != DELTA_PATCH_SUCCESS ||
+		p.input(&p, patch, 50) != DELTA_PATCH_SUCCESS || p.finish(&p) == DELTA_PATCH_SUCCESS) {
+		printf("FAIL: truncated patch accepted\n");
+		fail++;
+	}
+	// 控制字在帧中间结束
+	delta_patch_init(&p, ref, 1024, chunk, 100, sink_output, &sink);
+	if (p.input(&p, bad, 10) != DELTA_PATCH_SUCCESS || p.finish(&p) == DELTA_PATCH_SUCCESS) {
+		printf("FAIL: partial control word accepted\n");
+		fail++;
+	}
+	// 超出还原长度
+	delta_patch_init(&p, ref, 1024, chunk, 99, sink_output, &sink);
+	if (p.input(&p, bad, sizeof(bad)) == DELTA_PATCH_SUCCESS) {
+		printf("FAIL: record beyond the output limit accepted\n");
+		fail++;
+	}
+	// 长度为负
+	delta_patch_init(&p, ref, 1024, chunk, 100, sink_output, &sink);
+	offtout(0, &bad[0]);
+	offtout(-1, &bad[8]);
+	if (p.input(&p, bad, sizeof(bad)) == DELTA_PATCH_SUCCESS) {
+		printf("FAIL: negative length accepted\n");
+		fail++;
+	}
+	return fail;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t trials = TEST_TRIALS;
+	uint32_t fail = 0;
+	uint32_t ref_len;
+	uint32_t out_len;
+	uint32_t patch_len;
+	uint32_t bounds;
+	uint32_t t;
+	uint8_t mode;
+
+	if (argc > 1) {
+		trials = strtoul(argv[1], NULL, 0);
+	}
+
+	for (t = 0; t < trials; t++) {
+		patch_len = make_patch(&ref_len, &out_len, &bounds);
+		for (mode = 0; mode < SPLIT_MODES; mode++) {
+			fail += patch_trial(t, mode, ref_len, out_len, patch_len, bounds);
+		}
+	}
+	fail += reject_test();
+
+	printf("%u patches, %u split modes\n", trials, SPLIT_MODES);
+	printf(fail ? "FAILED\n" : "PASSED\n");
+	return fail != 0;
+}
@@ -0,0 +1,202 @@
+/*
+ * 纠删码的往返测试，在主机上运行
+ * 按fec.h中的Cauchy矩阵独立编码（逐位计算的GF(256)乘法，不用Bsp/src/fec.c的表），
+ * 随机擦除最多8个数据分片，用任选行号的校验分片交给Bsp/src/fec.c解码，检查恢复的数据。
+ * k从1到32都测试，其中一部分按镜像的最后一块处理：块中只有n < k个数据分片，
+ * 最后一个分片不满，与thread_mcast.c一样，不存在的分片和补齐部分按0参与编码和解码。
+ * 校验分片不足时解码必须失败。
+ * 用法: fec_test [trials]   trials为每个k的测试次数
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "fec.h"
+
+#define TEST_TRIALS			200u
+#define TEST_SHARD_MAX		256u
+
+static uint8_t source[FEC_MAX_DATA_SHARDS][TEST_SHARD_MAX];
+static uint8_t shards[FEC_MAX_DATA_SHARDS][TEST_SHARD_MAX];
+static uint8_t parity[FEC_MAX_PARITY][TEST_SHARD_MAX];
+
+static uint32_t rand_state = 0x9E3779B9u;
+
+static uint32_t rand_next(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+// 逐位相乘，按本原多项式0x11D取模
+static uint8_t ref_mul(uint8_t a, uint8_t b)
+{
+	uint32_t x = a;
+	uint8_t r = 0;
+
+	while (b != 0) {
+		if (b & 1u) {
+			r ^= x;
+		}
+		x <<= 1;
+		if (x & 0x100u) {
+			x ^= 0x11Du;
+		}
+		b >>= 1;
+	}
+	return r;
+}
+
+static uint8_t ref_inv(uint8_t a)
+{
+	uint32_t b;
+
+	for (b = 1; b < 256; b++) {
+		if (ref_mul(a, b) == 1) {
+			return b;
+		}
+	}
+	return 0;
+}
+
+// 生成行号为row的校验分片：sum_j data[j] / ((k + row) ^ j)
+static void ref_encode(uint8_t *out, uint32_t k, uint32_t row, uint32_t size)
+{
+	uint8_t c;
+	uint32_t i;
+	uint32_t j;
+
+	memset(out, 0, size);
+	for (j = 0; j < k; j++) {
+		c = ref_inv((k + row) ^ j);
+		for (i = 0; i < size; i++) {
+			out[i] ^= ref_mul(c, source[j][i]);
+		}
+	}
+}
+
+/*
+ * 一次往返：块中有n个数据分片，最后一个只有last字节有效，擦除e个，
+ * 用parity_count个随机行号的校验分片解码，expect为期望的结果
+ */
+static uint32_t fec_trial(uint32_t k, uint32_t n, uint32_t last, uint32_t size,
+						  uint32_t e, uint32_t parity_count, uint8_t expect)
+{
+	struct fec_t fec;
+	uint8_t *data[FEC_MAX_DATA_SHARDS];
+	uint8_t *rx_parity[FEC_MAX_PARITY];
+	uint8_t rows[FEC_MAX_PARITY];
+	uint32_t present = 0;
+	uint32_t erased = 0;
+	uint32_t i;
+	uint32_t j;
+	uint8_t status;
+
+	for (j = 0; j < k; j++) {
+		for (i = 0; i < size; i++) {
+			source[j][i] = j < n && (j + 1 < n || i < last) ? rand_next() : 0;
+		}
+	}
+
+	// 行号互不相同，k + row不超过255
+	for (i = 0; i < parity_count; i++) {
+		do {
+			rows[i] = rand_next() % (255u - k);
+			for (j = 0; j < i && rows[j] != rows[i]; j++) {
+			}
+		} while (j < i);
+		ref_encode(parity[i], k, rows[i], size);
+		rx_parity[i] = parity[i];
+	}
+
+	// 不存在的分片按已收到的全0分片处理
+	while (__builtin_popcount(erased) < e) {
+		erased |= 1u << (rand_next() % n);
+	}
+	for (j = 0; j < k; j++) {
+		data[j] = shards[j];
+		if (erased & (1u << j)) {
+			memset(shards[j], 0xA5, size);
+		} else {
+			memcpy(shards[j], source[j], size);
+			present |= 1u << j;
+		}
+	}
+
+	if (fec_init(&fec, k, size) != FEC_SUCCESS) {
+		printf("FAIL: fec_init(%u, %u)\n", k, size);
+		return 1;
+	}
+	status = fec.decode(&fec, data, present, rx_parity, rows, parity_count);
+	if (status != expect) {
+		printf("FAIL: k %u n %u size %u: %u erased, %u parity: decode returned %u\n",
+			   k, n, size, e, parity_count, status);
+		return 1;
+	}
+	if (status != FEC_SUCCESS) {
+		return 0;
+	}
+	for (j = 0; j < k; j++) {
+		if (memcmp(shards[j], source[j], size) != 0) {
+			printf("FAIL: k %u n %u size %u: shard %u wrong after recovering %u with %u parity\n",
+				   k, n, size, j, e, parity_count);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fec_t fec;
+	uint32_t trials = TEST_TRIALS;
+	uint32_t fail = 0;
+	uint32_t count = 0;
+	uint32_t size;
+	uint32_t last;
+	uint32_t max;
+	uint32_t k;
+	uint32_t n;
+	uint32_t e;
+	uint32_t p;
+	uint32_t t;
+
+	if (argc > 1) {
+		trials = strtoul(argv[1], NULL, 0);
+	}
+
+	if (fec_init(&fec, 0, 64) == FEC_SUCCESS || fec_init(&fec, FEC_MAX_DATA_SHARDS + 1, 64) == FEC_SUCCESS ||
+		fec_init(&fec, 4, 0) == FEC_SUCCESS) {
+		printf("FAIL: fec_init accepted an invalid configuration\n");
+		fail++;
+	}
+
+	for (k = 1; k <= FEC_MAX_DATA_SHARDS; k++) {
+		for (t = 0; t < trials; t++) {
+			size = 32u * (1u + rand_next() % (TEST_SHARD_MAX / 32u));
+			// 四分之一按镜像的最后一块测试
+			if (t % 4u == 0) {
+				n = 1u + rand_next() % k;
+				last = 1u + rand_next() % size;
+			} else {
+				n = k;
+				last = size;
+			}
+			max = n < FEC_MAX_PARITY ? n : FEC_MAX_PARITY;
+			e = rand_next() % (max + 1u);
+			// 校验分片可以多于缺失的数量
+			p = e + rand_next() % (FEC_MAX_PARITY - e + 1u);
+			fail += fec_trial(k, n, last, size, e, p, FEC_SUCCESS);
+			count++;
+			// 少一个校验分片时不能恢复
+			if (e > 0) {
+				fail += fec_trial(k, n, last, size, e, e - 1u, FEC_FAIL);
+				count++;
+			}
+		}
+	}
+
+	printf("%u decodes, k 1..%u, up to %u erasures\n", count, FEC_MAX_DATA_SHARDS, FEC_MAX_PARITY);
+	printf(fail ? "FAILED\n" : "PASSED\n");
+	return fail != 0;
+}
@@ -0,0 +1,413 @@
+/*
+ * 写入app区域的掉电测试，在主机上运行
+ * 在0x08000000映射一块内存作为内部flash，Bsp/src/firmware_opt.c直接在上面擦写。
+ * 擦除一个扇区、编程一个flash字各算一步，依次在第1、2、……步切断电源：
+ * 被切断的那一步只完成一部分（flash字中的各个32位字可能未写、已写或只写入部分位，
+ * 擦除的扇区只有部分字被擦空），之后不再执行任何擦写，然后模拟重新上电。
+ * 被切断的flash字和扇区ECC校验不过，Internal_Flash_Check对它们报告错误，直到重新擦除。
+ * 每次上电与写flash线程启动时一样调用firmware_opt_init和recover，
+ * 第一次恢复过程中再随机切断一次电源，之后的上电不再切断。
+ * 每种情况最后app区域必须是完整的旧镜像或完整的新镜像，
+ * 并且恢复完成后再上电时recover不再擦写flash。
+ * 用法: flash_fault_test [step]   给出step时只测试在这一步切断，用于调试
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include "firmware_opt.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE		0x100000
+#endif
+
+#define EMU_BASE			FLASH_SECTOR0_BASE
+#define EMU_SIZE			(INTERNAL_FLASH_SECTOR_MAX * FLASH_SECTOR_SIZE)
+#define EMU_WORD			(FLASH_NB_32BITWORD_IN_FLASHWORD * 4u)
+
+// 新镜像跨三个扇区，第二个扇区与旧镜像相同，复制时比较后跳过
+#define TEST_IMAGE_SIZE		(2u * FLASH_SECTOR_SIZE + 40000u)
+
+enum power_result {
+	POWER_DONE = 0,		// 运行完成，没有切断
+	POWER_CUT,			// 在指定的步切断
+};
+
+static uint8_t *flash = (uint8_t *)EMU_BASE;
+static uint8_t *initial;		// 开始复制前的flash：firmware区域为新镜像，app区域为旧镜像
+static uint8_t *image_old;		// app区域原来的内容
+static uint8_t *image_new;		// 复制完成后app区域应有的内容，镜像之外为擦除状态
+
+static jmp_buf power_off;
+static uint32_t step_count;		// 本次上电以来的擦写步数
+static uint32_t step_cut;		// 在第几步切断，0表示不切断
+static uint32_t cut_addr;		// 被切断的那一步所在的地址
+static uint32_t emu_error;		// 测试代码之外的错误，如擦写了bootloader区域
+static uint8_t emu_torn[EMU_SIZE / EMU_WORD];	// 写了一半的flash字，ECC校验不过
+static uint32_t ecc_reported;	// Internal_Flash_Check报告ECC错误的次数
+
+static uint32_t rand_state = 0x2545F491u;
+
+static uint32_t rand_next(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+// 每步擦写之前调用，到达切断的那一步时返回1
+static uint8_t emu_step(uint32_t addr)
+{
+	step_count++;
+	if (step_count != step_cut) {
+		return 0;
+	}
+	cut_addr = addr;
+	return 1;
+}
+
+// 切断时flash字中的每个32位字可能未写、已写或只写入部分位，编程只能把1变成0
+static void emu_tear_program(uint32_t *dst, const uint32_t *src)
+{
+	uint32_t i;
+
+	emu_torn[((uint8_t *)dst - flash) / EMU_WORD] = 1;
+	for (i = 0; i < FLASH_NB_32BITWORD_IN_FLASHWORD; i++) {
+		switch (rand_next() % 3) {
+		case 0:
+			break;
+		case 1:
+			dst[i] &= src[i];
+			break;
+		default:
+			dst[i] &= src[i] | rand_next();
+			break;
+		}
+	}
+}
+
+static void emu_tear_erase(uint32_t *dst)
+{
+	uint32_t i;
+
+	memset(&emu_torn[((uint8_t *)dst - flash) / EMU_WORD], 1, FLASH_SECTOR_SIZE / EMU_WORD);
+	for (i = 0; i < FLASH_SECTOR_SIZE / 4u; i++) {
+		if (rand_next() & 1) {
+			dst[i] = 0xFFFFFFFFu;
+		}
+	}
+}
+
+uint32_t flash_engine_erase(uint32_t StartSector, uint32_t SectorCount)
+{
+	uint32_t sector;
+	uint32_t *p;
+
+	for (sector = StartSector; sector < StartSector + SectorCount; sector++) {
+		if (sector < BOOTLOADER_FIRMWARE_SECTOR_START || sector >= INTERNAL_FLASH_SECTOR_MAX) {
+			emu_error++;
+			return INTERNAL_FLASH_INVALID_ADDR;
+		}
+		p = (uint32_t *)(flash + sector * FLASH_SECTOR_SIZE);
+		if (emu_step(EMU_BASE + sector * FLASH_SECTOR_SIZE)) {
+			emu_tear_erase(p);
+			longjmp(power_off, 1);
+		}
+		memset(p, 0xFF, FLASH_SECTOR_SIZE);
+		memset(&emu_torn[sector * FLASH_SECTOR_SIZE / EMU_WORD], 0, FLASH_SECTOR_SIZE / EMU_WORD);
+	}
+
+	return INTERNAL_FLASH_OK;
+}
+
+// 与Internal_Flash_Write相同：按flash字编程，尾部填充0xFF；已编程过的flash字不能再编程
+uint32_t flash_engine_write(uint32_t Address, uint8_t *Data, uint32_t Length)
+{
+	uint32_t word[FLASH_NB_32BITWORD_IN_FLASHWORD];
+	uint32_t *dst;
+	uint32_t count;
+	uint32_t index;
+	uint32_t i;
+
+	if ((Address & 0x3) != 0) {
+		return INTERNAL_FLASH_ALIGN_ERROR;
+	}
+	if (Address < BOOTLOADER_FIRMWARE_BASE || Address + Length > APP_END + 1) {
+		emu_error++;
+		return INTERNAL_FLASH_INVALID_ADDR;
+	}
+	for (index = 0; index < Length; index += EMU_WORD) {
+		count = Length - index < EMU_WORD ? Length - index : EMU_WORD;
+		memset(word, 0xFF, sizeof(word));
+		memcpy(word, &Data[index], count);
+		dst = (uint32_t *)(flash + (Address - EMU_BASE) + index);
+		for (i = 0; i < FLASH_NB_32BITWORD_IN_FLASHWORD; i++) {
+			if (dst[i] != 0xFFFFFFFFu) {
+				return INTERNAL_FLASH_ERROR;
+			}
+		}
+		if (emu_step(Address + index)) {
+			emu_tear_program(dst, word);
+			longjmp(power_off, 1);
+		}
+		memcpy(dst, word, sizeof(word));
+	}
+
+	return INTERNAL_FLASH_OK;
+}
+
+// 没有中断驱动的引擎，擦除在提交时同步完成
+uint32_t flash_engine_erase_async(uint32_t StartSector, uint32_t SectorCount, ULONG flag)
+{
+	(void)flag;
+	return flash_engine_erase(StartSector, SectorCount);
+}
+
+uint32_t flash_engine_wait(ULONG flag)
+{
+	(void)flag;
+	return INTERNAL_FLASH_OK;
+}
+
+// 范围内有写了一半的flash字时报告ECC错误，与硬件上屏蔽总线错误读取的结果相同
+uint32_t Internal_Flash_Check(uint32_t Address, uint32_t Length)
+{
+	uint32_t i;
+
+	if (Address < EMU_BASE || Address + Length > EMU_BASE + EMU_SIZE) {
+		emu_error++;
+		return INTERNAL_FLASH_INVALID_ADDR;
+	}
+	for (i = (Address - EMU_BASE) / EMU_WORD; i * EMU_WORD < Address + Length - EMU_BASE; i++) {
+		if (emu_torn[i]) {
+			ecc_reported++;
+			return INTERNAL_FLASH_ERROR;
+		}
+	}
+
+	return INTERNAL_FLASH_OK;
+}
+
+// 按偏移写入的传输不在本测试范围内
+uint32_t Internal_Flash_StreamInit(Internal_Flash_StreamTypeDef *Stream, uint32_t Address,
+								   uint32_t (*Program)(uint32_t Address, uint8_t *Data, uint32_t Length))
+{
+	(void)Stream;
+	(void)Address;
+	(void)Program;
+	return INTERNAL_FLASH_ERROR;
+}
+
+uint32_t Internal_Flash_StreamWrite(Internal_Flash_StreamTypeDef *Stream, uint8_t *Data, uint32_t Length)
+{
+	(void)Stream;
+	(void)Data;
+	(void)Length;
+	return INTERNAL_FLASH_ERROR;
+}
+
+uint32_t Internal_Flash_StreamFlush(Internal_Flash_StreamTypeDef *Stream)
+{
+	(void)Stream;
+	return INTERNAL_FLASH_ERROR;
+}
+
+// 测试使用复制布局，没有清单，A/B槽和清单校验都不会调用到
+uint32_t firmware_slot_active(struct firmware_slot_t *rec)
+{
+	(void)rec;
+	return FIRMWARE_SLOT_NONE;
+}
+
+uint8_t firmware_slot_vector_check(uint32_t base, uint32_t size)
+{
+	(void)base;
+	(void)size;
+	return FIRMWARE_SLOT_FAIL;
+}
+
+uint32_t firmware_slot_crc(const struct firmware_slot_t *rec)
+{
+	(void)rec;
+	return 0;
+}
+
+uint8_t manifest_verify(const struct firmware_manifest_t *m, const uint8_t *leaf)
+{
+	(void)m;
+	(void)leaf;
+	return MANIFEST_FAIL;
+}
+
+void manifest_leaf_hash(const uint8_t *data, uint32_t len, uint8_t *hash)
+{
+	(void)data;
+	(void)len;
+	memset(hash, 0, FIRMWARE_HASH_SIZE);
+}
+
+static uint8_t run_copy(struct firmware_opt_t *opt)
+{
+	// 镜像已在firmware区域中，与批量命令写入后执行WRITE相同
+	opt->firm_current_addr = opt->firm_start_addr + TEST_IMAGE_SIZE;
+	return opt->write(opt);
+}
+
+static uint8_t run_recover(struct firmware_opt_t *opt)
+{
+	return opt->recover(opt);
+}
+
+/*
+ * 上电运行fn，在第cut步切断电源，cut为0时不切断。
+ * 每次上电都重新初始化，与写flash线程启动时一样。
+ */
+static uint8_t power_run(struct firmware_opt_t *opt, uint8_t (*fn)(struct firmware_opt_t *), uint32_t cut, uint8_t *status)
+{
+	step_count = 0;
+	step_cut = cut;
+	if (setjmp(power_off) != 0) {
+		return POWER_CUT;
+	}
+	firmware_opt_init(opt);
+	*status = fn(opt);
+
+	return POWER_DONE;
+}
+
+static void image_setup(void)
+{
+	uint32_t i;
+
+	initial = malloc(EMU_SIZE);
+	image_old = malloc(APP_SIZE);
+	image_new = malloc(APP_SIZE);
+	if (initial == NULL || image_old == NULL || image_new == NULL) {
+		exit(1);
+	}
+
+	for (i = 0; i < APP_SIZE; i++) {
+		image_old[i] = (uint8_t)rand_next();
+	}
+	memset(image_new, 0xFF, APP_SIZE);
+	for (i = 0; i < TEST_IMAGE_SIZE; i++) {
+		image_new[i] = (i / FLASH_SECTOR_SIZE == 1) ? image_old[i] : (uint8_t)rand_next();
+	}
+
+	memset(initial, 0xFF, EMU_SIZE);
+	memcpy(initial + (BOOTLOADER_FIRMWARE_BASE - EMU_BASE), image_new, TEST_IMAGE_SIZE);
+	memcpy(initial + (APP_BASE - EMU_BASE), image_old, APP_SIZE);
+}
+
+struct trial_result_t {
+	uint32_t kept_old;		// app区域仍为旧镜像
+	uint32_t applied_new;	// app区域为新镜像
+	uint32_t recovered;		// 上电后由recover继续完成
+	uint32_t torn_app;		// 切断在app区域，恢复时重写了被中断的扇区
+};
+
+// 第cut步切断复制，恢复直到完成后检查app区域，返回非0表示失败
+static int trial(uint32_t cut, uint32_t total, struct trial_result_t *result)
+{
+	struct firmware_opt_t opt;
+	const uint8_t *app = flash + (APP_BASE - EMU_BASE);
+	uint8_t status = FIRMWARE_OPT_SUCCESS;
+	uint8_t recovered = 0;
+	uint32_t torn;
+
+	// 每步使用自己的随机序列，单独测试一步时结果相同
+	rand_state = 0x2545F491u ^ (cut * 0x9E3779B9u);
+	if (rand_state == 0) {
+		rand_state = 1;
+	}
+	memcpy(flash, initial, EMU_SIZE);
+	memset(emu_torn, 0, sizeof(emu_torn));
+	if (power_run(&opt, run_copy, cut, &status) != POWER_CUT) {
+		printf("FAIL: step %u: copy finished without reaching the cut\n", cut);
+		return 1;
+	}
+	torn = cut_addr;
+
+	// 第一次恢复中再切断一次，之后的上电直到恢复完成
+	if (power_run(&opt, run_recover, 1 + rand_next() % total, &status) == POWER_DONE) {
+		recovered |= (status == FIRMWARE_OPT_WRITE_CPLT);
+	} else if (power_run(&opt, run_recover, 0, &status) == POWER_DONE) {
+		recovered |= (status == FIRMWARE_OPT_WRITE_CPLT);
+	}
+	if (status != FIRMWARE_OPT_SUCCESS && status != FIRMWARE_OPT_WRITE_CPLT) {
+		printf("FAIL: step %u: recover returned %u\n", cut, status);
+		return 1;
+	}
+	// 恢复完成后再上电，不能再次写入app区域
+	power_run(&opt, run_recover, 0, &status);
+	if (status != FIRMWARE_OPT_SUCCESS || step_count != 0) {
+		printf("FAIL: step %u: recover runs again after it completed (%u steps)\n", cut, step_count);
+		return 1;
+	}
+
+	if (memcmp(app, image_new, APP_SIZE) == 0) {
+		result->applied_new++;
+		result->recovered += recovered;
+		result->torn_app += (torn >= APP_BASE);
+	} else if (memcmp(app, image_old, APP_SIZE) == 0 && !recovered) {
+		result->kept_old++;
+	} else {
+		printf("FAIL: step %u (0x%08X): app area is neither the old nor the new image\n", cut, torn);
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct firmware_opt_t opt;
+	struct trial_result_t result = {0};
+	uint8_t status = FIRMWARE_OPT_SUCCESS;
+	uint32_t total;
+	uint32_t first = 1;
+	uint32_t last;
+	uint32_t cut;
+	int fail = 0;
+
+	if (mmap((void *)EMU_BASE, EMU_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) != (void *)EMU_BASE) {
+		printf("cannot map the emulated flash at 0x%08X\n", EMU_BASE);
+		return 1;
+	}
+	image_setup();
+
+	// 不切断时完整复制一次，得到总步数
+	memcpy(flash, initial, EMU_SIZE);
+	if (power_run(&opt, run_copy, 0, &status) != POWER_DONE || status != FIRMWARE_OPT_WRITE_CPLT ||
+		memcmp(flash + (APP_BASE - EMU_BASE), image_new, APP_SIZE) != 0) {
+		printf("FAIL: uninterrupted copy\n");
+		return 1;
+	}
+	total = step_count;
+	last = total;
+	if (argc > 1) {
+		first = last = (uint32_t)strtoul(argv[1], NULL, 0);
+	}
+
+	for (cut = first; cut <= last && cut <= total; cut++) {
+		fail |= trial(cut, total, &result);
+	}
+	if (emu_error != 0) {
+		printf("FAIL: %u erase/program requests outside the firmware and app areas\n", emu_error);
+		fail = 1;
+	}
+	// 每条路径都要覆盖到：记录之前切断保留旧镜像，之后切断由COPYING记录继续，并重写被中断的扇区，
+	// 恢复时读到写了一半的flash字先由ECC检查发现
+	if (argc <= 1 && (result.kept_old == 0 || result.recovered == 0 || result.torn_app == 0 || ecc_reported == 0)) {
+		printf("FAIL: not every recovery path was exercised\n");
+		fail = 1;
+	}
+
+	printf("%u steps: %u kept the old image, %u applied the new image "
+		   "(%u finished by recover, %u after a torn app sector), %u ECC errors skipped\n",
+		   total, result.kept_old, result.applied_new, result.recovered, result.torn_app, ecc_reported);
+	printf(fail ? "FAILED\n" : "PASSED\n");
+	return fail;
+}
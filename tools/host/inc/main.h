@@ -0,0 +1,24 @@
+#ifndef __MAIN_H
+#define __MAIN_H
+
+/*
+ * 主机构建用的main.h，代替Core/Inc/main.h
+ * 只提供Bsp中可以在主机上编译的模块所需的标准头文件，不包含HAL；
+ * firmware_opt等按flash布局计算地址的模块还需要下面几个HAL中的常量
+ */
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define FLASH_SECTOR_SIZE					0x00020000UL	// 128KB
+#define FLASH_NB_32BITWORD_IN_FLASHWORD		8U				// 一个flash字为256位
+
+// 主机上的"flash"是普通内存，没有cache需要维护
+#define SCB_InvalidateDCache_by_Addr(addr, size)	((void)(addr), (void)(size))
+
+// 编译Threads中的模块时用到，由测试自己实现
+uint32_t HAL_GetTick(void);
+void sleep_ms(uint32_t ms);
+
+#endif
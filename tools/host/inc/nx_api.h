@@ -0,0 +1,24 @@
+#ifndef NX_API_H
+#define NX_API_H
+
+/*
+ * 主机构建用的nx_api.h，只提供Threads/src/thread_log.c等用到的NetX Duo类型和常量，
+ * 主机上没有IP实例，发送函数由测试自己实现
+ */
+#include "tx_api.h"
+
+#define NX_SUCCESS				0x00
+#define NX_OVERFLOW				0x03
+#define NX_NOT_CONNECTED		0x38
+#define NX_FALSE				0
+#define NX_TRUE					1
+
+typedef struct NX_IP_STRUCT {
+	ULONG nx_ip_id;
+} NX_IP;
+
+typedef struct NX_PACKET_POOL_STRUCT {
+	ULONG nx_packet_pool_id;
+} NX_PACKET_POOL;
+
+#endif
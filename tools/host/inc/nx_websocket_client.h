@@ -0,0 +1,10 @@
+#ifndef NX_WEBSOCKET_CLIENT_H
+#define NX_WEBSOCKET_CLIENT_H
+
+/* 主机构建用的nx_websocket_client.h，只提供thread_ws.h中ws_send用到的帧类型 */
+#include "nx_api.h"
+
+#define NX_WEBSOCKET_OPCODE_TEXT_FRAME		0x01
+#define NX_WEBSOCKET_OPCODE_BINARY_FRAME	0x02
+
+#endif
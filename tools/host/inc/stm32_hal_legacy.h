@@ -0,0 +1 @@
+/* 主机构建用的空文件，internal_flash.h包含它，主机上不需要HAL的兼容定义 */
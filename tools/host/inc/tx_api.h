@@ -0,0 +1,22 @@
+#ifndef TX_API_H
+#define TX_API_H
+
+/*
+ * 主机构建用的tx_api.h，只提供Bsp和Threads头文件中出现的ThreadX类型，
+ * 主机上的测试不创建ThreadX线程，flash_engine等的函数由测试自己实现
+ */
+#include <stdint.h>
+
+typedef unsigned long ULONG;
+typedef unsigned int UINT;
+typedef void VOID;
+
+typedef struct TX_THREAD_STRUCT {
+	ULONG tx_thread_id;
+} TX_THREAD;
+
+typedef struct TX_EVENT_FLAGS_GROUP_STRUCT {
+	ULONG tx_event_flags_group_current;
+} TX_EVENT_FLAGS_GROUP;
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * 二进制日志的往返测试，在主机上运行
+ * Threads/src/thread_log.c按LOG_BINARY=1编译，用iap_log记录一组覆盖各种参数的日志，
+ * 从日志环取出的记录按日志线程发送的格式拼成字节流写入stream，
+ * 同时用printf格式化同样的日志写入expected。
+ * log_binary_test.cmake再用tools/log_decode.py对照本程序的ELF解码stream，与expected比较。
+ * 格式串的id是地址的低16位，本程序不能编译为位置无关的可执行文件。
+ * 用法: log_binary_test stream.bin expected.txt
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "thread_log.h"
+
+#define TEST_SLOTS			64u
+
+struct log_ring_t log_ring;
+ULONG ip0_address = 0xC0A8010Au;
+
+static struct log_ring_slot_t slots[TEST_SLOTS];
+static uint32_t tick = 1000u;
+static FILE *stream;
+static FILE *expected;
+static uint32_t fail;
+
+// 每条日志的时间戳不同，检查解码出的时间
+uint32_t HAL_GetTick(void)
+{
+	return tick;
+}
+
+void sleep_ms(uint32_t ms)
+{
+	tick += ms;
+}
+
+// 日志线程的发送函数，本测试不运行日志线程
+void tcp_log_send(VOID *data, ULONG len)
+{
+	(void)data;
+	(void)len;
+}
+
+// 取出环中的记录写入stream，与日志线程拼成的批次相同
+static void drain(void)
+{
+	uint8_t record[LOG_RING_DATA_SIZE];
+	uint32_t len;
+
+	while ((len = log_ring.pop(&log_ring, record, sizeof(record))) > 0) {
+		fwrite(record, 1, len, stream);
+	}
+	if (log_ring.dropped != 0) {
+		printf("FAIL: %u records dropped\n", log_ring.dropped);
+		fail++;
+	}
+}
+
+// 同一条日志分别按二进制记录和printf输出，每条之后时间前进
+#define LOG_CASE(format, ...) do { \
+		iap_log(format, ##__VA_ARGS__); \
+		fprintf(expected, "[%u ms] " format "\n", tick, ##__VA_ARGS__); \
+		tick += 7u; \
+	} while (0)
+
+int main(int argc, char *argv[])
+{
+	const char *name = "firmware.bin";
+	char host[16] = "10.0.0.2";
+	ULONG offset = 0x08040000ul;
+	uint32_t i;
+
+	if (argc < 3) {
+		printf("usage: log_binary_test stream.bin expected.txt\n");
+		return 1;
+	}
+	stream = fopen(argv[1], "wb");
+	expected = fopen(argv[2], "w");
+	if (stream == NULL || expected == NULL || log_ring_init(&log_ring, slots, TEST_SLOTS) != LOG_RING_SUCCESS) {
+		printf("cannot open %s or %s\n", argv[1], argv[2]);
+		return 1;
+	}
+
+	LOG_CASE("boot");
+	LOG_CASE("100%% done");
+	LOG_CASE("frame at %lu", offset);
+	LOG_CASE("status %d", -5);
+	LOG_CASE("crc %08X, size %u", 0x1234ABCDu, 389120u);
+	LOG_CASE("file %s", name);
+	LOG_CASE("client %s:%u refused, %s", host, 7000u, "busy");
+	LOG_CASE("%-4d|%5s|%x|%c", 42, "ab", 0xBEEFu, 'Z');
+	LOG_CASE("empty string '%s' then %u", "", 3u);
+	drain();
+
+	// 一批接近日志环容量的记录，时间戳和参数逐条变化
+	for (i = 0; i < TEST_SLOTS; i++) {
+		LOG_CASE("batch %u of %u, %s", i, TEST_SLOTS, (i & 1u) ? "odd" : "even");
+	}
+	drain();
+
+	fclose(stream);
+	fclose(expected);
+	return fail != 0;
+}
@@ -0,0 +1,25 @@
+# 二进制日志往返测试的驱动脚本，由ctest以cmake -P运行
+# 参数: TEST_EXE 测试程序，DECODER tools/log_decode.py，PYTHON 解释器，WORK_DIR 输出目录
+set(stream ${WORK_DIR}/log_binary_stream.bin)
+set(expected ${WORK_DIR}/log_binary_expected.txt)
+
+execute_process(COMMAND ${TEST_EXE} ${stream} ${expected} RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "log_binary_test failed: ${result}")
+endif()
+
+# 解码器从标准输入读取日志流，格式串从测试程序的ELF中取
+execute_process(COMMAND ${PYTHON} ${DECODER} ${TEST_EXE} -
+    INPUT_FILE ${stream}
+    OUTPUT_VARIABLE decoded
+    ERROR_VARIABLE errors
+    RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "log_decode.py failed: ${result}\n${errors}")
+endif()
+
+file(READ ${expected} want)
+if(NOT decoded STREQUAL want)
+    message(FATAL_ERROR "decoded log differs\n--- expected\n${want}--- decoded\n${decoded}")
+endif()
+message(STATUS "log_binary round trip PASSED")
@@ -0,0 +1,196 @@
+/*
+ * 日志环的多线程压力测试，在主机上运行
+ * 四个生产者线程同时向Bsp/src/log_ring.c写入，一个消费者线程同时取出，
+ * 环很小时生产者频繁替消费者丢弃最旧的一条，与消费者争抢同一个槽。
+ * 每条记录带生产者编号、序号和由二者决定的内容，长度不定，部分超长被截断。
+ * 检查：取出的每条记录完整，同一生产者的序号递增，
+ * 取出的条数加上dropped等于写入的条数。
+ * 用法: log_ring_test [count]   count为每个生产者写入的条数
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "log_ring.h"
+
+#define TEST_PRODUCERS		4u
+#define TEST_COUNT			200000u
+#define TEST_HEADER			5u		// 生产者编号1字节，序号4字节
+
+struct test_run_t {
+	struct log_ring_t ring;
+	uint32_t count;					// 每个生产者写入的条数
+	uint32_t pace;					// 生产者每写入这么多条让出一次CPU，0表示不让出
+	uint32_t done;					// 已结束的生产者数
+	uint32_t received;				// 消费者取出的条数
+	uint32_t errors;
+};
+
+struct test_producer_t {
+	struct test_run_t *run;
+	uint8_t id;
+};
+
+// 记录的长度由生产者和序号决定，约八分之一超过LOG_RING_DATA_SIZE
+static uint32_t record_len(uint8_t id, uint32_t seq)
+{
+	return TEST_HEADER + (seq * 7u + id * 13u) % (LOG_RING_DATA_SIZE + 16u - TEST_HEADER);
+}
+
+static uint8_t record_byte(uint8_t id, uint32_t seq, uint32_t i)
+{
+	return (uint8_t)(seq * 31u + id * 17u + i);
+}
+
+static void *producer_entry(void *arg)
+{
+	struct test_producer_t *p = arg;
+	struct test_run_t *run = p->run;
+	uint8_t record[LOG_RING_DATA_SIZE + 16u];
+	uint32_t seq;
+	uint32_t len;
+	uint32_t i;
+
+	for (seq = 0; seq < run->count; seq++) {
+		len = record_len(p->id, seq);
+		record[0] = p->id;
+		memcpy(&record[1], &seq, sizeof(seq));
+		for (i = TEST_HEADER; i < len; i++) {
+			record[i] = record_byte(p->id, seq, i);
+		}
+		run->ring.push(&run->ring, record, len);
+		if (run->pace != 0 && seq % run->pace == 0) {
+			sched_yield();
+		}
+	}
+	__atomic_fetch_add(&run->done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+// 检查一条取出的记录，返回0表示正确
+static uint32_t record_check(const uint8_t *record, uint32_t len, uint32_t *next)
+{
+	uint32_t expect;
+	uint32_t seq;
+	uint32_t i;
+	uint8_t id;
+
+	if (len < TEST_HEADER || record[0] >= TEST_PRODUCERS) {
+		printf("FAIL: record of %u bytes from producer %u\n", len, len > 0 ? record[0] : 0);
+		return 1;
+	}
+	id = record[0];
+	memcpy(&seq, &record[1], sizeof(seq));
+	if (seq < next[id]) {
+		printf("FAIL: producer %u: seq %u after %u\n", id, seq, next[id] - 1);
+		return 1;
+	}
+	next[id] = seq + 1;
+
+	expect = record_len(id, seq);
+	if (expect > LOG_RING_DATA_SIZE) {
+		expect = LOG_RING_DATA_SIZE;
+	}
+	if (len != expect) {
+		printf("FAIL: producer %u seq %u: %u bytes, expected %u\n", id, seq, len, expect);
+		return 1;
+	}
+	for (i = TEST_HEADER; i < len; i++) {
+		if (record[i] != record_byte(id, seq, i)) {
+			printf("FAIL: producer %u seq %u: byte %u torn\n", id, seq, i);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void *consumer_entry(void *arg)
+{
+	struct test_run_t *run = arg;
+	uint8_t record[LOG_RING_DATA_SIZE];
+	uint32_t next[TEST_PRODUCERS] = {0};
+	uint32_t done;
+	uint32_t len;
+
+	while (1) {
+		// 先读结束的生产者数再取，取空时所有写入都已经可见
+		done = __atomic_load_n(&run->done, __ATOMIC_ACQUIRE);
+		len = run->ring.pop(&run->ring, record, sizeof(record));
+		if (len == 0) {
+			if (done == TEST_PRODUCERS) {
+				break;
+			}
+			// 与固件中日志线程取空后休眠一样，环为空时让出CPU
+			sched_yield();
+			continue;
+		}
+		run->received++;
+		run->errors += record_check(record, len, next);
+	}
+
+	return NULL;
+}
+
+// 用slots个槽的环跑一轮，返回失败数
+static uint32_t test_run(uint32_t slots, uint32_t count, uint32_t pace)
+{
+	static struct log_ring_slot_t slot[1024];
+	struct test_producer_t producer[TEST_PRODUCERS];
+	pthread_t thread[TEST_PRODUCERS + 1];
+	struct test_run_t run;
+	uint32_t total = TEST_PRODUCERS * count;
+	uint32_t i;
+
+	memset(&run, 0, sizeof(run));
+	run.count = count;
+	run.pace = pace;
+	if (slots > sizeof(slot) / sizeof(slot[0]) ||
+		log_ring_init(&run.ring, slot, slots) != LOG_RING_SUCCESS) {
+		printf("FAIL: log_ring_init(%u)\n", slots);
+		return 1;
+	}
+
+	pthread_create(&thread[TEST_PRODUCERS], NULL, consumer_entry, &run);
+	for (i = 0; i < TEST_PRODUCERS; i++) {
+		producer[i].run = &run;
+		producer[i].id = i;
+		pthread_create(&thread[i], NULL, producer_entry, &producer[i]);
+	}
+	for (i = 0; i <= TEST_PRODUCERS; i++) {
+		pthread_join(thread[i], NULL);
+	}
+
+	if (run.received + run.ring.dropped != total) {
+		printf("FAIL: %u slots: %u received + %u dropped != %u written\n",
+			   slots, run.received, run.ring.dropped, total);
+		run.errors++;
+	}
+	if (run.received == 0) {
+		printf("FAIL: %u slots: nothing received\n", slots);
+		run.errors++;
+	}
+	printf("%4u slots: %u written, %u received, %u dropped\n",
+		   slots, total, run.received, run.ring.dropped);
+
+	return run.errors;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t count = TEST_COUNT;
+	uint32_t fail = 0;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 0);
+	}
+
+	// 小环几乎每次写入都要丢弃最旧的一条；生产者让出CPU时消费者跟得上，主要测试并发的写入和取出
+	fail += test_run(2, count, 0);
+	fail += test_run(8, count, 0);
+	fail += test_run(64, count, 8);
+	fail += test_run(1024, count, 1);
+
+	printf(fail ? "FAILED\n" : "PASSED\n");
+	return fail != 0;
+}
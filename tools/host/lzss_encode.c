@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include "lzss_encode.h"
+
+#define HASH_BITS	16u
+#define HASH_SIZE	(1u << HASH_BITS)
+#define HASH_CHAIN	64u		// 每个位置最多比较的候选数
+#define NO_POS		UINT32_MAX
+
+struct bit_writer_t {
+	uint8_t *out;
+	size_t capacity;
+	size_t pos;
+	uint8_t acc;
+	uint8_t have;
+	uint8_t overflow;
+};
+
+static void put_bits(struct bit_writer_t *w, uint32_t value, uint8_t bits)
+{
+	while (bits > 0) {
+		bits--;
+		w->acc = (uint8_t)((w->acc << 1) | ((value >> bits) & 0x01));
+		if (++w->have < 8) {
+			continue;
+		}
+		if (w->pos < w->capacity) {
+			w->out[w->pos++] = w->acc;
+		} else {
+			w->overflow = 1;
+		}
+		w->acc = 0;
+		w->have = 0;
+	}
+}
+
+static uint32_t hash3(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2]) * 2654435761u >> (32u - HASH_BITS);
+}
+
+size_t lzss_encode(const uint8_t *in, size_t len, uint8_t window_bits, uint8_t lookahead_bits,
+		uint8_t *out, size_t capacity)
+{
+	struct bit_writer_t w = {out, capacity, 0, 0, 0, 0};
+	uint32_t window = 1u << window_bits;
+	uint32_t max_count = 1u << lookahead_bits;
+	// 引用比逐个字面量更短时才使用
+	uint32_t min_count = (1u + window_bits + lookahead_bits) / 9u + 1u;
+	uint32_t *head;
+	uint32_t *prev;
+	uint32_t best_len;
+	uint32_t best_off;
+	uint32_t cand;
+	uint32_t n;
+	uint32_t limit;
+	uint32_t chain;
+	size_t pos = 0;
+	size_t i;
+
+	head = malloc(HASH_SIZE * sizeof(uint32_t));
+	prev = malloc((len + 1) * sizeof(uint32_t));
+	if (head == NULL || prev == NULL) {
+		free(head);
+		free(prev);
+		return 0;
+	}
+	for (i = 0; i < HASH_SIZE; i++) {
+		head[i] = NO_POS;
+	}
+
+	while (pos < len) {
+		best_len = 0;
+		best_off = 0;
+		if (pos + 3 <= len) {
+			limit = len - pos < max_count ? (uint32_t)(len - pos) : max_count;
+			cand = head[hash3(&in[pos])];
+			for (chain = 0; cand != NO_POS && pos - cand <= window && chain < HASH_CHAIN; chain++) {
+				for (n = 0; n < limit && in[cand + n] == in[pos + n]; n++) {
+				}
+				if (n > best_len) {
+					best_len = n;
+					best_off = (uint32_t)(pos - cand);
+				}
+				cand = prev[cand];
+			}
+		}
+
+		if (best_len >= min_count) {
+			put_bits(&w, 0, 1);
+			put_bits(&w, best_off - 1, window_bits);
+			put_bits(&w, best_len - 1, lookahead_bits);
+		} else {
+			best_len = 1;
+			put_bits(&w, 1, 1);
+			put_bits(&w, in[pos], 8);
+		}
+
+		// 引用覆盖的每个位置都加入哈希链
+		for (n = 0; n < best_len; n++, pos++) {
+			if (pos + 3 <= len) {
+				i = hash3(&in[pos]);
+				prev[pos] = head[i];
+				head[i] = (uint32_t)pos;
+			}
+		}
+	}
+	// 最后一个字节用0填充
+	if (w.have > 0) {
+		put_bits(&w, 0, (uint8_t)(8 - w.have));
+	}
+
+	free(head);
+	free(prev);
+
+	return w.overflow ? 0 : w.pos;
+}
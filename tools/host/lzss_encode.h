@@ -0,0 +1,17 @@
+#ifndef __LZSS_ENCODE_H
+#define __LZSS_ENCODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * 参考压缩器，输出heatshrink格式的LZSS码流，与Bsp/src/decompress.c对应：
+ *   1 + 8bit                          字面量
+ *   0 + window_bits + lookahead_bits  回溯引用，偏移和长度均按减1编码
+ * 贪心匹配，引用只指向已输出的数据，不使用窗口初始的0。
+ * 返回码流字节数，out空间不足时返回0。
+ */
+size_t lzss_encode(const uint8_t *in, size_t len, uint8_t window_bits, uint8_t lookahead_bits,
+		uint8_t *out, size_t capacity);
+
+#endif
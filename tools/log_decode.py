@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+# 解码二进制日志（LOG_BINARY=1），格式见Threads/inc/thread_log.h
+# 用法: log_decode.py firmware.elf host[:port]   从控制端口读取日志，缺省端口7002
+#       log_decode.py firmware.elf -             从标准输入读取抓下来的日志流
+import re
+import socket
+import struct
+import sys
+
+CONTROL_PORT = 7002
+
+# C的长度修饰符去掉，%u按无符号、%d按有符号解释32位参数
+C_SPEC = re.compile(r'%([-+ #0]*\d*(?:\.\d+)?)(?:hh|h|ll|l|z)?([diouxXcs%])')
+
+
+def logstr_section(path):
+    elf = open(path, 'rb').read()
+    if elf[:4] != b'\x7fELF':
+        sys.exit('%s is not an ELF file' % path)
+    if elf[4] == 1:
+        shoff, = struct.unpack_from('<I', elf, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from('<3H', elf, 0x2E)
+        header = lambda i: struct.unpack_from('<2I4x3I', elf, shoff + i * shentsize)
+    else:
+        shoff, = struct.unpack_from('<Q', elf, 0x28)
+        shentsize, shnum, shstrndx = struct.unpack_from('<3H', elf, 0x3A)
+        header = lambda i: struct.unpack_from('<2I8x3Q', elf, shoff + i * shentsize)
+    _, _, _, names, _ = header(shstrndx)
+    for i in range(shnum):
+        name, _, addr, offset, size = header(i)
+        if elf[names + name:elf.index(b'\0', names + name)] == b'.logstr':
+            return addr, elf[offset:offset + size]
+    sys.exit('no .logstr section in %s' % path)
+
+
+# 记录中的id是格式串地址的低16位，段在链接脚本中放在地址0
+def format_string(section, fid):
+    addr, table = section
+    start = (fid - addr) & 0xFFFF
+    return table[start:table.index(b'\0', start)].decode('utf-8', 'replace')
+
+
+def render(fmt, payload):
+    args = []
+    pos = 0
+    for flags, conv in C_SPEC.findall(fmt):
+        if conv == '%':
+            continue
+        if conv == 's':
+            n = payload[pos]
+            args.append(payload[pos + 1:pos + 1 + n].decode('utf-8', 'replace'))
+            pos += 1 + n
+        elif pos + 4 <= len(payload):
+            value, = struct.unpack_from('<I', payload, pos)
+            if conv in 'di' and value >= 1 << 31:
+                value -= 1 << 32
+            args.append(value)
+            pos += 4
+        else:
+            args.append('?')
+    py = C_SPEC.sub(lambda m: '%' + m.group(1) + ('d' if m.group(2) in 'iu' else m.group(2)), fmt)
+    try:
+        return py % tuple(args)
+    except (TypeError, ValueError):
+        return fmt + ' ' + repr(args)
+
+
+def records(stream):
+    buf = b''
+    while True:
+        chunk = stream()
+        if not chunk:
+            return
+        buf += chunk
+        while len(buf) >= 8:
+            length, fid, time = struct.unpack_from('<2HI', buf)
+            if length < 8:
+                sys.exit('lost sync')
+            if len(buf) < length:
+                break
+            yield fid, time, buf[8:length]
+            buf = buf[length:]
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit('usage: log_decode.py firmware.elf host[:port]|-')
+    table = logstr_section(sys.argv[1])
+    if sys.argv[2] == '-':
+        stream = lambda: sys.stdin.buffer.read1(4096)
+    else:
+        host, _, port = sys.argv[2].partition(':')
+        conn = socket.create_connection((host, int(port or CONTROL_PORT)))
+        stream = lambda: conn.recv(4096)
+    for fid, time, payload in records(stream):
+        print('[%d ms] %s' % (time, render(format_string(table, fid), payload)), flush=True)
+
+
+if __name__ == '__main__':
+    main()